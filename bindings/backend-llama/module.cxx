@@ -6,6 +6,7 @@
 
 #include "autocog/codec/json.hxx"
 #include "autocog/data/store.hxx"
+#include "autocog/utilities/exception.hxx"
 
 #include "autocog/build_info.hxx"
 
@@ -13,15 +14,126 @@
 #include "errors.hxx"
 #include <pybind11/stl.h>
 
+#include <deque>
 #include <functional>
+#include <iterator>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <optional>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <unistd.h>
 
 namespace py    = pybind11;
 namespace data  = autocog::data;
 namespace codec = autocog::codec;
 
+namespace {
+
+using autocog::backend::llama::EvalID;
+using autocog::backend::llama::ModelID;
+using autocog::backend::llama::NodeEvent;
+
+// A NodeEvent kept until the next stream_step hands it to Python. Nodes live
+// in the evaluation's tree, which only grows, so the pointer stays valid.
+struct StreamEvent {
+  data::FTTNode const * node;
+  std::vector<unsigned> path;
+  bool leaf;
+  std::vector<unsigned> best;
+  std::string best_text;
+  bool best_complete;
+};
+
+// A streaming evaluation (stream_start .. stream_finish): the FTA it was
+// started from (held, so releasing its handle meanwhile is safe) and the events
+// reported since the last step.
+struct Stream {
+  ModelID model;
+  std::shared_ptr<data::FTA const> fta;
+  data::FTTNode const * root{nullptr};
+  std::vector<StreamEvent> events;
+};
+
+std::mutex streams_mutex;
+std::unordered_map<EvalID, std::shared_ptr<Stream>> streams;
+
+std::shared_ptr<Stream> get_stream(EvalID eval_id) {
+  std::lock_guard<std::mutex> guard(streams_mutex);
+  auto it = streams.find(eval_id);
+  if (it == streams.end())
+    throw autocog::utilities::InternalError("Invalid stream: " + std::to_string(eval_id));
+  return it->second;
+}
+
+// Asynchronous evaluations (evaluate_async): the Manager's workers report
+// each one here, then write a byte to `wakeup_fds[1]` so that an event loop
+// watching `wakeup_fds[0]` calls async_results.
+struct AsyncResult {
+  EvalID handle;
+  std::string status;   // "done", "cancelled" or "failed"
+  std::string value;    // FTT handle, or error message
+};
+
+std::mutex async_mutex;
+std::deque<AsyncResult> async_results;
+int wakeup_fds[2] = {-1, -1};
+
+int wakeup_fd() {
+  std::lock_guard<std::mutex> guard(async_mutex);
+  if (wakeup_fds[0] < 0) {
+    if (::pipe(wakeup_fds) != 0)
+      throw autocog::utilities::InternalError("Cannot create the async wakeup pipe");
+    for (int fd : wakeup_fds) {
+      ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+      ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+  }
+  return wakeup_fds[0];
+}
+
+void push_async_result(AsyncResult result) {
+  std::lock_guard<std::mutex> guard(async_mutex);
+  async_results.push_back(std::move(result));
+  char const byte = 1;
+  [[maybe_unused]] auto n = ::write(wakeup_fds[1], &byte, 1);  // a full pipe already wakes the reader
+}
+
+// Text of the path from the root down `path`.
+std::string path_text(data::FTTNode const & root, std::vector<unsigned> const & path) {
+  std::string text = root.text;
+  data::FTTNode const * node = &root;
+  for (unsigned i : path) {
+    node = &*std::next(node->children.begin(), i);
+    text += node->text;
+  }
+  return text;
+}
+
+py::dict event_to_dict(StreamEvent const & event) {
+  data::FTTNode const & node = *event.node;
+  py::dict result;
+  result["uid"]      = node.uid ? py::cast(*node.uid) : py::none();
+  result["action"]   = node.action;
+  result["text"]     = node.text;
+  result["tokens"]   = node.tokens;
+  result["logprob"]  = node.logprob;
+  result["length"]   = node.length;
+  result["pruned"]   = node.pruned;
+  result["path"]     = event.path;
+  result["leaf"]     = event.leaf;
+  py::dict best;
+  best["path"]     = event.best;
+  best["text"]     = event.best_text;
+  best["complete"] = event.best_complete;
+  result["best"] = best;
+  return result;
+}
+
+}
+
 PYBIND11_MODULE(backend_llama_cxx, module) {
     using namespace autocog::backend::llama;
 
@@ -37,16 +149,30 @@ PYBIND11_MODULE(backend_llama_cxx, module) {
     module.def("build_info", &autocog::build_info, "Build configuration info");
 
     module.def("create",
-        [](std::string const & model_path, int n_ctx) {
-            return Manager::add_model(model_path, n_ctx);
+        [](std::string const & model_path, int n_ctx, unsigned n_batch, unsigned n_ubatch, int n_threads) {
+            ModelConfig config;
+            config.n_batch = n_batch;
+            config.n_ubatch = n_ubatch;
+            config.n_threads = n_threads;
+            return Manager::add_model(model_path, n_ctx, config);
         },
-        "Load a GGUF model and return a ModelID",
+        "Load a GGUF model and return a ModelID. n_batch (tokens per decode "
+        "call, i.e. prefill chunk), n_ubatch (micro-batch) and n_threads keep "
+        "llama.cpp's defaults when 0.",
         py::arg("model_path"),
-        py::arg("n_ctx") = 4096
+        py::arg("n_ctx") = 4096,
+        py::arg("n_batch") = 0,
+        py::arg("n_ubatch") = 0,
+        py::arg("n_threads") = 0
     );
 
+    // Model locks are only ever taken without the GIL: a thread holding one may
+    // need the GIL to log (see python_sink.hxx).
+
     module.def("set_seed",
         [](ModelID model, unsigned seed) {
+            py::gil_scoped_release release;
+            auto lock = Manager::lock_model(model);
             Manager::get_model(model).set_seed(seed);
         },
         "Set the RNG seed for a model",
@@ -58,6 +184,68 @@ PYBIND11_MODULE(backend_llama_cxx, module) {
         return Manager::get_model(model).vocab_size();
     }, "Get vocabulary size");
 
+    module.def("prefix_cache_stats",
+        [](ModelID model) {
+            auto const stats = [model] {
+                py::gil_scoped_release release;
+                auto lock = Manager::lock_model(model);
+                return Manager::get_model(model).prefix_cache_stats();
+            }();
+            py::dict result;
+            result["hits"]          = stats.hits;
+            result["misses"]        = stats.misses;
+            result["reused_tokens"] = stats.reused_tokens;
+            result["entries"]       = stats.entries;
+            result["tokens"]        = stats.tokens;
+            result["budget"]        = stats.budget;
+            return result;
+        },
+        "Hit/miss counters and occupancy of the model's KV prefix cache",
+        py::arg("model")
+    );
+
+    module.def("set_mask_cache",
+        [](ModelID model, std::string const & dir) {
+            py::gil_scoped_release release;
+            auto lock = Manager::lock_model(model);
+            Manager::get_model(model).set_mask_cache(dir);
+        },
+        "Persist the model's vocab masks under `dir` (keyed by the model's "
+        "SHA-256); an empty `dir` disables it. Call before evaluating.",
+        py::arg("model"),
+        py::arg("dir")
+    );
+
+    module.def("prewarm",
+        [](ModelID model, std::string const & sta_id) {
+            py::gil_scoped_release release;
+            prewarm(model, *data::datastore().sta.get(sta_id));
+        },
+        "Start building (or loading) the vocab masks of a stored STA (by handle) "
+        "in the background.",
+        py::arg("model"),
+        py::arg("sta_id")
+    );
+
+    module.def("prefill_stats",
+        [](ModelID model) {
+            auto const stats = [model] {
+                py::gil_scoped_release release;
+                auto lock = Manager::lock_model(model);
+                return Manager::get_model(model).prefill_stats();
+            }();
+            py::dict result;
+            result["tokens"]            = stats.tokens;
+            result["chunks"]            = stats.chunks;
+            result["seconds"]           = stats.seconds;
+            result["tokens_per_second"] = stats.tokens_per_second();
+            return result;
+        },
+        "Tokens prefilled by the model, in how many decode calls, and the "
+        "resulting throughput",
+        py::arg("model")
+    );
+
     module.def("tokenize",
         [](ModelID model, std::string const & text, bool add_bos, bool special) {
             auto tokens = Manager::get_model(model).tokenize(text, add_bos, special);
@@ -76,6 +264,7 @@ PYBIND11_MODULE(backend_llama_cxx, module) {
         [](ModelID model, py::list const & py_tokens, bool spec_rm, bool spec_unp) {
             TokenSequence tokens;
             for (auto item : py_tokens) tokens.push_back(item.cast<TokenID>());
+            py::gil_scoped_release release;
             return Manager::get_model(model).detokenize(tokens, spec_rm, spec_unp);
         },
         "Detokenize tokens to text",
@@ -85,28 +274,78 @@ PYBIND11_MODULE(backend_llama_cxx, module) {
         py::arg("spec_unp") = false
     );
 
-    module.def("evaluate",
-        [](ModelID model, std::string const & fta_id) -> std::string {
-            // Evaluate the stored FTA, detokenize the resulting FTT with the
-            // model (only possible here, where it is loaded), and hand it to the
-            // store. The Manager's working evaluation is a transient: once the
-            // FTT is materialized we release it (resuming is not implemented).
-            auto const & fta = data::datastore().fta.get(fta_id);
-            EvalID eval_id = Manager::add_eval(model, fta);
-            Manager::advance(eval_id, std::nullopt);
-            data::FTT ftt = Manager::retrieve(eval_id);
+    module.def("score_choices",
+        [](ModelID model, TokenSequence const & context, std::vector<TokenSequence> const & choices, bool batched) {
+            py::gil_scoped_release release;
+            auto lock = Manager::lock_shared_context(model);
+            Model & m = Manager::get_model(model);
+            std::vector<ProbaSequence> logprobs;
+            m.set_tokens(context);
+            if (batched) {
+                m.eval_choices(choices, logprobs);
+            } else {
+                for (TokenSequence const & choice : choices) {
+                    m.set_tokens(context);
+                    m.eval_sequences(choice, logprobs.emplace_back());
+                }
+            }
+            m.set_tokens(context);
+            return logprobs;
+        },
+        "Logprob of every token of each choice given `context` (a non-empty "
+        "token list), as choose actions score them; batched=False scores the "
+        "choices one at a time instead of over their shared-prefix trie.",
+        py::arg("model"),
+        py::arg("context"),
+        py::arg("choices"),
+        py::arg("batched") = true
+    );
+
+    // Detokenize the evaluation's FTT with the model (only possible here, where
+    // it is loaded), hand it to the store, and release the evaluation (also if
+    // this fails): the Manager's working evaluation is a transient (resuming is
+    // not implemented).
+    //
+    // The FTT is a derived artifact: it inherits the FTA's provenance
+    // (sta/syntax/search), adds the FTA itself, and records the evaluating model
+    // by its full GGUF hash. datastore().ftt.add then finalizes it, keying the
+    // store on its content hash.
+    auto store_ftt = [](ModelID model, data::FTA const & fta, EvalID eval_id) -> std::string {
+        data::FTT ftt;
+        try {
+            ftt = Manager::retrieve(eval_id);
             detokenize(model, ftt);
+        } catch (...) {
             Manager::rm_eval(eval_id);
+            throw;
+        }
+        Manager::rm_eval(eval_id);
 
-            // The FTT is a derived artifact: it inherits the FTA's provenance
-            // (sta/syntax/search), adds the FTA itself, and records the
-            // evaluating model by its full GGUF hash. datastore().ftt.add then
-            // finalizes it, keying the store on its content hash.
-            ftt.provenance = fta.provenance;
-            ftt.provenance["fta"]   = fta.metadata ? fta.metadata->hash : std::string{};
+        ftt.provenance = fta.provenance;
+        ftt.provenance["fta"]   = fta.metadata ? fta.metadata->hash : std::string{};
+        {
+            auto lock = Manager::lock_model(model);  // sha256() is cached on first use
             ftt.provenance["model"] = Manager::get_model(model).sha256();
+        }
+
+        return data::datastore().ftt.add(std::make_unique<data::FTT>(std::move(ftt)));
+    };
 
-            return data::datastore().ftt.add(std::make_unique<data::FTT>(std::move(ftt)));
+    module.def("evaluate",
+        [store_ftt](ModelID model, std::string const & fta_id) -> std::string {
+            // Generation runs without the GIL: other Python threads (e.g. the
+            // server's request workers) keep running, and evaluations on other
+            // models proceed in parallel (see Manager::lock_model).
+            py::gil_scoped_release release;
+            auto const fta = data::datastore().fta.get(fta_id);
+            EvalID eval_id = Manager::add_eval(model, *fta);
+            try {
+                Manager::advance(eval_id, std::nullopt);
+            } catch (...) {
+                Manager::rm_eval(eval_id);  // its KV sequences go back to the model
+                throw;
+            }
+            return store_ftt(model, *fta, eval_id);
         },
         "Evaluate a stored FTA (by handle) with a model; detokenizes the FTT and "
         "stores it, returning its handle. Read it back via the runtime-sta FTT "
@@ -114,4 +353,192 @@ PYBIND11_MODULE(backend_llama_cxx, module) {
         py::arg("model"),
         py::arg("fta_id")
     );
+
+    module.def("stream_start",
+        [](ModelID model, std::string const & fta_id) -> EvalID {
+            py::gil_scoped_release release;
+            auto stream = std::make_shared<Stream>();
+            stream->model = model;
+            stream->fta = data::datastore().fta.get(fta_id);
+            EvalID eval_id = Manager::add_eval(model, *stream->fta);
+            stream->root = &Manager::retrieve(eval_id).root;
+            Manager::get_eval(eval_id).on_node([s = stream.get()](NodeEvent const & event) {
+                s->events.push_back(StreamEvent{&event.node, event.path, event.leaf, event.best,
+                                                path_text(*s->root, event.best), event.best_complete});
+            });
+            std::lock_guard<std::mutex> guard(streams_mutex);
+            streams.emplace(eval_id, std::move(stream));
+            return eval_id;
+        },
+        "Start evaluating a stored FTA (by handle) step by step; returns a stream "
+        "handle for stream_step / stream_finish.",
+        py::arg("model"),
+        py::arg("fta_id")
+    );
+
+    module.def("stream_step",
+        [](EvalID eval_id, unsigned max_token_eval) {
+            auto stream = get_stream(eval_id);
+            bool done;
+            {
+                py::gil_scoped_release release;
+                // A step evaluates nothing only once the queue is empty.
+                done = Manager::advance(eval_id, max_token_eval) == 0;
+            }
+            py::list events;
+            for (auto const & event : stream->events) events.append(event_to_dict(event));
+            stream->events.clear();
+            py::dict result;
+            result["events"] = events;
+            result["done"]   = done;
+            return result;
+        },
+        "Advance a stream by about `max_token_eval` tokens (a state is never left "
+        "half-evaluated). Returns {'events': [...], 'done': bool}: one event per "
+        "FTT node grown, with its detokenized text, its path (child indices from "
+        "the root), whether it ends a complete path, and the leading path so far "
+        "('best': its path, text and whether it is complete).",
+        py::arg("stream"),
+        py::arg("max_token_eval") = 16
+    );
+
+    module.def("stream_finish",
+        [store_ftt](EvalID eval_id) -> std::string {
+            auto stream = get_stream(eval_id);
+            {
+                std::lock_guard<std::mutex> guard(streams_mutex);
+                streams.erase(eval_id);
+            }
+            py::gil_scoped_release release;
+            return store_ftt(stream->model, *stream->fta, eval_id);
+        },
+        "Store the stream's FTT (complete if its last step was done) and release "
+        "the stream; returns the FTT handle (see evaluate).",
+        py::arg("stream")
+    );
+
+    module.def("evaluate_async",
+        [store_ftt](ModelID model, std::string const & fta_id, std::optional<unsigned> max_token_eval) -> EvalID {
+            wakeup_fd();
+            py::gil_scoped_release release;
+            // The callback owns the FTA: the evaluation references it until
+            // removed, by the callback or by the worker dropping it (see
+            // Manager::submit), whatever the caller releases meanwhile.
+            auto const fta = data::datastore().fta.get(fta_id);
+            EvalID eval_id = Manager::add_eval(model, *fta);
+            Manager::submit(eval_id, max_token_eval,
+                [store_ftt, model, fta](EvalID id, Manager::Outcome outcome, std::string const & error) {
+                    AsyncResult result{id, {}, {}};
+                    try {
+                        switch (outcome) {
+                            case Manager::Outcome::Done:
+                                result.status = "done";
+                                result.value = store_ftt(model, *fta, id);
+                                break;
+                            case Manager::Outcome::Cancelled:
+                                result.status = "cancelled";
+                                Manager::rm_eval(id);
+                                break;
+                            case Manager::Outcome::Failed:
+                                result.status = "failed";
+                                result.value = error;
+                                Manager::rm_eval(id);
+                                break;
+                        }
+                    } catch (std::exception const & e) {
+                        result.status = "failed";
+                        result.value = e.what();
+                        Manager::rm_eval(id);
+                    }
+                    push_async_result(std::move(result));
+                });
+            return eval_id;
+        },
+        "Evaluate a stored FTA (by handle) on the model's native worker thread, "
+        "batched with the model's other asynchronous evaluations; returns a "
+        "handle at once. Its result is reported by async_results (see "
+        "async_fd). With `max_token_eval`, the evaluation stops after about that "
+        "many tokens and its partial FTT is reported.",
+        py::arg("model"),
+        py::arg("fta_id"),
+        py::arg("max_token_eval") = std::nullopt
+    );
+
+    module.def("evaluate_cancel",
+        [](EvalID handle) {
+            py::gil_scoped_release release;
+            return Manager::cancel(handle);
+        },
+        "Cancel an asynchronous evaluation; it is then reported as 'cancelled' "
+        "(unless it completed first). False if it is no longer in flight.",
+        py::arg("handle")
+    );
+
+    // The workers may need the GIL (logging, stored callbacks): join them while
+    // the interpreter still runs, not from the C atexit handler of cleanup.
+    py::module_::import("atexit").attr("register")(py::cpp_function([]() {
+        py::gil_scoped_release release;
+        Manager::stop_workers();
+    }));
+
+    module.def("async_fd",
+        []() { return wakeup_fd(); },
+        "File descriptor that becomes readable when asynchronous evaluations "
+        "complete (e.g. for asyncio's loop.add_reader); call async_results then.");
+
+    module.def("async_results",
+        []() {
+            std::deque<AsyncResult> results;
+            {
+                std::lock_guard<std::mutex> guard(async_mutex);
+                results.swap(async_results);
+                char buffer[256];
+                while (wakeup_fds[0] >= 0 && ::read(wakeup_fds[0], buffer, sizeof(buffer)) > 0) {}
+            }
+            py::list list;
+            for (auto const & r : results) {
+                py::dict item;
+                item["handle"] = r.handle;
+                item["status"] = r.status;
+                if (r.status == "done") item["ftt"] = r.value;
+                if (r.status == "failed") item["error"] = r.value;
+                list.append(item);
+            }
+            return list;
+        },
+        "Drain the completed asynchronous evaluations: a list of {'handle', "
+        "'status', 'ftt' (if 'done') or 'error' (if 'failed')}. Clears async_fd.");
+
+    module.def("evaluate_batch",
+        [store_ftt](ModelID model, std::vector<std::string> const & fta_ids) {
+            // Continuous batching: the evaluations advance together, their
+            // decode steps sharing llama_decode calls (Manager::advance_all).
+            py::gil_scoped_release release;
+            std::vector<std::shared_ptr<data::FTA const>> ftas;
+            std::vector<EvalID> eval_ids;
+            try {
+                for (auto const & fta_id : fta_ids) {
+                    ftas.push_back(data::datastore().fta.get(fta_id));
+                    eval_ids.push_back(Manager::add_eval(model, *ftas.back()));
+                }
+                Manager::advance_all(eval_ids, std::nullopt);
+            } catch (...) {
+                for (EvalID eval_id : eval_ids) Manager::rm_eval(eval_id);
+                throw;
+            }
+            std::vector<std::string> ftt_ids;
+            try {
+                for (size_t i = 0; i < eval_ids.size(); ++i)
+                    ftt_ids.push_back(store_ftt(model, *ftas[i], eval_ids[i]));
+            } catch (...) {
+                for (EvalID eval_id : eval_ids) Manager::rm_eval(eval_id);  // those not stored yet
+                throw;
+            }
+            return ftt_ids;
+        },
+        "Evaluate several stored FTAs (by handle) together, batching their decode "
+        "steps; returns the FTT handles in the same order (see evaluate).",
+        py::arg("model"),
+        py::arg("fta_ids")
+    );
 }
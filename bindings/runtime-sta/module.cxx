@@ -81,15 +81,15 @@ PYBIND11_MODULE(runtime_sta_cxx, module) {
         py::arg("data"));                                                                    \
     module.def("get_" VERB_TAG,                                                              \
         [](std::string const & id) -> py::object {                                           \
-            return codec::to_py(data::datastore().REG.get(id));                              \
+            return codec::to_py(*data::datastore().REG.get(id));                             \
         }, "Convert a stored " LABEL " to a Python object", py::arg("id"));                  \
     module.def("store_" VERB_TAG,                                                            \
         [](std::string const & id, std::string const & path) {                              \
-            codec::to_file(data::datastore().REG.get(id), path);                            \
+            codec::to_file(*data::datastore().REG.get(id), path);                           \
         }, "Serialize a stored " LABEL " to a JSON file", py::arg("id"), py::arg("path"));   \
     module.def("dump_" VERB_TAG,                                                             \
         [](std::string const & id) -> std::string {                                          \
-            return codec::to_json(data::datastore().REG.get(id)).dump(2);                    \
+            return codec::to_json(*data::datastore().REG.get(id)).dump(2);                   \
         }, "Serialize a stored " LABEL " to a JSON string", py::arg("id"));                  \
     module.def("release_" VERB_TAG,                                                          \
         [](std::string const & id) { data::datastore().REG.release(id); },                  \
@@ -108,18 +108,19 @@ PYBIND11_MODULE(runtime_sta_cxx, module) {
         [](std::string const & program_id, std::string const & prompt_name,
            py::object content, std::string const & syntax_id,
            std::string const & search_id) -> std::string {
-            auto const & program = data::datastore().sta.get(program_id);
-            auto const & syntax  = data::datastore().syntax.get(syntax_id);
-            auto const & search  = data::datastore().search.get(search_id);
+            // Shared handles: a concurrent release cannot free them under us.
+            auto const program = data::datastore().sta.get(program_id);
+            auto const syntax  = data::datastore().syntax.get(syntax_id);
+            auto const search  = data::datastore().search.get(search_id);
 
-            auto it = program.prompts.find(prompt_name);
-            if (it == program.prompts.end())
+            auto it = program->prompts.find(prompt_name);
+            if (it == program->prompts.end())
                 throw autocog::ConfigError(
                     "Prompt '" + prompt_name + "' not found in program", prompt_name);
 
             auto content_doc = to_document(content);
-            std::string sta_uid = program.metadata ? program.metadata->hash : std::string{};
-            auto fta = sta::instantiate(it->second, content_doc, syntax, search, sta_uid);
+            std::string sta_uid = program->metadata ? program->metadata->hash : std::string{};
+            auto fta = sta::instantiate(it->second, content_doc, *syntax, *search, sta_uid);
             return data::datastore().fta.add(std::make_unique<data::FTA>(std::move(fta)));
         },
         "Instantiate an STA prompt into an FTA; returns a handle",
@@ -130,11 +131,11 @@ PYBIND11_MODULE(runtime_sta_cxx, module) {
     module.def("walk_ftt_to_frame",
         [](std::string const & program_id, std::string const & prompt_name,
            std::string const & ftt_id, py::object content) -> py::object {
-            auto const & program = data::datastore().sta.get(program_id);
-            auto const & ftt     = data::datastore().ftt.get(ftt_id);
+            auto const program = data::datastore().sta.get(program_id);
+            auto const ftt     = data::datastore().ftt.get(ftt_id);
             auto content_doc = to_document(content);
             auto frame = sta::walk_ftt_to_frame(
-                ftt, program, prompt_name, content_doc, /*resolve_selects=*/true);
+                *ftt, *program, prompt_name, content_doc, /*resolve_selects=*/true);
             return codec::to_py(frame);
         },
         "Walk a stored FTT (by handle) into the prompt's frame; returns the frame dict",
@@ -0,0 +1,175 @@
+
+#include "autocog/backend/llama/beams.hxx"
+
+#include <algorithm>
+
+namespace autocog::backend::llama {
+
+std::pair<size_t, size_t> RepetitionState::match(TokenID const tok) const {
+  size_t const n = recent.size();
+  size_t best_length = 0, best_distance = 0;
+  for (size_t j = n; j-- > 0;) {
+    size_t const common = recent[j] == tok ? (j > 0 ? suffix[j - 1] : 0) + 1 : 0;
+    size_t const distance = n - j;
+    size_t const length = std::min<size_t>({common, distance, j + 1});
+    if (length >= best_length) {
+      best_length = length;
+      best_distance = distance;
+    }
+  }
+  return {best_length, best_distance};
+}
+
+std::pair<size_t, size_t> RepetitionState::push(TokenID const tok) {
+  auto const found = match(tok);
+  for (size_t j = recent.size(); j-- > 0;)
+    suffix[j] = recent[j] == tok ? (j > 0 ? suffix[j - 1] : 0) + 1 : 0;
+  recent.push_back(tok);
+  suffix.push_back(0);
+  if (recent.size() > WINDOW) {
+    recent.erase(recent.begin());
+    suffix.erase(suffix.begin());
+  }
+  return found;
+}
+
+void add_repetition_penalty(
+  BeamState & beam, TokenID const tok, float const penalty_weight,
+  float const length_weight, float const recency_weight
+) {
+  auto const [length, distance] = beam.repetition->match(tok);
+  if (length < RepetitionState::MIN_LENGTH) return;
+  float length_factor  = std::log(1. + length_weight  * length);
+  float recency_factor = std::log(1. + recency_weight * distance);
+  beam.repetition_penalty *= (1.0f + penalty_weight * length_factor / recency_factor);
+}
+
+static void add_distinct(std::vector<TokenID> & distinct, TokenID const tok) {
+  auto const it = std::lower_bound(distinct.begin(), distinct.end(), tok);
+  if (it == distinct.end() || *it != tok) distinct.insert(it, tok);
+}
+
+float token_set_distance(std::vector<TokenID> const & a, std::vector<TokenID> const & b) {
+  size_t common = 0;
+  for (size_t i = 0, j = 0; i < a.size() && j < b.size();) {
+    if (a[i] < b[j]) ++i;
+    else if (b[j] < a[i]) ++j;
+    else { ++common; ++i; ++j; }
+  }
+  size_t const united = a.size() + b.size() - common;
+  return united == 0 ? 0.0f : 1.0f - (float)common / united;
+}
+
+void calculate_diversity_bonuses(std::vector<BeamState> & beams, float const weight) {
+  // Each pair once (same summation order per beam as visiting all others).
+  std::vector<float> diversity(beams.size(), 0.0f);
+  for (size_t i = 0; i < beams.size(); ++i) {
+    for (size_t j = i + 1; j < beams.size(); ++j) {
+      float const d = token_set_distance(beams[i].distinct, beams[j].distinct);
+      diversity[i] += d;
+      diversity[j] += d;
+    }
+  }
+  for (size_t i = 0; i < beams.size(); ++i)
+    beams[i].diversity_bonus = weight * diversity[i] / (beams.size() - 1);
+}
+
+void materialize(BeamState const & beam, BeamArena const & arena, TokenSequence & tokens, ProbaSequence & logprobs) {
+  tokens.resize(beam.length);
+  logprobs.resize(beam.length);
+  int node = beam.last;
+  for (size_t i = beam.length; i-- > 0; node = arena[node].parent) {
+    tokens[i] = arena[node].token;
+    logprobs[i] = arena[node].logprob;
+  }
+  tokens.resize(beam.length - beam.trimmed);
+}
+
+bool ends_with(BeamState const & beam, BeamArena const & arena, TokenSequence const & stop) {
+  if (stop.size() > beam.length) return false;
+  int node = beam.last;
+  for (size_t i = stop.size(); i-- > 0; node = arena[node].parent)
+    if (arena[node].token != stop[i]) return false;
+  return true;
+}
+
+void expand_beam(
+  BeamState const & beam, BeamArena & arena,
+  data::CompleteAction const & ca, TokenSequence const & stop,
+  std::vector<TokenID> const & topk_tokens, std::vector<float> const & topk_logits,
+  std::vector<BeamState> & beams
+) {
+  std::shared_ptr<RepetitionState const> repetition = beam.repetition;
+  if (ca.repetition && (!repetition || beam.last >= 0)) {
+    // The parent's last token joins the window its extensions share.
+    auto state = repetition ? std::make_shared<RepetitionState>(*repetition) : std::make_shared<RepetitionState>();
+    if (beam.last >= 0) state->push(arena[beam.last].token);
+    repetition = std::move(state);
+  }
+  for (size_t i = 0; i < topk_tokens.size(); ++i) {
+    BeamState & new_beam = beams.emplace_back(beam);
+    new_beam.repetition = repetition;
+    new_beam.lookahead_bonus = 0.0f;  // scored again by this step's rollouts, if any
+    new_beam.last = static_cast<int>(arena.size());
+    arena.push_back(BeamNode{topk_tokens[i], topk_logits[i], beam.last});
+    new_beam.length++;
+    new_beam.logprob += topk_logits[i];
+
+    if (ca.repetition) add_repetition_penalty(new_beam, topk_tokens[i], ca.repetition.value());
+    if (ca.diversity) add_distinct(new_beam.distinct, topk_tokens[i]);
+
+    new_beam.stopped = ends_with(new_beam, arena, stop);
+    if (new_beam.stopped) {
+      new_beam.trimmed = stop.size();
+      if (ca.diversity) {
+        // Once per beam: the stop tokens may also occur in the rest.
+        ProbaSequence logprobs;
+        materialize(new_beam, arena, new_beam.distinct, logprobs);
+        std::sort(new_beam.distinct.begin(), new_beam.distinct.end());
+        new_beam.distinct.erase(std::unique(new_beam.distinct.begin(), new_beam.distinct.end()), new_beam.distinct.end());
+      }
+    }
+  }
+}
+
+void prune_beams(std::vector<BeamState> & beams, unsigned beam_width) {
+  std::sort(beams.begin(), beams.end(), [](BeamState const & a, BeamState const & b) {
+    if (a.stopped != b.stopped) return a.stopped;
+    return a.score() > b.score();
+  });
+  std::vector<BeamState> pruned;
+  size_t kept_active = 0;
+  for (BeamState const & beam : beams) {
+    if (beam.stopped) pruned.push_back(beam);
+    else if (kept_active < beam_width) { pruned.push_back(beam); kept_active++; }
+  }
+  beams = std::move(pruned);
+}
+
+Rollout start_rollout(size_t const candidate, ContextID const seq, BeamState const & beam,
+                      BeamArena const & arena, TokenSequence const & stop) {
+  Rollout rollout{candidate, seq, arena[beam.last].token};
+  size_t const n = std::min<size_t>(stop.size(), beam.length);
+  rollout.tail.resize(n);
+  int node = beam.last;
+  for (size_t i = n; i-- > 0; node = arena[node].parent) rollout.tail[i] = arena[node].token;
+  return rollout;
+}
+
+void extend_rollout(Rollout & rollout, TokenID const token, float const logprob, TokenSequence const & stop) {
+  rollout.token = token;
+  rollout.logprob += logprob;
+  rollout.length++;
+  rollout.tokens.push_back(token);
+  if (stop.empty()) return;
+  if (rollout.tail.size() == stop.size()) rollout.tail.erase(rollout.tail.begin());
+  rollout.tail.push_back(token);
+  rollout.stopped = rollout.tail == stop;
+}
+
+void apply_rollout(BeamState & beam, Rollout const & rollout) {
+  float const proba = std::exp(-(beam.logprob + rollout.logprob) / (beam.length + rollout.length));
+  beam.lookahead_bonus = proba - beam.proba();
+}
+
+}
@@ -0,0 +1,125 @@
+#ifndef AUTOCOG_BACKEND_LLAMA_BEAMS_HXX
+#define AUTOCOG_BACKEND_LLAMA_BEAMS_HXX
+
+#include "autocog/backend/llama/types.hxx"
+
+#include "autocog/data/fta.hxx"
+
+#include <cmath>
+#include <cstddef>
+#include <memory>
+#include <utility>
+#include <vector>
+
+namespace autocog::backend::llama {
+
+// Beam search of a completion, without the model: the beams, their scoring,
+// and the rollouts scoring them ahead. Evaluation::Completion drives them with
+// the batched decode steps (and owns their KV sequences).
+
+// Repeats ending at the last token of a sequence, updated in O(WINDOW) per
+// appended token. suffix[j] is the length of the common suffix of the sequence
+// up to recent[j] and of the whole sequence.
+struct RepetitionState {
+  static constexpr size_t MIN_LENGTH = 3;
+  static constexpr size_t WINDOW = 256;
+
+  std::vector<TokenID> recent;
+  std::vector<unsigned> suffix;
+
+  // The longest suffix ending with `tok`, were it appended, that occurred
+  // before (length, distance), within the last WINDOW tokens and without
+  // overlapping itself. Ties go to the farthest.
+  std::pair<size_t, size_t> match(TokenID const tok) const;
+  // Append `tok`, returning its match().
+  std::pair<size_t, size_t> push(TokenID const tok);
+};
+
+// Beams share their common prefixes: each generated token is a node of the
+// completion's arena, linked to the node of the token before it. Extending a
+// beam appends one node; pruned beams just stop referencing theirs.
+struct BeamNode {
+  TokenID token;
+  float logprob;
+  int parent;  // -1 for the first token of the completion
+};
+using BeamArena = std::vector<BeamNode>;
+
+struct BeamState {
+  int last{-1};        // node of the beam's last token (-1: no token yet)
+  unsigned length{0};  // tokens (and logprobs) of the beam
+  unsigned trimmed{0}; // trailing tokens that matched the stop sequence (their logprobs count)
+  float logprob{0.};
+  float repetition_penalty = 1.0f;
+  float diversity_bonus = 0.0f;
+  float lookahead_bonus = 0.0f;
+  bool stopped{false};
+  ContextID seq{0};  // KV sequence of a live beam (shared with its parent until reassigned)
+  bool synced{true}; // `seq` holds the beam's tokens (else rebuilt before its decode)
+  // Of the base tokens and the beam's tokens but the last (if penalized):
+  // shared by the beams expanded from one parent, so copying a beam does not
+  // copy the window. expand_beam() builds it once per expanded parent.
+  std::shared_ptr<RepetitionState const> repetition;
+  std::vector<TokenID> distinct;  // sorted distinct `tokens` (if diversity is scored)
+
+  float proba() const { return length == 0 ? 0.0f : std::exp(-logprob / length); }
+  float score() const { return (this->proba() + lookahead_bonus + diversity_bonus) / repetition_penalty; }
+};
+
+// Penalize the beam for the repeat its new token `tok` ends, if any: the
+// longer and the closer, the heavier. `beam.repetition` does not hold `tok`.
+void add_repetition_penalty(
+  BeamState & beam, TokenID const tok, float const penalty_weight,
+  float const length_weight = 1.0, float const recency_weight = 1.0
+);
+
+// Jaccard distance of two beams' token sets, merged without allocating.
+float token_set_distance(std::vector<TokenID> const & a, std::vector<TokenID> const & b);
+void calculate_diversity_bonuses(std::vector<BeamState> & beams, float const weight);
+
+// The beam's tokens (without the stop sequence) and all its logprobs.
+void materialize(BeamState const & beam, BeamArena const & arena, TokenSequence & tokens, ProbaSequence & logprobs);
+
+// Whether the beam's last tokens are `stop`.
+bool ends_with(BeamState const & beam, BeamArena const & arena, TokenSequence const & stop);
+
+// Append to `beams` one extension of `beam` per top-k token.
+void expand_beam(
+  BeamState const & beam, BeamArena & arena,
+  data::CompleteAction const & ca, TokenSequence const & stop,
+  std::vector<TokenID> const & topk_tokens, std::vector<float> const & topk_logits,
+  std::vector<BeamState> & beams
+);
+
+// Keep the stopped beams and the `beam_width` best live ones, stopped first.
+void prune_beams(std::vector<BeamState> & beams, unsigned beam_width);
+
+// Greedy continuation of a live candidate beam, used to score it before
+// pruning: at most `ahead` tokens, and no further than the stop sequence. Runs
+// on its own KV sequence, forked from the candidate's parent, or on the
+// candidate's when the model has none left (in turns with the others there).
+struct Rollout {
+  size_t candidate;     // index in Completion::candidates
+  ContextID seq;
+  TokenID token;        // next token to decode
+  float logprob{0.};    // of the tokens generated so far
+  unsigned length{0};   // tokens generated so far
+  bool stopped{false};  // they end with the stop sequence
+  TokenSequence tail{}; // last tokens of the candidate and rollout (at most the stop's length)
+  TokenSequence tokens{}; // generated so far, the last one being `token`
+};
+
+Rollout start_rollout(size_t const candidate, ContextID const seq, BeamState const & beam,
+                      BeamArena const & arena, TokenSequence const & stop);
+// Append the greedy `token`; the rollout stops once it completes `stop`.
+void extend_rollout(Rollout & rollout, TokenID const token, float const logprob, TokenSequence const & stop);
+
+// Lookahead bonus: the candidate is scored on its tokens followed by its
+// rollout (the probability of the whole, as for a beam), rather than on its
+// tokens alone. A stopped candidate is not rolled out: its own tokens are
+// already the whole, so its bonus stays 0 and both are scored alike.
+void apply_rollout(BeamState & beam, Rollout const & rollout);
+
+}
+
+#endif // AUTOCOG_BACKEND_LLAMA_BEAMS_HXX
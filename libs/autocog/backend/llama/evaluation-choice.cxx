@@ -27,20 +27,18 @@ unsigned Evaluation::evaluate_choice(PathState & state) {
   if (p.successors.size() != p.choices.size())
     throw autocog::utilities::InternalError("Choice action must have as many successors as choices");
 
-  unsigned num_token_eval = 0;
-  std::vector<ChoiceResult> results;
+  auto [model, ctx] = this->restore(state);
+  std::vector<ProbaSequence> choice_logprobs;
+  unsigned num_token_eval = model.eval_choices(p.choices, choice_logprobs, ctx);
 
+  std::vector<ChoiceResult> results;
   for (size_t idx = 0; idx < p.choices.size(); ++idx) {
-    auto [model, ctx] = this->restore(state);
-    ProbaSequence logprobs;
-    num_token_eval += model.eval_sequences(p.choices[idx], logprobs, ctx);
-
+    ProbaSequence const & logprobs = choice_logprobs[idx];
     float proba = 0.;
     for (float lpb : logprobs) proba += lpb;
     proba = logprobs.empty() ? 0.0f : std::exp(-proba / logprobs.size());
 
     results.emplace_back(idx, logprobs, proba);
-    state.context.reset(); // TODO remove once context saving/restore/rewind is implemented
   }
 
   std::sort(results.begin(), results.end(),
@@ -51,6 +49,7 @@ unsigned Evaluation::evaluate_choice(PathState & state) {
     auto & choice_tokens = p.choices[result.index];
     data::FTTNode & child = grow(state.parent, state.action, prepared.fta, choice_tokens, result.logprobs);
     child.pruned = (count >= ca.width) || (count > 0 && result.proba < ca.threshold);
+    this->emit(&state.parent, child, false);
     if (!child.pruned) {
       this->enqueue(p.successors[result.index], child, state);
     }
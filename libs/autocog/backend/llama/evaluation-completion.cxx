@@ -1,182 +1,354 @@
 #include "autocog/backend/llama/evaluation.hxx"
+#include "autocog/backend/llama/beams.hxx"
 #include "autocog/backend/llama/model.hxx"
 #include "autocog/logging.hxx"
 #include "autocog/utilities/exception.hxx"
 
 #include <algorithm>
 #include <cmath>
+#include <map>
+#include <memory>
 #include <set>
+#include <utility>
 #include <variant>
 #include <vector>
 
 namespace autocog::backend::llama {
 
-struct BeamState {
-  TokenSequence tokens;
-  ProbaSequence logprobs;
-  float logprob{0.};
-  float repetition_penalty = 1.0f;
-  float diversity_bonus = 0.0f;
-  float lookahead_bonus = 0.0f;
-  bool stopped{false};
-
-  float proba() const { return logprobs.empty() ? 0.0f : std::exp(-logprob / logprobs.size()); }
-  float score() const { return (this->proba() + lookahead_bonus + diversity_bonus) / repetition_penalty; }
-};
+// A live beam's KV sequence holds the base tokens plus its own tokens except
+// the last one: that pending token is decoded by the next batched step, which
+// yields the logits the beam is expanded from.
+static TokenID pending_token(BeamState const & beam, BeamArena const & arena, TokenPrefix const & base_tokens) {
+  return beam.last < 0 ? base_tokens.back() : arena[beam.last].token;
+}
 
-static float calculate_repetition_penalty(
-  TokenSequence const & tokens, float & penalty, float const penalty_weight,
-  size_t const min_length = 3, size_t const max_window_size = 256,
-  float const length_weight = 1.0, float const recency_weight = 1.0
+// Give every surviving live beam its own KV sequence. The first survivor of a
+// parent keeps the parent's sequence, its siblings fork it into freshly leased
+// ones, and parent sequences left without survivors go back to the model (except
+// `root`, the state's own sequence, which is not leased). When the model has no
+// sequence left for a sibling, it keeps sharing its parent's: the beams of a
+// sequence are then decoded in turns, each rebuilding it first (see
+// Evaluation::completion_requests), so the completion's result does not depend
+// on the other evaluations. Returns false if some beams share a sequence.
+static bool assign_sequences(
+  Model & model, ContextID root,
+  std::vector<ContextID> const & parents, std::vector<BeamState> & beams
 ) {
-  size_t window_size = std::min(tokens.size(), max_window_size);
-  for (size_t i = min_length; i < tokens.size(); ++i) {
-    size_t best_length = 0, best_distance = 0;
-    size_t search_start = (i >= window_size) ? i - window_size : 0;
-    for (size_t j = search_start; j < i; ++j) {
-      size_t match_length = 0;
-      while (j + match_length < i && i + match_length < tokens.size() &&
-             tokens[j + match_length] == tokens[i + match_length]) {
-        match_length++;
-      }
-      if (match_length >= min_length && match_length > best_length) {
-        best_length = match_length;
-        best_distance = i - j;
-      }
-    }
-    if (best_length >= min_length) {
-      float length_factor  = std::log(1. + length_weight  * best_length);
-      float recency_factor = std::log(1. + recency_weight * best_distance);
-      penalty *= (1.0f + penalty_weight * length_factor / recency_factor);
+  std::set<ContextID> claimed;
+  std::vector<size_t> forks;
+  for (size_t i = 0; i < beams.size(); ++i) {
+    if (beams[i].stopped) continue;
+    if (!claimed.insert(beams[i].seq).second) forks.push_back(i);
+  }
+  for (ContextID seq : parents)
+    if (seq != root && claimed.count(seq) == 0) model.release_sequence(seq);
+  bool owned = true;
+  for (size_t i : forks) {
+    ContextID seq;
+    try {
+      seq = model.acquire_sequence();
+    } catch (autocog::ModelError const &) {
+      owned = false;
+      continue;
     }
+    model.fork_sequence(beams[i].seq, seq);
+    beams[i].seq = seq;
   }
-  return penalty;
+  return owned;
 }
 
-static float token_sequence_diversity(TokenSequence const & a, TokenSequence const & b) {
-  std::set<TokenID> set_a(a.begin(), a.end());
-  std::set<TokenID> set_b(b.begin(), b.end());
-  std::set<TokenID> intersection;
-  std::set_intersection(set_a.begin(), set_a.end(), set_b.begin(), set_b.end(),
-                        std::inserter(intersection, intersection.begin()));
-  std::set<TokenID> union_set;
-  std::set_union(set_a.begin(), set_a.end(), set_b.begin(), set_b.end(),
-                 std::inserter(union_set, union_set.begin()));
-  return 1.0f - (float)intersection.size() / union_set.size();
-}
+// Returns the sequences still leased by live beams when the completion ends
+// (normally or not).
+struct BeamSequences {
+  Model & model;
+  ContextID root;
+  std::vector<BeamState> const & beams;
 
-static void calculate_diversity_bonuses(std::vector<BeamState> & beams, float const weight) {
-  for (size_t i = 0; i < beams.size(); ++i) {
-    float diversity = 0.0f;
-    for (size_t j = 0; j < beams.size(); ++j)
-      if (i != j) diversity += token_sequence_diversity(beams[i].tokens, beams[j].tokens);
-    beams[i].diversity_bonus = weight * diversity / (beams.size() - 1);
+  ~BeamSequences() {
+    std::set<ContextID> leased;
+    for (BeamState const & beam : beams)
+      if (!beam.stopped && beam.seq != root) leased.insert(beam.seq);
+    for (ContextID seq : leased) model.release_sequence(seq);
   }
-}
+};
 
-static unsigned expand_beam(
-  Model & model, ContextID ctx, BeamState const & beam,
-  data::CompleteAction const & ca, TokenSequence const & stop,
-  std::vector<bool> const & mask, TokenSequence const & base_tokens,
-  std::vector<BeamState> & beams
-) {
-  TokenSequence context_tokens = base_tokens;
-  context_tokens.insert(context_tokens.end(), beam.tokens.begin(), beam.tokens.end());
-  model.set_tokens(context_tokens, ctx);
-
-  std::vector<TokenID> topk_tokens;
-  std::vector<float> topk_logits;
-  unsigned num_token_eval = model.eval_topk_tokens(mask, ca.beams, topk_tokens, topk_logits, ctx);
-
-  for (size_t i = 0; i < topk_tokens.size(); ++i) {
-    BeamState & new_beam = beams.emplace_back(beam);
-    new_beam.tokens.push_back(topk_tokens[i]);
-    new_beam.logprobs.push_back(topk_logits[i]);
-    new_beam.logprob += topk_logits[i];
-
-    if (ca.repetition) {
-      TokenSequence beam_tokens;
-      beam_tokens.insert(beam_tokens.end(), base_tokens.begin(), base_tokens.end());
-      beam_tokens.insert(beam_tokens.end(), new_beam.tokens.begin(), new_beam.tokens.end());
-      calculate_repetition_penalty(beam_tokens, new_beam.repetition_penalty, ca.repetition.value());
+// One completion in progress: its beams advance by one token per batched
+// decode step. With lookahead, the candidates of a step are then rolled out
+// up to `ahead` more steps (all together, batched like the beams) before pruning.
+// When the model runs out of KV sequences, beams and rollouts share them and
+// are decoded in turns, so the result is the same (only slower).
+struct Evaluation::Completion {
+  Frontier::Handle state;
+  Model & model;
+  ContextID ctx;
+  data::CompleteAction const & action;
+  PreparedAction const & prepared;
+  VocabMask const & mask;
+  BeamArena arena;
+  std::vector<BeamState> beams;
+  BeamSequences leases;           // after `beams`, which it reads on destruction
+  std::vector<ContextID> parents; // sequences of the live beams in the pending step
+  unsigned pos{0};
+
+  // A step decodes every live beam (or rollout), in turns when they share a
+  // sequence: each batch takes the next ones up to one whose sequence is
+  // already in it.
+  size_t next{0};                         // first beam (or rollout) not requested yet in this step
+  std::vector<size_t> requested;          // beams (or rollouts) of the pending batch
+  std::vector<TopkResult> expansions;     // top-k of each beam decoded in this step
+  std::map<ContextID, size_t> decoded_on; // last beam (or rollout) decoded on each sequence
+  TokenSequence base;                     // state tokens, once a sequence is rebuilt
+  bool crowded{false};                    // some sequences were shared (warned once)
+
+  std::vector<BeamState> candidates;  // expanded beams awaiting their rollouts
+  std::vector<Rollout> rollouts;      // leased sequences, released when they end
+  unsigned ahead{0};                  // rollout steps left
+
+  Completion(Frontier::Handle state_, Model & model_, ContextID ctx_,
+             data::CompleteAction const & action_, PreparedAction const & prepared_,
+             VocabMask const & mask_) :
+    state(state_), model(model_), ctx(ctx_), action(action_), prepared(prepared_), mask(mask_),
+    beams(), leases{model_, ctx_, beams}, parents()
+  {
+    BeamState & root = beams.emplace_back();
+    root.seq = ctx;
+    if (action.repetition) {
+      // Repeats of the prefix count too. Two windows of it are enough for every
+      // repeat shorter than a window.
+      TokenSequence base;
+      state->tokens.flatten(base);
+      auto repetition = std::make_shared<RepetitionState>();
+      for (size_t i = base.size() - std::min(base.size(), 2 * RepetitionState::WINDOW); i < base.size(); ++i)
+        repetition->push(base[i]);
+      root.repetition = std::move(repetition);
     }
+  }
 
-    new_beam.stopped = (stop.size() <= new_beam.tokens.size()) &&
-      std::equal(stop.begin(), stop.end(), new_beam.tokens.end() - stop.size());
-    if (new_beam.stopped)
-      new_beam.tokens.erase(new_beam.tokens.end() - stop.size(), new_beam.tokens.end());
+  ~Completion() {
+    this->end_rollouts();
   }
-  return num_token_eval;
-}
 
-static void prune_beams(std::vector<BeamState> & beams, unsigned beam_width) {
-  std::sort(beams.begin(), beams.end(), [](BeamState const & a, BeamState const & b) {
-    if (a.stopped != b.stopped) return a.stopped;
-    return a.score() > b.score();
-  });
-  std::vector<BeamState> pruned;
-  size_t kept_active = 0;
-  for (BeamState const & beam : beams) {
-    if (beam.stopped) pruned.push_back(beam);
-    else if (kept_active < beam_width) { pruned.push_back(beam); kept_active++; }
-  }
-  beams = std::move(pruned);
-}
+  // Bring `seq` to the tokens `beam`'s sequence must hold, followed by
+  // `extra` (a rollout's): the state's tokens and the beam's own, but the
+  // last one (decoded by its next request).
+  unsigned rebuild(BeamState const & beam, ContextID const seq, TokenSequence const & extra = {}) {
+    if (base.empty()) state->tokens.flatten(base);
+    TokenSequence tokens, own;
+    ProbaSequence logprobs;
+    materialize(beam, arena, own, logprobs);
+    tokens.reserve(base.size() + own.size() + extra.size());
+    tokens.insert(tokens.end(), base.begin(), base.end());
+    tokens.insert(tokens.end(), own.begin(), own.end());
+    tokens.insert(tokens.end(), extra.begin(), extra.end());
+    tokens.pop_back();
+    return model.set_tokens(tokens, seq);
+  }
 
-static bool beam_search_step(
-  Model & model, ContextID ctx,
-  data::CompleteAction const & ca, TokenSequence const & stop,
-  std::vector<bool> const & mask, TokenSequence const & base_tokens,
-  std::vector<BeamState> & current_beams, unsigned & num_token_eval
-) {
-  std::vector<BeamState> next_beams;
-  for (BeamState const & beam : current_beams) {
-    if (beam.stopped) next_beams.push_back(beam);
-    else num_token_eval += expand_beam(model, ctx, beam, ca, stop, mask, base_tokens, next_beams);
+  void crowd() {
+    if (crowded) return;
+    crowded = true;
+    SPDLOG_LOGGER_WARN(autocog::log(), "No free KV sequence for every beam and rollout of a completion: they share sequences and are decoded in turns");
   }
-  if (ca.diversity) calculate_diversity_bonuses(next_beams, ca.diversity.value());
 
-  bool all_stopped = std::all_of(next_beams.begin(), next_beams.end(),
-                                 [](BeamState const & b) { return b.stopped; });
-  if (all_stopped) { current_beams = std::move(next_beams); return true; }
+  // Rollouts on a sequence of their own (not their candidate's) lease it.
+  void end_rollouts() {
+    for (Rollout const & rollout : rollouts)
+      if (rollout.seq != candidates[rollout.candidate].seq) model.release_sequence(rollout.seq);
+    rollouts.clear();
+    ahead = 0;
+  }
 
-  prune_beams(next_beams, ca.beams);
-  if (next_beams.empty())
-    throw autocog::utilities::InternalError("No valid beams remaining in completion");
-  current_beams = std::move(next_beams);
-  return false;
+  // Roll out the live candidates if pruning will drop some of them, for as
+  // many steps as the completion has left (at most `ahead`). A candidate the
+  // model has no sequence left for is rolled out on its own. The RNG model's
+  // logprobs ignore the context: rollouts would tell nothing, and only
+  // consume its random stream.
+  bool start_rollouts() {
+    if (model.id == 0) return false;
+    std::vector<size_t> live;
+    for (size_t i = 0; i < candidates.size(); ++i)
+      if (!candidates[i].stopped) live.push_back(i);
+    if (live.size() <= action.beams) return false;
+    for (size_t i : live) {
+      ContextID seq = candidates[i].seq;
+      try {
+        seq = model.acquire_sequence();
+      } catch (autocog::ModelError const &) {
+        this->crowd();
+      }
+      if (seq != candidates[i].seq) model.fork_sequence(candidates[i].seq, seq);
+      rollouts.push_back(start_rollout(i, seq, candidates[i], arena, prepared.stop));
+    }
+    ahead = std::min(action.ahead, action.length - pos - 1);
+    decoded_on.clear();
+    return true;
+  }
+};
+
+bool Evaluation::holds_shared_context() const {
+  return completion && completion->ctx == 0;
 }
 
-unsigned Evaluation::evaluate_completion(PathState & state) {
+void Evaluation::begin_completion(Frontier::Handle const current) {
   data::FTA const & fta = prepared.fta;
+  PathState & state = *current;
   data::CompleteAction const & ca = std::get<data::CompleteAction>(fta.actions[state.action].body);
-  PreparedAction const & p = prepared.actions[state.action];
 
-  auto [model, ctx] = this->restore(state);
-  std::vector<bool> const & mask = ca.vocab
+  if (state.tokens.empty())
+    throw autocog::utilities::InternalError("Completion requires a non-empty prefix");
+  auto [model, ctx] = this->restore(state, 1);
+  VocabMask const & mask = ca.vocab
       ? model.vocab_mask(*ca.vocab, fta.vocabs.at(*ca.vocab))
       : model.full_vocab_mask();
 
-  std::vector<BeamState> beams;
-  beams.emplace_back();
+  completion = std::make_shared<Completion>(current, model, ctx, ca, prepared.actions[state.action], mask);
+  if (ca.length == 0) this->finish_completion();
+}
+
+void Evaluation::completion_requests(std::vector<TopkRequest> & requests) {
+  Completion & c = *completion;
+  c.requested.clear();
+  std::set<ContextID> batch;
+  if (c.ahead > 0) {
+    // The next token of every rollout not stopped yet, decoded in a single
+    // batch (greedy). A rollout finds its sequence as it left it, unless
+    // another was decoded on it since.
+    for (; c.next < c.rollouts.size(); ++c.next) {
+      Rollout const & rollout = c.rollouts[c.next];
+      if (rollout.stopped) continue;
+      if (!batch.insert(rollout.seq).second) break;
+      BeamState const & candidate = c.candidates[rollout.candidate];
+      auto const last = c.decoded_on.find(rollout.seq);
+      if (last == c.decoded_on.end() ? !candidate.synced : last->second != c.next)
+        token_eval += c.rebuild(candidate, rollout.seq, rollout.tokens);
+      c.requested.push_back(c.next);
+      requests.push_back(TopkRequest{rollout.seq, rollout.token, &c.mask, 1});
+    }
+    return;
+  }
+  if (c.next == 0) {
+    c.parents.clear();
+    for (BeamState const & beam : c.beams)
+      if (!beam.stopped && std::find(c.parents.begin(), c.parents.end(), beam.seq) == c.parents.end())
+        c.parents.push_back(beam.seq);
+    c.expansions.assign(c.beams.size(), {});
+    c.decoded_on.clear();
+  }
+  // The pending token of every live beam, decoded in a single batch (several
+  // if beams share a sequence).
+  for (; c.next < c.beams.size(); ++c.next) {
+    BeamState const & beam = c.beams[c.next];
+    if (beam.stopped) continue;
+    if (!batch.insert(beam.seq).second) break;
+    if (!beam.synced || c.decoded_on.count(beam.seq) > 0) token_eval += c.rebuild(beam, beam.seq);
+    c.requested.push_back(c.next);
+    requests.push_back(TopkRequest{beam.seq, pending_token(beam, c.arena, c.state->tokens), &c.mask, c.action.beams});
+  }
+}
+
+bool Evaluation::completion_step(TopkResult const * results) {
+  Completion & c = *completion;
+  data::CompleteAction const & ca = c.action;
+
+  token_eval += c.requested.size();
+  if (c.ahead > 0) {
+    for (size_t i = 0; i < c.requested.size(); ++i) {
+      Rollout & rollout = c.rollouts[c.requested[i]];
+      extend_rollout(rollout, results[i].tokens[0], results[i].logprobs[0], c.prepared.stop);
+      c.decoded_on[rollout.seq] = c.requested[i];
+    }
+    if (c.next < c.rollouts.size()) return false;  // rollouts sharing a sequence: next turn
+    c.next = 0;
+    bool const stopped = std::all_of(c.rollouts.begin(), c.rollouts.end(),
+                                     [](Rollout const & r) { return r.stopped; });
+    if (--c.ahead > 0 && !stopped) return false;
+    for (Rollout const & rollout : c.rollouts)
+      apply_rollout(c.candidates[rollout.candidate], rollout);
+    // A candidate's sequence that rollouts ran on holds theirs now.
+    for (BeamState & candidate : c.candidates)
+      if (c.decoded_on.count(candidate.seq) > 0) candidate.synced = false;
+    c.end_rollouts();
+    return this->prune_candidates();
+  }
+
+  for (size_t i = 0; i < c.requested.size(); ++i) {
+    c.expansions[c.requested[i]] = results[i];
+    c.decoded_on[c.beams[c.requested[i]].seq] = c.requested[i];
+  }
+  if (c.next < c.beams.size()) return false;  // beams sharing a sequence: next turn
+  c.next = 0;
 
-  unsigned num_token_eval = 0;
-  for (unsigned pos = 0; pos < ca.length; ++pos) {
-    bool should_stop = beam_search_step(model, ctx, ca, p.stop, mask, state.tokens, beams, num_token_eval);
-    if (should_stop) break;
+  c.candidates.clear();
+  for (size_t i = 0; i < c.beams.size(); ++i) {
+    BeamState const & beam = c.beams[i];
+    if (beam.stopped) {
+      c.candidates.push_back(beam);
+      continue;
+    }
+    size_t const first = c.candidates.size();
+    expand_beam(beam, c.arena, ca, c.prepared.stop, c.expansions[i].tokens, c.expansions[i].logprobs, c.candidates);
+    // The sequence holds this beam's tokens unless another was decoded on it after.
+    bool const synced = c.decoded_on[beam.seq] == i;
+    for (size_t k = first; k < c.candidates.size(); ++k) c.candidates[k].synced = synced;
   }
+  // No lookahead on the last step: its beams are the completion's results.
+  if (ca.ahead > 0 && c.pos + 1 < ca.length && c.start_rollouts()) return false;
+  return this->prune_candidates();
+}
+
+bool Evaluation::prune_candidates() {
+  Completion & c = *completion;
+  data::CompleteAction const & ca = c.action;
+  std::vector<BeamState> next_beams = std::move(c.candidates);
+  c.candidates.clear();
+  if (ca.diversity) calculate_diversity_bonuses(next_beams, ca.diversity.value());
+
+  bool all_stopped = std::all_of(next_beams.begin(), next_beams.end(),
+                                 [](BeamState const & b) { return b.stopped; });
+  if (!all_stopped) {
+    prune_beams(next_beams, ca.beams);
+    if (next_beams.empty())
+      throw autocog::utilities::InternalError("No valid beams remaining in completion");
+  }
+  if (!assign_sequences(c.model, c.ctx, c.parents, next_beams)) c.crowd();
+  c.beams = std::move(next_beams);
+  return all_stopped || ++c.pos >= ca.length;
+}
+
+void Evaluation::finish_completion() {
+  Completion & c = *completion;
+  PathState & state = *c.state;
+  data::CompleteAction const & ca = c.action;
+  std::vector<BeamState> & beams = c.beams;
 
   std::sort(beams.begin(), beams.end(),
             [](BeamState const & a, BeamState const & b) { return a.score() > b.score(); });
 
   unsigned count = 0;
+  TokenSequence tokens;
+  ProbaSequence logprobs;
   for (auto & beam : beams) {
-    data::FTTNode & child = grow(state.parent, state.action, fta, beam.tokens, beam.logprobs);
+    materialize(beam, c.arena, tokens, logprobs);
+    data::FTTNode & child = grow(state.parent, state.action, prepared.fta, tokens, logprobs);
     child.pruned = (count >= ca.width) || (count > 0 && beam.proba() < ca.threshold);
-    if (!child.pruned) this->enqueue(p.successors[0], child, state);
+    this->emit(&state.parent, child, false);
+    // A live beam's sequence already holds its tokens (but the last): fork it.
+    if (!child.pruned)
+      this->enqueue(c.prepared.successors[0], child, state,
+                    beam.stopped || !beam.synced ? std::nullopt : std::optional<ContextID>(beam.seq));
     count++;
   }
-  return num_token_eval;
+
+  Frontier::Handle const current = c.state;
+  completion.reset();
+  this->close(current);
+}
+
+void Evaluation::abort() {
+  if (!completion) return;
+  Frontier::Handle const current = completion->state;
+  completion.reset();
+  this->discard(current);
 }
 
 }
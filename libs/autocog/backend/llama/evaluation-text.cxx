@@ -19,10 +19,13 @@ unsigned Evaluation::evaluate_text(PathState & state) {
   }
 
   auto & child = grow(state.parent, state.action, prepared.fta, p.tokens, logprobs);
+  this->emit(&state.parent, child, p.successors.empty());
   if (p.successors.size() == 1) {
     this->enqueue(p.successors[0], child, state);
   } else if (p.successors.size() > 1) {
     throw autocog::utilities::InternalError("Text action should never have more than 1 successor");
+  } else {
+    this->complete(child);
   }
   return num_token_eval;
 }
@@ -2,8 +2,12 @@
 #include "autocog/backend/llama/evaluation.hxx"
 #include "autocog/backend/llama/model.hxx"
 #include "autocog/logging.hxx"
+#include "autocog/utilities/exception.hxx"
 
+#include <algorithm>
 #include <cmath>
+#include <functional>
+#include <limits>
 #include <utility>
 #include <variant>
 
@@ -28,40 +32,315 @@ data::FTTNode & grow(data::FTTNode & parent, ActionID const id, data::FTA const
   return parent.children.back();
 }
 
+TokenPrefix TokenPrefix::extend(TokenSequence const & tokens) const {
+  if (tokens.empty()) return *this;
+  TokenPrefix prefix;
+  prefix.head = std::make_shared<Segment const>(Segment{head, tokens, this->size() + tokens.size()});
+  return prefix;
+}
+
+void TokenPrefix::flatten(TokenSequence & out, size_t const hold) const {
+  size_t const n = this->size() - std::min(hold, this->size());
+  out.resize(n);
+  for (Segment const * segment = head.get(); segment; segment = segment->parent.get()) {
+    size_t const begin = segment->size - segment->tokens.size();
+    if (begin >= n) continue;
+    size_t const count = std::min(segment->size, n) - begin;
+    std::copy_n(segment->tokens.begin(), count, out.begin() + begin);
+  }
+}
+
 PathState::PathState(ActionID const action_, data::FTTNode & parent_,
-                     TokenSequence const & tokens_, std::optional<ContextID> context_) :
+                     TokenPrefix const & tokens_, std::optional<ContextID> context_) :
   action(action_), parent(parent_), tokens(tokens_), context(context_)
 {}
 
+ContextPool::ContextPool(Model & model_, unsigned const capacity_) :
+  model(model_),
+  capacity(capacity_),
+  slots()
+{
+  if (capacity == 0) return;
+  try {
+    slots.push_back(Slot{model.acquire_sequence(), 0, 0});
+  } catch (autocog::ModelError const &) {
+    // Every sequence of the model is in use: fall back to sequence 0.
+  }
+}
+
+ContextPool::~ContextPool() {
+  for (Slot const & slot : slots) model.release_sequence(slot.seq);
+}
+
+size_t ContextPool::find(PathState const & state) const {
+  if (state.lease == 0 || !state.context) return slots.size();
+  for (size_t i = 0; i < slots.size(); ++i)
+    if (slots[i].seq == state.context.value())
+      return slots[i].lease == state.lease ? i : slots.size();
+  return slots.size();
+}
+
+bool ContextPool::holds(PathState const & state) const {
+  return this->find(state) < slots.size();
+}
+
+ContextPool::Slot * ContextPool::take() {
+  for (Slot & slot : slots)
+    if (slot.lease == 0) return &slot;
+  if (slots.size() < capacity) {
+    try {
+      ContextID seq = model.acquire_sequence();
+      return &slots.emplace_back(Slot{seq, 0, 0});
+    } catch (autocog::ModelError const &) {
+      // Every sequence of the model is in use: recycle one of ours instead.
+    }
+  }
+  if (slots.empty()) return nullptr;
+  return &*std::min_element(slots.begin(), slots.end(),
+                            [](Slot const & a, Slot const & b) { return a.last_use < b.last_use; });
+}
+
+void ContextPool::lease(PathState & state, std::optional<ContextID> const source) {
+  Slot * slot = this->take();
+  if (slot == nullptr) {
+    state.context = 0;
+    state.lease = 0;
+    return;
+  }
+  if (source) model.fork_sequence(source.value(), slot->seq);
+  slot->lease = next_lease++;
+  slot->last_use = ++clock;
+  state.context = slot->seq;
+  state.lease = slot->lease;
+}
+
+void ContextPool::touch(PathState const & state) {
+  size_t i = this->find(state);
+  if (i < slots.size()) slots[i].last_use = ++clock;
+}
+
+void ContextPool::release(PathState & state) {
+  // The KV content is kept: the next lease forks over it, or reuses its
+  // common prefix when rebuilt by set_tokens.
+  size_t i = this->find(state);
+  if (i < slots.size()) slots[i].lease = 0;
+  state.lease = 0;
+}
+
+QueueMetric parse_queue_metric(std::string const & metric) {
+  if (metric.empty() || metric == "breadth-first") return QueueMetric::BreadthFirst;
+  if (metric == "depth-first") return QueueMetric::DepthFirst;
+  if (metric == "logprob")     return QueueMetric::Logprob;
+  if (metric == "perplexity")  return QueueMetric::Perplexity;
+  if (metric == "beam")        return QueueMetric::BeamOfPaths;
+  // Queue metrics are free-form in STL: keep the unordered (FIFO) exploration for names we do not know.
+  SPDLOG_LOGGER_WARN(autocog::log(), "Unknown queue metric '{}', using breadth-first", metric);
+  return QueueMetric::BreadthFirst;
+}
+
+float path_score(QueueMetric const metric, data::FTTNode const & node) {
+  if (metric == QueueMetric::Perplexity || metric == QueueMetric::BeamOfPaths)
+    return node.length == 0 ? 0.0f : node.logprob / node.length;
+  return node.logprob;
+}
+
+Frontier::Frontier(QueueMetric const metric_, unsigned const width_) :
+  metric(metric_),
+  width(width_),
+  states(),
+  heap(),
+  bounds(),
+  admitted()
+{}
+
+PathState & Frontier::emplace(ActionID const action, data::FTTNode & parent,
+                              TokenPrefix const & tokens, unsigned const depth) {
+  Handle state = states.emplace(states.end(), action, parent, tokens, std::nullopt);
+  state->depth = depth;
+
+  float const score = path_score(metric, parent);
+  Entry entry{0, 0.0f, next_order++, state};
+  switch (metric) {
+    case QueueMetric::BreadthFirst:                                          break;
+    case QueueMetric::DepthFirst:   entry.order = -entry.order;              break;
+    case QueueMetric::Logprob:
+    case QueueMetric::Perplexity:   entry.score = score;                     break;
+    case QueueMetric::BeamOfPaths:  entry.rank = depth; entry.score = score; break;
+  }
+  heap.push_back(entry);
+  std::push_heap(heap.begin(), heap.end(), Entry::after);
+  bounds.insert(score);
+  return *state;
+}
+
+Frontier::Handle Frontier::take() {
+  std::pop_heap(heap.begin(), heap.end(), Entry::after);
+  Handle state = heap.back().state;
+  heap.pop_back();
+  bounds.erase(bounds.find(path_score(metric, state->parent)));
+  return state;
+}
+
+void Frontier::done(Handle const state) {
+  states.erase(state);
+}
+
+bool Frontier::admit(PathState const & state) {
+  if (metric != QueueMetric::BeamOfPaths) return true;
+  if (admitted.size() <= state.depth) admitted.resize(state.depth + 1, 0);
+  if (admitted[state.depth] >= width) return false;
+  admitted[state.depth]++;
+  return true;
+}
+
+float Frontier::bound() const {
+  return bounds.empty() ? std::numeric_limits<float>::infinity() : *bounds.begin();
+}
+
 Evaluation::Evaluation(EvaluationConfig const & config_, ModelID const model_, data::FTA const & fta_) :
   config(config_),
   model(model_),
   prepared(prepare(model_, fta_)),
   result(),
-  queue(),
+  metric(parse_queue_metric(fta_.queue_metric)),
+  pool(Manager::get_model(model_), config_.max_contexts),
+  queue(metric, config_.queue_width),
+  leaves(),
   started(false)
 {}
 
 unsigned Evaluation::advance(std::optional<unsigned> max_token_eval) {
+  unsigned const start = token_eval;
+  std::optional<unsigned> until;
+  if (max_token_eval) until = start + max_token_eval.value();
+
+  Model & model = Manager::get_model(this->model);
+  std::vector<TopkRequest> requests;
+  std::vector<TopkResult> results;
+  while (this->poll(requests, until)) {
+    try {
+      model.eval_topk_batch(requests, results);
+    } catch (...) {
+      this->abort();
+      throw;
+    }
+    this->resume(results.data());
+    requests.clear();
+  }
+  return token_eval - start;
+}
+
+bool Evaluation::poll(std::vector<TopkRequest> & requests, std::optional<unsigned> const until) {
   if (!started) { this->initial(); started = true; }
 
-  unsigned num_token_eval = 0;
-  while (!queue.empty() && (max_token_eval == std::nullopt || num_token_eval < max_token_eval)) {
-    PathState & state = queue.front();
+  while (!completion) {
+    if (queue.empty() || (until && token_eval >= until.value())) return false;
+    Frontier::Handle current = queue.take();
+    PathState & state = *current;
+    if (!queue.admit(state)) {
+      this->discard(current);
+      continue;
+    }
     switch (prepared.fta.actions[state.action].body.index()) {
-      case 0: num_token_eval += this->evaluate_text(state);       break;  // TextAction
-      case 1: num_token_eval += this->evaluate_completion(state); break;  // CompleteAction
-      case 2: num_token_eval += this->evaluate_choice(state);     break;  // ChooseAction
+      case 0: token_eval += this->evaluate_text(state);   this->close(current); break;  // TextAction
+      case 1: this->begin_completion(current);                                  break;  // CompleteAction
+      case 2: token_eval += this->evaluate_choice(state); this->close(current); break;  // ChooseAction
     }
-    queue.pop();
   }
-  return num_token_eval;
+  this->completion_requests(requests);
+  return true;
+}
+
+void Evaluation::resume(TopkResult const * results) {
+  if (!completion)
+    throw autocog::utilities::InternalError("No pending decode step to resume");
+  if (this->completion_step(results)) this->finish_completion();
+}
+
+void Evaluation::close(Frontier::Handle const state) {
+  data::FTTNode & node = state->parent;
+  pool.release(*state);
+  queue.done(state);
+  this->expanded(node);
+
+  if (this->settled()) {
+    while (!queue.empty()) this->discard(queue.take());
+  }
+}
+
+void Evaluation::complete(data::FTTNode const & leaf) {
+  leaves.insert(path_score(metric, leaf));
+}
+
+void Evaluation::discard(Frontier::Handle const state) {
+  // An unexpanded node would otherwise read as a completed leaf.
+  data::FTTNode & node = state->parent;
+  node.pruned = true;
+  pool.release(*state);
+  queue.done(state);
+  this->expanded(node);
+}
+
+void Evaluation::expanded(data::FTTNode & node) {
+  // Children that were never queued (leaves, pruned) are final when grown, so
+  // sealing a node hashes them then; queued ones were sealed on their way up.
+  for (data::FTTNode * n = &node; n != nullptr;) {
+    auto it = unsealed.find(n);
+    if (--it->second.pending > 0) return;
+    data::FTTNode * const parent = it->second.parent;
+    unsealed.erase(it);
+    n->seal();
+    n = parent;
+  }
+}
+
+bool Evaluation::settled() const {
+  if (config.early_stop == 0 || leaves.size() < config.early_stop) return false;
+  auto const beating = std::distance(leaves.begin(), leaves.upper_bound(queue.bound()));
+  return static_cast<size_t>(beating) >= config.early_stop;
 }
 
 data::FTT const & Evaluation::retrieve() const {
   return result;
 }
 
+void Evaluation::on_node(NodeCallback callback) {
+  if (started)
+    throw autocog::utilities::InternalError("The node callback must be set before the evaluation starts");
+  node_callback = std::move(callback);
+}
+
+std::vector<unsigned> Evaluation::path_to(data::FTTNode const * node) const {
+  std::vector<unsigned> path;
+  for (auto it = links.find(node); it != links.end(); it = links.find(it->second.first))
+    path.push_back(it->second.second);
+  std::reverse(path.begin(), path.end());
+  return path;
+}
+
+void Evaluation::emit(data::FTTNode const * parent, data::FTTNode & node, bool const leaf) {
+  if (!node_callback) return;
+  if (parent) links.emplace(&node, std::make_pair(parent, static_cast<unsigned>(parent->children.size() - 1)));
+
+  Model & model = Manager::get_model(this->model);
+  node.text = node.tokens.empty() ? std::string{} : model.detokenize(node.tokens, false, false);
+
+  std::vector<unsigned> path = this->path_to(&node);
+  if (!node.pruned) {
+    float const score = path_score(metric, node);
+    bool lead;
+    if (leaf) lead = !best_complete || score < path_score(metric, *best);
+    else lead = !best_complete && (best == nullptr || path.size() > best_path.size() ||
+                                   (path.size() == best_path.size() && score < path_score(metric, *best)));
+    if (lead) {
+      best = &node;
+      best_path = path;
+      best_complete = leaf;
+    }
+  }
+  node_callback(NodeEvent{node, std::move(path), leaf, best_path, best_complete});
+}
+
 void Evaluation::initial() {
   data::FTA const & fta = prepared.fta;
   TokenSequence const & init_tokens = prepared.actions[0].tokens;
@@ -74,22 +353,35 @@ void Evaluation::initial() {
   result.root.uid     = a0.uid;
   result.root.field   = a0.field;
   result.root.indices = a0.indices;
-  if (!prepared.actions[0].successors.empty())
-    this->queue.emplace(prepared.actions[0].successors[0], result.root, init_tokens, std::nullopt);
+  bool const leaf = prepared.actions[0].successors.empty();
+  this->emit(nullptr, result.root, leaf);
+  if (!leaf) {
+    unsealed.emplace(&result.root, Unsealed{nullptr, 1});
+    this->queue.emplace(prepared.actions[0].successors[0], result.root, TokenPrefix().extend(init_tokens), 1);
+  } else {
+    this->complete(result.root);
+    result.root.seal();
+  }
 }
 
-void Evaluation::enqueue(ActionID const action, data::FTTNode & parent, PathState const & state) {
-  std::optional<ContextID> ctx = state.context;
-  ctx.reset(); // TODO context saving logic
-  std::vector<TokenID> tokens(state.tokens.begin(), state.tokens.end());
-  tokens.insert(tokens.end(), parent.tokens.begin(), parent.tokens.end());
-  this->queue.emplace(action, parent, tokens, ctx);
+void Evaluation::enqueue(ActionID const action, data::FTTNode & parent, PathState const & state,
+                         std::optional<ContextID> const source) {
+  PathState & next = this->queue.emplace(action, parent, state.tokens.extend(parent.tokens), state.depth + 1);
+  unsealed.emplace(&parent, Unsealed{&state.parent, 1});
+  unsealed.at(&state.parent).pending++;
+  if (source) pool.lease(next, source);
+  else if (pool.holds(state)) pool.lease(next, state.context);
 }
 
-std::pair<Model &, ContextID> Evaluation::restore(PathState & state) const {
+std::pair<Model &, ContextID> Evaluation::restore(PathState & state, size_t const hold) {
   Model & model = Manager::get_model(this->model);
-  if (!state.context) state.context = 0;
-  model.set_tokens(state.tokens, state.context.value());
+  if (pool.holds(state)) pool.touch(state);
+  else pool.lease(state, std::nullopt);
+  if (hold > state.tokens.size())
+    throw autocog::utilities::InternalError("Cannot hold back more tokens than the state has");
+  TokenSequence tokens;
+  state.tokens.flatten(tokens, hold);
+  model.set_tokens(tokens, state.context.value());
   return std::pair<Model &, ContextID>(model, state.context.value());
 }
 
@@ -7,25 +7,160 @@
 #include "autocog/data/fta.hxx"
 #include "autocog/data/ftt.hxx"
 
+#include <functional>
+#include <list>
+#include <memory>
 #include <optional>
-#include <queue>
+#include <set>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
 
 namespace autocog::backend::llama {
 
 class Model;
+struct TopkRequest;
+struct TopkResult;
+
+// Tokens on the path to a PathState: an immutable chain of segments (the
+// tokens of each FTT node on the path), shared by every state queued below
+// them. Queueing a state appends one segment instead of copying its prefix.
+class TokenPrefix {
+  public:
+    TokenPrefix() = default;
+
+    TokenPrefix extend(TokenSequence const & tokens) const;
+
+    size_t size() const { return head ? head->size : 0; }
+    bool empty() const { return !head; }
+    TokenID back() const { return head->tokens.back(); }
+    // All the tokens but the last `hold`, into `out`.
+    void flatten(TokenSequence & out, size_t const hold = 0) const;
+
+  private:
+    struct Segment {
+      std::shared_ptr<Segment const> parent;
+      TokenSequence tokens;  // never empty
+      size_t size;           // tokens up to the end of this segment
+    };
+    std::shared_ptr<Segment const> head;
+};
 
 struct PathState {
   ActionID const action;
   data::FTTNode & parent;
-  TokenSequence const tokens;
+  TokenPrefix const tokens;
   std::optional<ContextID> context;
+  unsigned lease{0};           // ContextPool stamp of `context` (0: not pooled)
+  unsigned depth{0};           // actions evaluated on the path to `parent`
 
   PathState(ActionID const action_, data::FTTNode & parent,
-            std::vector<TokenID> const & tokens_, std::optional<ContextID> context);
+            TokenPrefix const & tokens_, std::optional<ContextID> context);
 };
 
 struct EvaluationConfig {
   bool evaluate_text{true};
+  unsigned max_contexts{8};    // KV sequences an evaluation keeps for its queued states
+  unsigned queue_width{4};     // states expanded per depth by the "beam" queue metric
+  unsigned early_stop{0};      // stop once this many complete leaves beat every open state (0: never)
+};
+
+// Order in which queued PathStates are evaluated, from FTA::queue_metric.
+// Scores are negative logprobs of the state's parent node: lower is better.
+enum class QueueMetric {
+  BreadthFirst,   // "breadth-first" (or unset): FIFO
+  DepthFirst,     // "depth-first": LIFO
+  Logprob,        // "logprob": cumulative logprob
+  Perplexity,     // "perplexity": length-normalized logprob
+  BeamOfPaths     // "beam": depth by depth, the best `queue_width` of each depth
+};
+
+QueueMetric parse_queue_metric(std::string const & metric);
+
+// Score of the path ending at `node` under `metric`. A cumulative logprob never
+// improves as a path grows, so for QueueMetric::Logprob the score of an open
+// state bounds every leaf below it; the other metrics use it as a heuristic.
+float path_score(QueueMetric const metric, data::FTTNode const & node);
+
+// The open PathStates of an evaluation. States are owned here, at stable
+// addresses: take() removes the next one from the ordering but keeps it alive
+// (its children are queued while it is evaluated) until done().
+class Frontier {
+  public:
+    using Handle = std::list<PathState>::iterator;
+
+    Frontier(QueueMetric const metric_, unsigned const width_);
+
+    bool empty() const { return heap.empty(); }
+    PathState & emplace(ActionID const action, data::FTTNode & parent,
+                        TokenPrefix const & tokens, unsigned const depth);
+    Handle take();
+    void done(Handle const state);
+
+    // False if the beam of `state`'s depth is already full.
+    bool admit(PathState const & state);
+    // Best score among the open states (+inf when empty).
+    float bound() const;
+
+  private:
+    struct Entry {
+      unsigned rank;       // path depth for BeamOfPaths, else 0
+      float score;
+      long long order;     // insertion order (negated for DepthFirst)
+      Handle state;
+
+      // Heap order: the entry evaluated next is the smallest (rank, score, order).
+      static bool after(Entry const & a, Entry const & b) {
+        return std::tie(a.rank, a.score, a.order) > std::tie(b.rank, b.score, b.order);
+      }
+    };
+
+    QueueMetric const metric;
+    unsigned const width;
+    std::list<PathState> states;
+    std::vector<Entry> heap;
+    std::multiset<float> bounds;
+    std::vector<unsigned> admitted;   // per depth, for BeamOfPaths
+    long long next_order{0};
+};
+
+// KV sequences leased from the model by one Evaluation. A queued PathState owns
+// one slot, seeded with a fork of its parent's KV so restoring it only decodes
+// the tokens its parent did not already see. When the pool is full the least
+// recently used slot is taken over: its previous holder keeps a stale lease and
+// is given a new slot (rebuilt by set_tokens) when it is restored. One slot is
+// leased up front so that concurrent evaluations do not share sequences; if
+// the model has none left, states fall back to the model's shared sequence 0.
+class ContextPool {
+  public:
+    ContextPool(Model & model_, unsigned const capacity_);
+    ~ContextPool();
+    ContextPool(ContextPool const &) = delete;
+    ContextPool & operator=(ContextPool const &) = delete;
+
+    // True while states fall back to sequence 0 (no slot could be leased).
+    bool shared() const { return slots.empty(); }
+    bool holds(PathState const & state) const;
+    void lease(PathState & state, std::optional<ContextID> const source);
+    void touch(PathState const & state);
+    void release(PathState & state);
+
+  private:
+    struct Slot {
+      ContextID seq;
+      unsigned lease;            // stamp of the current holder (0: free)
+      unsigned long last_use;
+    };
+
+    Model & model;
+    unsigned const capacity;
+    std::vector<Slot> slots;
+    unsigned next_lease{1};
+    unsigned long clock{0};
+
+    size_t find(PathState const & state) const;  // slots.size() if not held
+    Slot * take();
 };
 
 // Append a child to `parent`: cumulative logprob/length, and the at-creation
@@ -33,9 +168,23 @@ struct EvaluationConfig {
 data::FTTNode & grow(data::FTTNode & parent, ActionID const id, data::FTA const & fta,
                      TokenSequence const & tokens, ProbaSequence const & logprobs);
 
+// A node just added to an evaluation's tree, as reported to its node callback
+// (Evaluation::on_node). Its `text` is already detokenized. Paths are child
+// indices from the root (empty for the root itself).
+struct NodeEvent {
+  data::FTTNode const & node;
+  std::vector<unsigned> path;
+  bool leaf;                      // `node` ends a complete path
+  // Leading path so far: the best complete path under the queue metric once
+  // there is one, before that the best of the deepest nodes grown.
+  std::vector<unsigned> best;
+  bool best_complete;
+};
+
 class Evaluation {
   public:
-    using Queue = std::queue<PathState>;
+    using NodeCallback = std::function<void(NodeEvent const &)>;
+
     EvaluationConfig const config;
 
   private:
@@ -43,23 +192,98 @@ class Evaluation {
     PreparedFTA prepared;      // model-bound tokenization over the portable FTA
     data::FTT result;          // the tree we grow in place (result.root is the root)
 
-    Queue queue;
+    QueueMetric const metric;
+    ContextPool pool;
+    Frontier queue;
+    std::multiset<float> leaves;   // path scores of the completed leaves
     bool started{false};
+    unsigned token_eval{0};        // tokens evaluated so far
+
+    // Streaming (see on_node): each node's parent and index in its children.
+    NodeCallback node_callback;
+    std::unordered_map<data::FTTNode const *, std::pair<data::FTTNode const *, unsigned>> links;
+    data::FTTNode const * best{nullptr};
+    std::vector<unsigned> best_path;
+    bool best_complete{false};
+
+    // Merkle sealing (see data::FTTNode::seal): the nodes queued for expansion
+    // whose subtree is not final yet, with their parent and their count of
+    // pending children (plus one until their own expansion is done).
+    struct Unsealed {
+      data::FTTNode * parent;
+      unsigned pending;
+    };
+    std::unordered_map<data::FTTNode const *, Unsealed> unsealed;
+
+    // A completion runs one batched decode step at a time (see poll/resume).
+    // Defined with the completion code; shared_ptr lets it stay incomplete here.
+    struct Completion;
+    std::shared_ptr<Completion> completion;
 
   protected:
-    std::pair<Model &, ContextID> restore(PathState & state) const;
+    // Bring the state's KV sequence to `state.tokens`, minus the last `hold`
+    // tokens (left pending for the caller to decode in its own batch).
+    std::pair<Model &, ContextID> restore(PathState & state, size_t const hold = 0);
 
     void initial();
-    void enqueue(ActionID const action, data::FTTNode & parent, PathState const & current);
+    // Queue `action` after the node `parent` just grown from `current`. The new
+    // state's slot is forked from `source` (a sequence holding the longest known
+    // prefix of the new state, e.g. a completion beam) or else from `current`'s.
+    void enqueue(ActionID const action, data::FTTNode & parent, PathState const & current,
+                 std::optional<ContextID> const source = std::nullopt);
+    // Record `leaf`, grown from the last action of a path.
+    void complete(data::FTTNode const & leaf);
+    // Report `node`, just grown from `parent` (nullptr for the root) and with
+    // its pruned flag set, to the node callback if any.
+    void emit(data::FTTNode const * parent, data::FTTNode & node, bool const leaf);
+    std::vector<unsigned> path_to(data::FTTNode const * node) const;
+    // Drop an open state without evaluating it: its path is left pruned.
+    void discard(Frontier::Handle const state);
+    // `node` has all its children: seal it, and its ancestors, once final.
+    void expanded(data::FTTNode & node);
+    bool settled() const;
+
+    // Release an evaluated state and stop early once settled.
+    void close(Frontier::Handle const state);
 
     unsigned evaluate_text       (PathState & state);
-    unsigned evaluate_completion (PathState & state);
     unsigned evaluate_choice     (PathState & state);
 
+    void begin_completion(Frontier::Handle const state);
+    void completion_requests(std::vector<TopkRequest> & requests);
+    bool completion_step(TopkResult const * results);  // true once the completion is over
+    bool prune_candidates();  // ends a step (after its rollouts, if any)
+    void finish_completion();
+
   public:
     Evaluation(EvaluationConfig const & config_, ModelID const model_, data::FTA const & fta_);
+
     unsigned advance(std::optional<unsigned> max_token_eval);
     data::FTT const & retrieve() const;
+
+    // Streaming: `callback` is called (on the advancing thread) for every node
+    // added to the tree from now on; set it before the first advance to see
+    // them all. Nodes are detokenized as they are grown.
+    void on_node(NodeCallback callback);
+
+    // Stepwise evaluation, for a caller batching the decode steps of several
+    // evaluations (Manager::advance_all). poll() evaluates queued states until
+    // one needs a batched decode step: it appends that step's requests and
+    // returns true, and resume() must then be given their results. It returns
+    // false once the queue is empty, or when `until` tokens have been evaluated
+    // (a state is never left half-evaluated). abort() drops the pending step
+    // after a failed decode: its state is left pruned.
+    bool poll(std::vector<TopkRequest> & requests, std::optional<unsigned> const until);
+    void resume(TopkResult const * results);
+    void abort();
+
+    ModelID model_id() const { return model; }
+    bool pending() const { return completion != nullptr; }
+    // States of this evaluation may decode into the model's shared sequence 0,
+    // and its pending step, if any, does.
+    bool shared_context() const { return pool.shared(); }
+    bool holds_shared_context() const;
+    unsigned evaluated() const { return token_eval; }
 };
 
 }
@@ -0,0 +1,313 @@
+
+#include "autocog/backend/llama/logits.hxx"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <utility>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#  define AUTOCOG_LOGITS_X86 1
+#  include <immintrin.h>
+#else
+#  define AUTOCOG_LOGITS_X86 0
+#endif
+
+namespace autocog::backend::llama {
+
+namespace {
+
+constexpr float NEG_INF = -std::numeric_limits<float>::infinity();
+
+// Bounded heap of the best (logit, token) pairs offered so far. The front is
+// the worst kept entry, so its logit is the bar a new token has to clear.
+class TopK {
+  public:
+    TopK(size_t const k_, VocabMask const * mask_) : k(k_), mask(mask_) { heap.reserve(k); }
+
+    float threshold() const {
+      if (k == 0) return std::numeric_limits<float>::infinity();
+      return heap.size() < k ? NEG_INF : heap.front().first;
+    }
+
+    bool allows(size_t const tok) const { return mask == nullptr || mask->test(tok); }
+
+    // Allowed tokens among [tok, tok + width), as the low bits of a word.
+    VocabMask::Word allowed(size_t const tok, unsigned const width) const {
+      return mask == nullptr ? ~VocabMask::Word{0} : mask->bits(tok, width);
+    }
+
+    // `tok` must be allowed by the mask.
+    void offer(TokenID const tok, float const logit) {
+      if (heap.size() < k) {
+        heap.emplace_back(logit, tok);
+        std::push_heap(heap.begin(), heap.end(), better);
+      } else if (better({logit, tok}, heap.front())) {
+        std::pop_heap(heap.begin(), heap.end(), better);
+        heap.back() = {logit, tok};
+        std::push_heap(heap.begin(), heap.end(), better);
+      }
+    }
+
+    void extract(float const lse, std::vector<TokenID> & tokens, std::vector<float> & logprobs) {
+      std::sort(heap.begin(), heap.end(), better);
+      tokens.clear();
+      logprobs.clear();
+      tokens.reserve(heap.size());
+      logprobs.reserve(heap.size());
+      for (auto const & [logit, tok] : heap) {
+        tokens.push_back(tok);
+        logprobs.push_back(lse - logit);
+      }
+    }
+
+  private:
+    using Entry = std::pair<float, TokenID>;
+
+    static bool better(Entry const & a, Entry const & b) {
+      return a.first > b.first || (a.first == b.first && a.second < b.second);
+    }
+
+    size_t const k;
+    VocabMask const * const mask;
+    std::vector<Entry> heap;
+};
+
+// Running log-sum-exp state for the elements left over by the vector loops.
+struct LogSumExp {
+  float max{NEG_INF};
+  float sum{0.0f};
+
+  void add(float const x) {
+    if (x == NEG_INF) return;
+    if (x > max) {
+      sum = sum * std::exp(max - x) + 1.0f;
+      max = x;
+    } else {
+      sum += std::exp(x - max);
+    }
+  }
+  void merge(float const m, float const s) {
+    if (m == NEG_INF) return;
+    if (m > max) {
+      sum = sum * std::exp(max - m) + s;
+      max = m;
+    } else {
+      sum += s * std::exp(m - max);
+    }
+  }
+  float value() const { return max + std::log(sum); }
+};
+
+float scan_scalar(float const * logits, size_t const n, size_t const start, TopK & topk, LogSumExp & lse) {
+  float bar = topk.threshold();
+  for (size_t i = start; i < n; ++i) {
+    float const x = logits[i];
+    lse.add(x);
+    if (x > bar && topk.allows(i)) {
+      topk.offer(static_cast<TokenID>(i), x);
+      bar = topk.threshold();
+    }
+  }
+  return lse.value();
+}
+
+#if AUTOCOG_LOGITS_X86
+
+// exp(x) as 2^n * p(r), with n = round(x / ln2) and r = x - n ln2 (Cephes
+// polynomial for expf, ~1 ulp). Inputs are clamped to the normal range.
+
+__attribute__((target("avx2,fma")))
+inline __m256 exp_avx2(__m256 x) {
+  x = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(-87.3f)), _mm256_set1_ps(88.3f));
+  __m256 const n = _mm256_round_ps(_mm256_mul_ps(x, _mm256_set1_ps(1.44269504088896341f)),
+                                   _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+  __m256 r = _mm256_fnmadd_ps(n, _mm256_set1_ps(0.693359375f), x);
+  r = _mm256_fnmadd_ps(n, _mm256_set1_ps(-2.12194440e-4f), r);
+  __m256 p = _mm256_set1_ps(1.9875691500e-4f);
+  p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.3981999507e-3f));
+  p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(8.3334519073e-3f));
+  p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(4.1665795894e-2f));
+  p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.6666665459e-1f));
+  p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(5.0000001201e-1f));
+  p = _mm256_fmadd_ps(p, _mm256_mul_ps(r, r), r);
+  p = _mm256_add_ps(p, _mm256_set1_ps(1.0f));
+  __m256i const e = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23);
+  return _mm256_mul_ps(p, _mm256_castsi256_ps(e));
+}
+
+__attribute__((target("avx2,fma")))
+float scan_avx2(float const * logits, size_t const n, TopK & topk) {
+  // Per-lane online log-sum-exp: the running sums are only rescaled when some
+  // lane sees a new maximum, which is rare once the first blocks are read.
+  __m256 max = _mm256_set1_ps(NEG_INF);
+  __m256 sum = _mm256_setzero_ps();
+  __m256 bar = _mm256_set1_ps(topk.threshold());
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 const x = _mm256_loadu_ps(logits + i);
+    if (_mm256_movemask_ps(_mm256_cmp_ps(x, max, _CMP_GT_OQ))) {
+      __m256 const next = _mm256_max_ps(max, x);
+      sum = _mm256_mul_ps(sum, exp_avx2(_mm256_sub_ps(max, next)));
+      max = next;
+    }
+    sum = _mm256_add_ps(sum, exp_avx2(_mm256_sub_ps(x, max)));
+
+    unsigned candidates = _mm256_movemask_ps(_mm256_cmp_ps(x, bar, _CMP_GT_OQ));
+    if (candidates && (candidates &= topk.allowed(i, 8))) {
+      for (; candidates; candidates &= candidates - 1) {
+        size_t const tok = i + __builtin_ctz(candidates);
+        if (logits[tok] > topk.threshold()) topk.offer(static_cast<TokenID>(tok), logits[tok]);
+      }
+      bar = _mm256_set1_ps(topk.threshold());
+    }
+  }
+
+  alignas(32) float lane_max[8];
+  alignas(32) float lane_sum[8];
+  _mm256_store_ps(lane_max, max);
+  _mm256_store_ps(lane_sum, sum);
+  LogSumExp lse;
+  for (unsigned l = 0; l < 8; ++l) lse.merge(lane_max[l], lane_sum[l]);
+  return scan_scalar(logits, n, i, topk, lse);
+}
+
+// GCC 12 false positive: -Wmaybe-uninitialized on the _mm512_undefined_*()
+// pass-through operand of the unmasked AVX-512 intrinsics.
+#if defined(__GNUC__) && !defined(__clang__)
+#  pragma GCC diagnostic push
+#  pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+__attribute__((target("avx512f")))
+inline __m512 exp_avx512(__m512 x) {
+  x = _mm512_min_ps(_mm512_max_ps(x, _mm512_set1_ps(-87.3f)), _mm512_set1_ps(88.3f));
+  __m512 const n = _mm512_roundscale_ps(_mm512_mul_ps(x, _mm512_set1_ps(1.44269504088896341f)),
+                                        _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+  __m512 r = _mm512_fnmadd_ps(n, _mm512_set1_ps(0.693359375f), x);
+  r = _mm512_fnmadd_ps(n, _mm512_set1_ps(-2.12194440e-4f), r);
+  __m512 p = _mm512_set1_ps(1.9875691500e-4f);
+  p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(1.3981999507e-3f));
+  p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(8.3334519073e-3f));
+  p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(4.1665795894e-2f));
+  p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(1.6666665459e-1f));
+  p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(5.0000001201e-1f));
+  p = _mm512_fmadd_ps(p, _mm512_mul_ps(r, r), r);
+  p = _mm512_add_ps(p, _mm512_set1_ps(1.0f));
+  __m512i const e = _mm512_slli_epi32(_mm512_add_epi32(_mm512_cvtps_epi32(n), _mm512_set1_epi32(127)), 23);
+  return _mm512_mul_ps(p, _mm512_castsi512_ps(e));
+}
+
+__attribute__((target("avx512f")))
+float scan_avx512(float const * logits, size_t const n, TopK & topk) {
+  __m512 max = _mm512_set1_ps(NEG_INF);
+  __m512 sum = _mm512_setzero_ps();
+  __m512 bar = _mm512_set1_ps(topk.threshold());
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m512 const x = _mm512_loadu_ps(logits + i);
+    if (_mm512_cmp_ps_mask(x, max, _CMP_GT_OQ)) {
+      __m512 const next = _mm512_max_ps(max, x);
+      sum = _mm512_mul_ps(sum, exp_avx512(_mm512_sub_ps(max, next)));
+      max = next;
+    }
+    sum = _mm512_add_ps(sum, exp_avx512(_mm512_sub_ps(x, max)));
+
+    unsigned candidates = _mm512_cmp_ps_mask(x, bar, _CMP_GT_OQ);
+    if (candidates && (candidates &= topk.allowed(i, 16))) {
+      for (; candidates; candidates &= candidates - 1) {
+        size_t const tok = i + __builtin_ctz(candidates);
+        if (logits[tok] > topk.threshold()) topk.offer(static_cast<TokenID>(tok), logits[tok]);
+      }
+      bar = _mm512_set1_ps(topk.threshold());
+    }
+  }
+
+  alignas(64) float lane_max[16];
+  alignas(64) float lane_sum[16];
+  _mm512_store_ps(lane_max, max);
+  _mm512_store_ps(lane_sum, sum);
+  LogSumExp lse;
+  for (unsigned l = 0; l < 16; ++l) lse.merge(lane_max[l], lane_sum[l]);
+  return scan_scalar(logits, n, i, topk, lse);
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+#  pragma GCC diagnostic pop
+#endif
+
+#endif
+
+float scan(float const * logits, size_t const n, TopK & topk, SimdLevel const level) {
+  switch (level) {
+#if AUTOCOG_LOGITS_X86
+    case SimdLevel::AVX512: return scan_avx512(logits, n, topk);
+    case SimdLevel::AVX2:   return scan_avx2(logits, n, topk);
+#endif
+    default: {
+      LogSumExp lse;
+      return scan_scalar(logits, n, 0, topk, lse);
+    }
+  }
+}
+
+}
+
+SimdLevel simd_level() {
+  static SimdLevel const level = [] {
+#if AUTOCOG_LOGITS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return SimdLevel::AVX512;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return SimdLevel::AVX2;
+#endif
+    return SimdLevel::Scalar;
+  }();
+  return level;
+}
+
+char const * simd_level_name(SimdLevel const level) {
+  switch (level) {
+    case SimdLevel::AVX512: return "avx512";
+    case SimdLevel::AVX2:   return "avx2";
+    case SimdLevel::Scalar: return "scalar";
+  }
+  return "scalar";
+}
+
+float log_sum_exp(float const * logits, size_t const n, SimdLevel const level) {
+  TopK none(0, nullptr);
+  return scan(logits, n, none, level);
+}
+
+void sequence_logprobs(
+  float const * logits, size_t const n_vocab, TokenID const * tokens, size_t const n,
+  float * logprobs, SimdLevel const level
+) {
+  for (size_t i = 0; i < n; ++i) {
+    float const * row = logits + i * n_vocab;
+    logprobs[i] = log_sum_exp(row, n_vocab, level) - row[tokens[i]];
+  }
+}
+
+float masked_topk(
+  float const * logits, VocabMask const & mask, size_t const k,
+  std::vector<TokenID> & tokens, std::vector<float> & logprobs,
+  SimdLevel const level
+) {
+  if (mask.sparse()) {
+    // Few allowed tokens: the log-sum-exp still needs every logit, but the
+    // top-k only gathers the allowed ones.
+    TopK topk(k, nullptr);
+    float const lse = log_sum_exp(logits, mask.size(), level);
+    for (TokenID tok : mask.allowed())
+      if (logits[tok] > topk.threshold()) topk.offer(tok, logits[tok]);
+    topk.extract(lse, tokens, logprobs);
+    return lse;
+  }
+  TopK topk(k, &mask);
+  float const lse = scan(logits, mask.size(), topk, level);
+  topk.extract(lse, tokens, logprobs);
+  return lse;
+}
+
+}
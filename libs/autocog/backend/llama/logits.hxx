@@ -0,0 +1,49 @@
+#ifndef AUTOCOG_BACKEND_LLAMA_LOGITS_HXX
+#define AUTOCOG_BACKEND_LLAMA_LOGITS_HXX
+
+#include "autocog/backend/llama/types.hxx"
+#include "autocog/backend/llama/vocab-mask.hxx"
+
+#include <cstddef>
+#include <vector>
+
+namespace autocog::backend::llama {
+
+// Instruction sets the logits kernels are compiled for. The kernels are built
+// with per-function target attributes and picked at runtime, so a portable
+// build still uses AVX2/AVX-512 where the CPU has them.
+enum class SimdLevel { Scalar, AVX2, AVX512 };
+
+// Widest level supported by both this build and the running CPU.
+SimdLevel simd_level();
+char const * simd_level_name(SimdLevel const level);
+
+// log(sum(exp(logits[0..n)))), computed in a single vectorized pass.
+float log_sum_exp(float const * logits, size_t const n, SimdLevel const level = simd_level());
+
+// Logprobs of a sequence: `logits` holds `n` contiguous rows of `n_vocab`
+// logits (llama's output layout), and logprobs[i] = lse(row i) - row i[tokens[i]]
+// (negative logprobs, as below), each row reduced in one vectorized pass.
+void sequence_logprobs(
+  float const * logits, size_t const n_vocab, TokenID const * tokens, size_t const n,
+  float * logprobs, SimdLevel const level = simd_level()
+);
+
+// Fused masked log-softmax and top-k: in one pass over the logits, computes
+// their log-sum-exp and keeps the `k` best tokens allowed by `mask` (one bit
+// per logit) in a bounded heap. Lanes above the current k-th best logit are
+// filtered with the mask's words, so disallowed tokens never reach the heap.
+// A sparse mask (VocabMask::index) skips the fused pass: the top-k gathers
+// only the allowed logits after a plain log-sum-exp. On return `tokens` / `logprobs` hold them best
+// first, as negative logprobs (lse - logit, the backend's convention). Equal
+// logits rank by token id; -inf logits are never selected. Returns the
+// log-sum-exp.
+float masked_topk(
+  float const * logits, VocabMask const & mask, size_t const k,
+  std::vector<TokenID> & tokens, std::vector<float> & logprobs,
+  SimdLevel const level = simd_level()
+);
+
+}
+
+#endif // AUTOCOG_BACKEND_LLAMA_LOGITS_HXX
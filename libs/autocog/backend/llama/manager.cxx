@@ -2,6 +2,9 @@
 #include "autocog/backend/llama/manager.hxx"
 #include "autocog/backend/llama/evaluation.hxx"
 
+#include <algorithm>
+#include <exception>
+#include <map>
 #include <string>
 #include <cstdlib>
 #include "autocog/utilities/exception.hxx"
@@ -9,6 +12,84 @@
 
 namespace autocog::backend::llama {
 
+namespace {
+
+// An evaluation taking part in continuous batching rounds.
+struct Active {
+  Evaluation * eval;
+  std::optional<unsigned> until;  // see Evaluation::poll
+  size_t first{0};                // of its requests in the round
+  bool done{false};
+  std::exception_ptr error{};     // why it failed (then also done)
+};
+
+// Drop `a`'s pending step, if any, and take it out of the rounds as failed.
+void fail(Active & a, std::exception_ptr const error) {
+  a.eval->abort();
+  a.done = true;
+  a.error = error;
+}
+
+// One round over the active evaluations of `model` (whose lock is held): each
+// evaluation runs to its next decode step, the steps are decoded together, and
+// each gets its results. Evaluations with nothing left to do (for now) are
+// marked done. An evaluation that throws fails alone; if the shared decode
+// fails, every evaluation of the round fails with it.
+void batch_round(Model & model, std::vector<Active> & active,
+                 std::vector<TopkRequest> & requests, std::vector<TopkResult> & results,
+                 bool const shared_wanted = false) {
+  // Evaluations without KV slots of their own all use sequence 0: while one
+  // of them has a step pending on it (or someone outside the rounds waits for
+  // it), the others have to wait.
+  bool shared_busy = shared_wanted || std::any_of(active.begin(), active.end(),
+                                 [](Active const & a) { return !a.done && a.eval->holds_shared_context(); });
+  requests.clear();
+  std::vector<Active *> round;
+  for (Active & a : active) {
+    if (a.done) continue;
+    if (!a.eval->pending() && a.eval->shared_context() && shared_busy) continue;
+    a.first = requests.size();
+    try {
+      if (a.eval->poll(requests, a.until)) {
+        round.push_back(&a);
+        shared_busy = shared_busy || a.eval->holds_shared_context();
+      } else {
+        a.done = true;
+      }
+    } catch (...) {
+      requests.resize(a.first);
+      fail(a, std::current_exception());
+    }
+  }
+  if (round.empty()) return;
+
+  try {
+    model.eval_topk_batch(requests, results);
+  } catch (...) {
+    for (Active * a : round) fail(*a, std::current_exception());
+    return;
+  }
+  for (Active * a : round) {
+    try {
+      a->eval->resume(results.data() + a->first);
+    } catch (...) {
+      fail(*a, std::current_exception());
+    }
+  }
+}
+
+std::string describe(std::exception_ptr const error) {
+  try {
+    std::rethrow_exception(error);
+  } catch (std::exception const & e) {
+    return e.what();
+  } catch (...) {
+    return "unknown error";
+  }
+}
+
+}
+
 
 void quiet_log_callback(enum ggml_log_level level, const char * text, [[maybe_unused]] void * user_data) {
     if (level == GGML_LOG_LEVEL_ERROR) {
@@ -29,8 +110,11 @@ Manager::~Manager() {
 
 void Manager::cleanup() {
   if (Manager::initialized) {
+    stop_workers();  // first: they use the models and evaluations
     evaluations.clear();
     models.clear();
+    model_mutexes.clear();
+    shared_contexts.clear();
     llama_backend_free();
     Manager::initialized = false;
   }
@@ -43,6 +127,8 @@ void Manager::initialize() {
 
   auto & manager = instance();
   manager.models.emplace_back(); // adding Model #0 which is a simple character level random number generator (for ultra-fast testing)
+  manager.model_mutexes.emplace_back();
+  manager.shared_contexts.emplace_back();
 
   std::atexit([]() { 
     instance().cleanup(); 
@@ -50,40 +136,133 @@ void Manager::initialize() {
   Manager::initialized = true;
 }
 
-ModelID Manager::add_model(std::string const & path, int n_ctx) {
+ModelID Manager::add_model(std::string const & path, int n_ctx, ModelConfig const & config) {
+  // Loading is done under the registry lock: models are added rarely, and the
+  // id is the model's index.
   auto & manager = instance();
+  std::lock_guard<std::mutex> guard(manager.mutex);
   ModelID id = manager.models.size();
-  manager.models.emplace_back(id, path, n_ctx);
+  manager.models.emplace_back(id, path, n_ctx, config);
+  manager.model_mutexes.emplace_back();
+  manager.shared_contexts.emplace_back();
   return id;
 }
 
 Model & Manager::get_model(ModelID id) {
   auto & manager = instance();
+  std::lock_guard<std::mutex> guard(manager.mutex);
+  if (id >= manager.models.size()) {
+    throw autocog::utilities::InternalError("Invalid Model ID: " + std::to_string(id));
+  }
   return manager.models[id];
 }
 
-EvalID Manager::add_eval(ModelID const model, data::FTA const & fta) {
+std::unique_lock<std::mutex> Manager::lock_model(ModelID id) {
   auto & manager = instance();
+  std::mutex * model_mutex = nullptr;
+  {
+    std::lock_guard<std::mutex> guard(manager.mutex);
+    if (id >= manager.model_mutexes.size()) {
+      throw autocog::utilities::InternalError("Invalid Model ID: " + std::to_string(id));
+    }
+    model_mutex = &manager.model_mutexes[id];
+  }
+  return std::unique_lock<std::mutex>(*model_mutex);
+}
+
+Manager::SharedContext & Manager::get_shared_context(ModelID id) {
+  auto & manager = instance();
+  std::lock_guard<std::mutex> guard(manager.mutex);
+  if (id >= manager.shared_contexts.size()) {
+    throw autocog::utilities::InternalError("Invalid Model ID: " + std::to_string(id));
+  }
+  return manager.shared_contexts[id];
+}
+
+std::unique_lock<std::mutex> Manager::lock_shared_context(ModelID id) {
+  SharedContext & shared = get_shared_context(id);
+  auto lock = lock_model(id);
+  if (shared.holder != nullptr) {
+    shared.waiting++;
+    shared.released.wait(lock, [&] { return shared.holder == nullptr; });
+    shared.waiting--;
+  }
+  return lock;
+}
+
+void Manager::hold_shared_context(ModelID id, Evaluation const * holder) {
+  SharedContext & shared = get_shared_context(id);
+  bool const released = shared.holder != nullptr && holder == nullptr;
+  shared.holder = holder;
+  if (released) shared.released.notify_all();
+}
+
+EvalID Manager::add_eval(ModelID const model, data::FTA const & fta, EvaluationConfig const & config) {
+  std::unique_ptr<Evaluation> eval;
+  {
+    auto lock = lock_model(model);
+    eval = std::make_unique<Evaluation>(config, model, fta);
+  }
+  auto & manager = instance();
+  std::lock_guard<std::mutex> guard(manager.mutex);
   EvalID id = manager.next_eval_id++;
-  EvaluationConfig config;
-  manager.evaluations.try_emplace(id, config, model, fta);
+  manager.evaluations.emplace(id, std::move(eval));
   return id;
 }
 
 Evaluation & Manager::get_eval(EvalID id) {
   auto & manager = instance();
+  std::lock_guard<std::mutex> guard(manager.mutex);
   auto it = manager.evaluations.find(id);
   if (it == manager.evaluations.end()) {
     throw autocog::utilities::InternalError("Invalid Evaluation ID: " + std::to_string(id));
   }
-  return it->second;
+  return *it->second;
 }
 
 unsigned Manager::advance(EvalID id, std::optional<unsigned> max_token_eval) {
   auto & eval = get_eval(id);
+  auto lock = eval.shared_context() ? lock_shared_context(eval.model_id()) : lock_model(eval.model_id());
   return eval.advance(max_token_eval);
 }
 
+std::vector<unsigned> Manager::advance_all(std::vector<EvalID> const & ids, std::optional<unsigned> max_token_eval) {
+  std::map<ModelID, std::vector<size_t>> by_model;   // indices in `ids`
+  std::vector<Evaluation *> evals;
+  std::vector<unsigned> num_token_eval(ids.size(), 0);
+  for (size_t i = 0; i < ids.size(); ++i) {
+    if (std::find(ids.begin(), ids.begin() + i, ids[i]) != ids.begin() + i) {
+      throw autocog::utilities::InternalError("Evaluation " + std::to_string(ids[i]) + " is advanced twice");
+    }
+    evals.push_back(&get_eval(ids[i]));
+    by_model[evals.back()->model_id()].push_back(i);
+  }
+
+  std::vector<TopkRequest> requests;
+  std::vector<TopkResult> results;
+  for (auto const & [model_id, indices] : by_model) {
+    Model & model = get_model(model_id);
+    bool const shared = std::any_of(indices.begin(), indices.end(),
+                                    [&](size_t i) { return evals[i]->shared_context(); });
+    auto lock = shared ? lock_shared_context(model_id) : lock_model(model_id);
+    std::vector<Active> active;
+    for (size_t i : indices) {
+      Evaluation & eval = *evals[i];
+      num_token_eval[i] = eval.evaluated();
+      std::optional<unsigned> until;
+      if (max_token_eval) until = eval.evaluated() + max_token_eval.value();
+      active.push_back(Active{&eval, until});
+    }
+    while (std::any_of(active.begin(), active.end(), [](Active const & a) { return !a.done; }))
+      batch_round(model, active, requests, results);
+    for (size_t i : indices) num_token_eval[i] = evals[i]->evaluated() - num_token_eval[i];
+    // The others ran to the end: report the first failure.
+    for (Active const & a : active)
+      if (a.error) std::rethrow_exception(a.error);
+  }
+  return num_token_eval;
+}
+
 data::FTT const & Manager::retrieve(EvalID id) {
   auto & eval = get_eval(id);
   return eval.retrieve();
@@ -91,8 +270,170 @@ data::FTT const & Manager::retrieve(EvalID id) {
 
 void Manager::rm_eval(EvalID id) {
   auto & manager = instance();
-  manager.evaluations.erase(id);
+  std::unique_ptr<Evaluation> eval;
+  {
+    std::lock_guard<std::mutex> guard(manager.mutex);
+    auto it = manager.evaluations.find(id);
+    if (it == manager.evaluations.end()) return;
+    eval = std::move(it->second);
+    manager.evaluations.erase(it);
+  }
+  // Its KV sequences go back to the model.
+  auto lock = lock_model(eval->model_id());
+  if (get_shared_context(eval->model_id()).holder == eval.get())
+    hold_shared_context(eval->model_id(), nullptr);
+  eval.reset();
+}
+
+void Manager::submit(EvalID id, std::optional<unsigned> max_token_eval, OnDone done) {
+  ModelID model = get_eval(id).model_id();
+  auto & manager = instance();
+  Worker * worker;
+  {
+    std::lock_guard<std::mutex> guard(manager.mutex);
+    auto & slot = manager.workers[model];
+    if (!slot) {
+      slot = std::make_unique<Worker>();
+      slot->thread = std::thread(&Manager::work, model, std::ref(*slot));
+    }
+    worker = slot.get();
+  }
+  {
+    std::lock_guard<std::mutex> guard(worker->mutex);
+    if (!worker->in_flight.insert(id).second) {
+      throw autocog::utilities::InternalError("Evaluation " + std::to_string(id) + " is already submitted");
+    }
+    worker->cancelled.erase(id);
+    worker->incoming.push_back(Worker::Submission{id, max_token_eval, std::move(done)});
+  }
+  worker->wakeup.notify_one();
 }
 
+bool Manager::cancel(EvalID id) {
+  auto & manager = instance();
+  std::vector<Worker *> workers;
+  {
+    std::lock_guard<std::mutex> guard(manager.mutex);
+    for (auto & [model, worker] : manager.workers) workers.push_back(worker.get());
+  }
+  for (Worker * worker : workers) {
+    {
+      std::lock_guard<std::mutex> guard(worker->mutex);
+      if (worker->in_flight.count(id) == 0) continue;
+      worker->cancelled.insert(id);
+    }
+    worker->wakeup.notify_one();
+    return true;
+  }
+  return false;
 }
 
+void Manager::stop_workers() {
+  auto & manager = instance();
+  std::map<ModelID, std::unique_ptr<Worker>> workers;
+  {
+    std::lock_guard<std::mutex> guard(manager.mutex);
+    workers.swap(manager.workers);
+  }
+  for (auto & [model, worker] : workers) {
+    {
+      std::lock_guard<std::mutex> guard(worker->mutex);
+      worker->stop = true;
+    }
+    worker->wakeup.notify_one();
+    worker->thread.join();
+  }
+}
+
+void Manager::work(ModelID model_id, Worker & worker) {
+  struct Running {
+    Worker::Submission submission;
+    Active active;
+  };
+  struct Finished {
+    Worker::Submission submission;
+    Outcome outcome;
+    std::string error;
+  };
+
+  Model & model = get_model(model_id);
+  std::vector<Running> running;
+  std::vector<Active> active;
+  std::vector<TopkRequest> requests;
+  std::vector<TopkResult> results;
+  while (true) {
+    std::vector<Worker::Submission> joining;
+    std::unordered_set<EvalID> cancelled;
+    bool stop;
+    {
+      std::unique_lock<std::mutex> lock(worker.mutex);
+      worker.wakeup.wait(lock, [&] { return worker.stop || !worker.incoming.empty() || !running.empty(); });
+      stop = worker.stop;
+      joining.swap(worker.incoming);
+      cancelled.swap(worker.cancelled);
+    }
+    if (stop) {
+      // The dropped submissions' callbacks may own what their evaluations
+      // reference (e.g. the FTA): remove the evaluations before them.
+      for (Running const & r : running) rm_eval(r.submission.id);
+      for (Worker::Submission const & submission : joining) rm_eval(submission.id);
+      return;
+    }
+
+    std::vector<Finished> finished;
+    bool yield;
+    {
+      auto lock = lock_model(model_id);
+      for (Worker::Submission & submission : joining) {
+        Evaluation * eval;
+        try {
+          eval = &get_eval(submission.id);
+        } catch (std::exception const & e) {
+          finished.push_back(Finished{std::move(submission), Outcome::Failed, e.what()});  // removed meanwhile
+          continue;
+        }
+        std::optional<unsigned> until;
+        if (submission.max_token_eval) until = eval->evaluated() + submission.max_token_eval.value();
+        running.push_back(Running{std::move(submission), Active{eval, until}});
+      }
+      for (Running & r : running) {
+        if (cancelled.count(r.submission.id) == 0) continue;
+        r.active.eval->abort();
+        r.active.done = true;
+        finished.push_back(Finished{r.submission, Outcome::Cancelled, {}});
+      }
+
+      active.clear();
+      for (Running const & r : running) active.push_back(r.active);
+      yield = get_shared_context(model_id).waiting > 0;
+      batch_round(model, active, requests, results, yield);
+      // The lock is released until the next round: a completion pending on
+      // sequence 0 keeps it from the other users meanwhile.
+      Evaluation const * holder = nullptr;
+      for (Active const & a : active)
+        if (!a.done && a.eval->holds_shared_context()) holder = a.eval;
+      hold_shared_context(model_id, holder);
+      for (size_t i = 0; i < running.size(); ++i) {
+        if (active[i].done && !running[i].active.done) {
+          if (active[i].error)
+            finished.push_back(Finished{running[i].submission, Outcome::Failed, describe(active[i].error)});
+          else
+            finished.push_back(Finished{running[i].submission, Outcome::Done, {}});
+        }
+        running[i].active = active[i];
+      }
+      running.erase(std::remove_if(running.begin(), running.end(), [](Running const & r) { return r.active.done; }),
+                    running.end());
+    }
+
+    if (yield) std::this_thread::yield();  // let the waiters take the model first
+    if (finished.empty()) continue;
+    {
+      std::lock_guard<std::mutex> guard(worker.mutex);
+      for (Finished const & f : finished) worker.in_flight.erase(f.submission.id);
+    }
+    for (Finished const & f : finished) f.submission.done(f.submission.id, f.outcome, f.error);
+  }
+}
+
+}
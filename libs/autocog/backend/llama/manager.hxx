@@ -5,43 +5,143 @@
 #include "autocog/backend/llama/model.hxx"
 #include "autocog/backend/llama/evaluation.hxx"
 
+#include <condition_variable>
 #include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include <unordered_map>
+#include <unordered_set>
 #include <optional>
 #include <string>
+#include <vector>
 
 namespace autocog::backend::llama {
 
+// Thread safety: `mutex` guards the registries (models, evaluations, ids) and
+// is only held briefly, never while waiting on a model. Work on a model (its
+// llama context, KV sequences and caches, and the evaluations using it) is
+// serialized by that model's lock (lock_model): advance, add_eval and rm_eval
+// take it, and callers take it around other mutating Model calls (through
+// lock_shared_context when decoding on sequence 0). An evaluation must not be
+// advanced and removed concurrently.
 class Manager {
   public:
     static bool initialized;
+
+    // How a submitted evaluation ended (see submit).
+    enum class Outcome { Done, Cancelled, Failed };
+    using OnDone = std::function<void(EvalID, Outcome, std::string const & error)>;
+
   private:
+    // Background evaluation of one model's submitted evaluations.
+    struct Worker {
+      struct Submission {
+        EvalID id;
+        std::optional<unsigned> max_token_eval;
+        OnDone done;
+      };
+
+      std::mutex mutex;                       // guards everything but `thread`
+      std::condition_variable wakeup;
+      std::vector<Submission> incoming;       // not yet in the rounds
+      std::unordered_set<EvalID> in_flight;   // incoming or in the rounds
+      std::unordered_set<EvalID> cancelled;
+      bool stop{false};
+      std::thread thread;
+    };
+
     // std::deque, not std::vector: get_model() hands out Model& by id (the
     // index), and deque keeps element references valid across growth (it never
     // relocates existing elements), so a reference stays good after a later
     // add_model. With vector, growth would relocate and dangle those references.
     std::deque<Model> models;
+    std::deque<std::mutex> model_mutexes;   // one per model, same index
+
+    // Sequence 0 of a model, used by the evaluations without a KV sequence of
+    // their own (see ContextPool) and by score_choices. A completion running in
+    // the worker's rounds keeps its tokens there between two rounds, while the
+    // model is unlocked: other users wait for it (see lock_shared_context).
+    struct SharedContext {
+      Evaluation const * holder{nullptr};   // guarded by the model's lock
+      unsigned waiting{0};                  // idem
+      std::condition_variable released;     // waited on with the model's lock
+    };
+    std::deque<SharedContext> shared_contexts;  // one per model, same index
 
     EvalID next_eval_id = 0;
-    std::unordered_map<EvalID, Evaluation> evaluations;
+    // Owned through a pointer: an evaluation is built (under its model's lock)
+    // before being registered.
+    std::unordered_map<EvalID, std::unique_ptr<Evaluation>> evaluations;
+
+    std::map<ModelID, std::unique_ptr<Worker>> workers;  // started by the first submit
+
+    std::mutex mutex;
 
     Manager() = default;
     void cleanup();
     static Manager & instance();
+    static void work(ModelID model, Worker & worker);
+    static SharedContext & get_shared_context(ModelID id);
+    // Under the model's lock: `holder` (or nobody) keeps sequence 0 until the next round.
+    static void hold_shared_context(ModelID id, Evaluation const * holder);
 
   public:
     ~Manager();
 
     static void initialize();
 
-    static ModelID add_model(std::string const & path, int n_ctx);
+    static ModelID add_model(std::string const & path, int n_ctx,
+                               ModelConfig const & config = ModelConfig{});
     static Model & get_model(ModelID id);
+    // Exclusive use of a model until the lock is released.
+    static std::unique_lock<std::mutex> lock_model(ModelID id);
+    // Same, for work decoding on sequence 0: waits until no submitted
+    // completion holds it between rounds.
+    static std::unique_lock<std::mutex> lock_shared_context(ModelID id);
 
-    static EvalID add_eval(ModelID const model_, data::FTA const & fta);
+    static EvalID add_eval(ModelID const model_, data::FTA const & fta,
+                           EvaluationConfig const & config = EvaluationConfig{});
     static Evaluation & get_eval(EvalID id);
     static unsigned advance(EvalID id, std::optional<unsigned> max_token_eval=std::nullopt);
+    // Continuous batching: advance several evaluations together. Each round, the
+    // pending decode step of every active evaluation of a model (the live beams
+    // of its completion, on its own KV sequences) goes into shared llama_decode
+    // calls; an evaluation leaves the rounds once done or past `max_token_eval`
+    // (counted per evaluation). Returns the tokens evaluated by each of `ids`.
+    static std::vector<unsigned> advance_all(std::vector<EvalID> const & ids,
+                                             std::optional<unsigned> max_token_eval=std::nullopt);
     static data::FTT const & retrieve(EvalID id);
     static void rm_eval(EvalID id);
+
+    // Asynchronous evaluation: queue `id` for its model's worker thread, which
+    // runs the advance_all rounds over every submitted evaluation of the model
+    // (new ones join at the next round), so callers need no thread of their
+    // own. `done` is called on the worker thread, without any lock held, once
+    // the evaluation is over or has evaluated `max_token_eval` more tokens
+    // (Outcome::Done), was cancelled, or failed (on its own error, or when the
+    // round's shared decode fails, with every evaluation of the round). The
+    // evaluation stays registered: `done` may remove it or submit it again.
+    // `done` may own what the evaluation references (e.g. its FTA): it is only
+    // destroyed once the evaluation is removed.
+    //
+    // Any number of evaluations can be in flight, but each one holds a KV
+    // sequence of its own (see ContextPool) and a model has
+    // Model::DEFAULT_N_SEQ - 1 of them, also used by the prefix cache and by
+    // completion beams. Evaluations started once they are all leased share
+    // sequence 0 and decode one at a time: past a few dozen evaluations in
+    // flight per model, throughput stops growing.
+    static void submit(EvalID id, std::optional<unsigned> max_token_eval, OnDone done);
+    // Stop a submitted evaluation at the next round (its pending step, if any,
+    // is dropped). False if it is not in flight.
+    static bool cancel(EvalID id);
+    // Join the worker threads, dropping the submissions still in flight (their
+    // `done` is not called and their evaluations are removed). Also done by
+    // cleanup; embedders whose callbacks need an interpreter lock call it
+    // before tearing the interpreter down.
+    static void stop_workers();
 };
 
 }
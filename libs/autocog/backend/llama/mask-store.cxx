@@ -0,0 +1,106 @@
+
+#include "autocog/backend/llama/mask-store.hxx"
+#include "autocog/logging.hxx"
+
+#include <cctype>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <system_error>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace autocog::backend::llama {
+
+namespace {
+
+constexpr size_t HEADER_SIZE = sizeof(MaskStore::MAGIC) + sizeof(std::uint64_t);
+
+// Refs come from FTAs: only cache those that are plain file names.
+bool cacheable(std::string const & ref) {
+  if (ref.empty() || ref[0] == '.') return false;
+  for (char const c : ref)
+    if (!std::isalnum(static_cast<unsigned char>(c)) && c != '_' && c != '-' && c != '.') return false;
+  return true;
+}
+
+}
+
+MaskStore::MaskStore(std::string const & dir, std::string const & model_sha) :
+  dir_((std::filesystem::path(dir) / model_sha).string())
+{}
+
+std::string MaskStore::path(std::string const & ref) const {
+  return (std::filesystem::path(dir_) / (ref + ".mask")).string();
+}
+
+std::optional<VocabMask> MaskStore::load(std::string const & ref, size_t const vocab_size) const {
+  if (!cacheable(ref)) return std::nullopt;
+  std::string const file = path(ref);
+  int const fd = ::open(file.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return std::nullopt;
+
+  size_t const n_words = (vocab_size + VocabMask::WORD_BITS - 1) / VocabMask::WORD_BITS;
+  size_t const expected = HEADER_SIZE + n_words * sizeof(VocabMask::Word);
+  struct stat st;
+  if (::fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) != expected) {
+    ::close(fd);
+    SPDLOG_LOGGER_WARN(autocog::log(), "Ignoring vocab mask file with unexpected size: {}", file);
+    return std::nullopt;
+  }
+  void * const addr = ::mmap(nullptr, expected, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);  // the mapping stays valid
+  if (addr == MAP_FAILED) return std::nullopt;
+  std::shared_ptr<void const> mapping(addr, [expected](void const * p) { ::munmap(const_cast<void *>(p), expected); });
+
+  auto const * bytes = static_cast<unsigned char const *>(addr);
+  std::uint64_t stored_size;
+  std::memcpy(&stored_size, bytes + sizeof(MAGIC), sizeof(stored_size));
+  if (std::memcmp(bytes, MAGIC, sizeof(MAGIC)) != 0 || stored_size != vocab_size) {
+    SPDLOG_LOGGER_WARN(autocog::log(), "Ignoring malformed vocab mask file: {}", file);
+    return std::nullopt;
+  }
+  // The header keeps the words 8-byte aligned in the (page-aligned) mapping.
+  auto const * words = reinterpret_cast<VocabMask::Word const *>(bytes + HEADER_SIZE);
+  return VocabMask::view(vocab_size, words, std::move(mapping));
+}
+
+void MaskStore::save(std::string const & ref, VocabMask const & mask) const {
+  if (!cacheable(ref)) return;
+  std::string const file = path(ref);
+  std::error_code ec;
+  std::filesystem::create_directories(dir_, ec);
+  if (ec) {
+    SPDLOG_LOGGER_WARN(autocog::log(), "Cannot create vocab mask cache directory {}: {}", dir_, ec.message());
+    return;
+  }
+
+  // Unique per process and thread: masks may be saved from background builds.
+  std::string const tmp = file + ".tmp." + std::to_string(::getpid()) + "." + std::to_string(std::hash<std::thread::id>{}(std::this_thread::get_id()));
+  {
+    std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+    std::uint64_t const size = mask.size();
+    out.write(MAGIC, sizeof(MAGIC));
+    out.write(reinterpret_cast<char const *>(&size), sizeof(size));
+    out.write(reinterpret_cast<char const *>(mask.words()), static_cast<std::streamsize>(mask.n_words() * sizeof(VocabMask::Word)));
+    if (!out.flush()) {
+      SPDLOG_LOGGER_WARN(autocog::log(), "Cannot write vocab mask file: {}", tmp);
+      out.close();
+      std::filesystem::remove(tmp, ec);
+      return;
+    }
+  }
+  std::filesystem::rename(tmp, file, ec);
+  if (ec) {
+    SPDLOG_LOGGER_WARN(autocog::log(), "Cannot write vocab mask file {}: {}", file, ec.message());
+    std::filesystem::remove(tmp, ec);
+  }
+}
+
+}
@@ -0,0 +1,42 @@
+#ifndef AUTOCOG_BACKEND_LLAMA_MASK_STORE_HXX
+#define AUTOCOG_BACKEND_LLAMA_MASK_STORE_HXX
+
+#include "autocog/backend/llama/vocab-mask.hxx"
+
+#include <optional>
+#include <string>
+
+namespace autocog::backend::llama {
+
+// On-disk cache of resolved vocab masks, shared across processes. A mask only
+// depends on the model's vocabulary and on the vocab expression, so files are
+// keyed by the model's SHA-256 and the vocab ref (itself a hash of the
+// expression): `<dir>/<model sha>/<ref>.mask`.
+//
+// A file is a 16-byte header (MAGIC, then the vocab size as a little-endian
+// uint64) followed by the packed words. Loading maps the file read-only and
+// returns a VocabMask view of it, so a cached mask costs neither a read nor a
+// copy until it is modified. Files are written to a temporary name and renamed,
+// so concurrent writers and readers never see a partial mask.
+//
+// The store is a cache: unreadable or malformed files are ignored (and
+// rebuilt), refs that are not plain file names are not cached, and failures
+// to write are logged, never thrown.
+class MaskStore {
+  public:
+    static constexpr char MAGIC[8] = {'A', 'C', 'V', 'M', 'A', 'S', 'K', '1'};
+
+    MaskStore(std::string const & dir, std::string const & model_sha);
+
+    std::optional<VocabMask> load(std::string const & ref, size_t const vocab_size) const;
+    void save(std::string const & ref, VocabMask const & mask) const;
+
+    std::string path(std::string const & ref) const;
+
+  private:
+    std::string dir_;   // <dir>/<model sha>
+};
+
+}
+
+#endif // AUTOCOG_BACKEND_LLAMA_MASK_STORE_HXX
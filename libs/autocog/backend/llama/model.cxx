@@ -1,7 +1,10 @@
 
 #include "autocog/backend/llama/model.hxx"
+#include "autocog/backend/llama/logits.hxx"
+#include "autocog/backend/llama/regex-dfa.hxx"
 #include "autocog/logging.hxx"
 
+#include "autocog/data/utility.hxx"
 #include "autocog/data/vocab.hxx"
 
 #include <regex>
@@ -10,9 +13,14 @@
 
 #include <cmath>
 #include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <filesystem>
 #include <fstream>
 #include <iterator>
-#include "picosha2.h"
+#include <thread>
 #include "autocog/utilities/exception.hxx"
 
 
@@ -22,19 +30,23 @@ namespace autocog::backend::llama {
 Model::Model() :
   id(0),
   model(nullptr),
-  contexts(),
-  rng(42)
-{
-  contexts.push_back(nullptr);
-  tokens.emplace_back();
-}
-
-Model::Model(ModelID const id_, std::string const & model_path, int n_ctx) :
+  context(nullptr),
+  tokens(DEFAULT_N_SEQ),
+  leased_(DEFAULT_N_SEQ, false),
+  rng(42),
+  surfaces_(std::make_unique<TokenSurfaces>())
+{}
+
+Model::Model(ModelID const id_, std::string const & model_path, int n_ctx, ModelConfig const & config, unsigned n_seq) :
   id(id_),
   model(nullptr),
-  contexts(),
+  context(nullptr),
+  tokens(),
+  leased_(),
   rng(0),
-  source_(model_path)
+  source_(model_path),
+  surfaces_(std::make_unique<TokenSurfaces>()),
+  prefix_cache_(n_ctx / PREFIX_CACHE_FRACTION, PREFIX_CACHE_ENTRIES)
 {
   // Load model
   llama_model_params model_params = llama_model_default_params();
@@ -43,63 +55,129 @@ Model::Model(ModelID const id_, std::string const & model_path, int n_ctx) :
     throw autocog::ModelError("Failed to load model from: " + model_path, id, "load");
   }
    
-  // Create context parameters
+  // Create context parameters: one context holding `n_seq` KV sequences. The
+  // cache is unified so every sequence can use the full `n_ctx` (sequences
+  // forked from a common prefix share its cells).
   llama_context_params ctx_params = llama_context_default_params();
   ctx_params.n_ctx = n_ctx;
+  ctx_params.n_seq_max = n_seq;
+  ctx_params.kv_unified = true;
+  if (config.n_batch > 0) ctx_params.n_batch = config.n_batch;
+  if (config.n_ubatch > 0) ctx_params.n_ubatch = config.n_ubatch;
+  if (config.n_threads > 0) {
+    ctx_params.n_threads = config.n_threads;
+    ctx_params.n_threads_batch = config.n_threads;
+  }
    
-  // Create single context with ID=0 (and associated token sequence)
-  llama_context * ctx = llama_init_from_model(this->model, ctx_params);
-  if (!ctx) {
+  // Create the context (and the token sequence tracked for each KV sequence)
+  this->context = llama_init_from_model(this->model, ctx_params);
+  if (!this->context) {
     llama_model_free(this->model);
     throw autocog::ModelError("Failed to create llama context", id, "context");
   }
-  this->contexts.push_back(ctx);
-  this->tokens.emplace_back(); 
+  this->tokens.resize(n_seq);
+  this->leased_.assign(n_seq, false);
+}
+
+// Builds the primed vocab masks in the background, one at a time: each build
+// is parallel already (see parallel_ranges). Jobs run on the Model (`this`),
+// which joins the thread before it is destroyed or moved.
+struct Model::MaskBuilder {
+  using Job = std::packaged_task<VocabMask()>;
+
+  std::mutex mutex;
+  std::condition_variable wakeup;
+  std::deque<std::pair<std::string, Job>> queue;
+  bool stop{false};
+  std::thread thread;
+
+  void run() {
+    while (true) {
+      Job job;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        wakeup.wait(lock, [&] { return stop || !queue.empty(); });
+        if (queue.empty()) return;
+        job = std::move(queue.front().second);
+        queue.pop_front();
+      }
+      job();
+    }
+  }
+
+  // The job of `ref` if it has not started yet.
+  std::optional<Job> take(std::string const & ref) {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto it = queue.begin(); it != queue.end(); ++it) {
+      if (it->first != ref) continue;
+      Job job = std::move(it->second);
+      queue.erase(it);
+      return job;
+    }
+    return std::nullopt;
+  }
+};
+
+void Model::join_mask_builder() {
+  if (!mask_builder_) return;
+  {
+    std::lock_guard<std::mutex> lock(mask_builder_->mutex);
+    mask_builder_->stop = true;
+  }
+  mask_builder_->wakeup.notify_one();
+  mask_builder_->thread.join();  // once every queued job ran
+  mask_builder_.reset();
 }
 
 Model::~Model() {
+  // Background mask builds use the vocab: let them finish first.
+  join_mask_builder();
+
   if (this->id == 0) {
     // NOP
   } else {
-    for (auto* ctx : this->contexts) if (ctx) llama_free(ctx);
-    contexts.clear();
+    if (this->context) llama_free(this->context);
     if (this->model) llama_model_free(model);
   }
 }
 
 Model::Model(Model && o) noexcept
-  : id(o.id),
+  : id((o.join_mask_builder(), o.id)),  // pending builds run on `o`: finish them first
     model(o.model),
-    contexts(std::move(o.contexts)),
+    context(o.context),
     tokens(std::move(o.tokens)),
+    leased_(std::move(o.leased_)),
     rng(std::move(o.rng)),
     source_(std::move(o.source_)),
     sha_cache_(std::move(o.sha_cache_)),
     vocab_mask_cache_(std::move(o.vocab_mask_cache_)),
-    full_vocab_mask_(std::move(o.full_vocab_mask_))
+    full_vocab_mask_(std::move(o.full_vocab_mask_)),
+    pending_masks_(std::move(o.pending_masks_)),
+    mask_store_(std::move(o.mask_store_)),
+    mask_cache_dir_(std::move(o.mask_cache_dir_)),
+    mask_builder_(),
+    surfaces_(std::move(o.surfaces_)),
+    prefix_cache_(std::move(o.prefix_cache_)),
+    prefill_stats_(o.prefill_stats_)
 {
   // Transfer ownership: leave the moved-from object owning nothing, so its
-  // destructor frees neither the model nor any context. (std::move on a vector
-  // leaves it empty in practice, but clear() makes the no-op teardown explicit.)
+  // destructor frees neither the model nor the context.
   o.model = nullptr;
-  o.contexts.clear();
+  o.context = nullptr;
 }
 
 void Model::check_context_id(ContextID const id) const {
-  if (this->contexts.size() != this->tokens.size()) {
-    throw autocog::utilities::InternalError("Discrepancy between contexts and tokens vector size");
-  }
-  if (id >= this->contexts.size()) {
+  if (id >= this->tokens.size()) {
     throw autocog::utilities::InternalError("Invalid context ID: " + std::to_string(id));
   }
-  if (this->contexts[id] == nullptr && this->id != 0) {
-    throw autocog::utilities::InternalError("Missing context ID: " + std::to_string(id));
+  if (this->context == nullptr && this->id != 0) {
+    throw autocog::utilities::InternalError("Missing llama context for model: " + std::to_string(this->id));
   }
 }
 
-llama_context * Model::get_context(ContextID const id) const {
-  check_context_id(id);
-  return this->contexts[id];
+llama_context * Model::get_context() const {
+  check_context_id(0);
+  return this->context;
 }
 
 TokenSequence & Model::get_tokens(ContextID const id) {
@@ -221,34 +299,159 @@ size_t Model::vocab_size() const {
   return llama_vocab_n_tokens(this->get_vocab());
 }
 
-static float logit_to_log_sum_exp(float * logit, unsigned vocab_size) {
-  // Find max logit for numerical stability
-  float max_logit = *std::max_element(logit, logit + vocab_size);
+namespace {
+
+// Owning llama_batch (llama_batch_init/llama_batch_free) filled one token at a
+// time with an explicit position and KV sequence(s), since llama_batch_get_one
+// always targets sequence 0. A token added to several sequences is decoded once
+// and its KV cell is shared by all of them.
+struct Batch {
+  llama_batch batch;
+
+  explicit Batch(size_t capacity, size_t n_seq_max = 1) : batch(llama_batch_init(static_cast<int32_t>(capacity), 0, static_cast<int32_t>(n_seq_max))) {}
+  ~Batch() { llama_batch_free(batch); }
+  Batch(Batch const &) = delete;
+  Batch & operator=(Batch const &) = delete;
+
+  void add(TokenID token, llama_pos pos, ContextID seq, bool logits) {
+    int32_t const i = batch.n_tokens++;
+    batch.token[i]     = token;
+    batch.pos[i]       = pos;
+    batch.n_seq_id[i]  = 1;
+    batch.seq_id[i][0] = static_cast<llama_seq_id>(seq);
+    batch.logits[i]    = logits;
+  }
 
-  // Compute log-sum-exp for normalization
-  float log_sum_exp = 0.0f;
-  for (unsigned i = 0; i < vocab_size; ++i) {
-    log_sum_exp += std::exp(logit[i] - max_logit);
+  void add(TokenID token, llama_pos pos, std::vector<ContextID> const & seqs, bool logits) {
+    int32_t const i = batch.n_tokens++;
+    batch.token[i]     = token;
+    batch.pos[i]       = pos;
+    batch.n_seq_id[i]  = static_cast<int32_t>(seqs.size());
+    for (size_t s = 0; s < seqs.size(); ++s) batch.seq_id[i][s] = static_cast<llama_seq_id>(seqs[s]);
+    batch.logits[i]    = logits;
+  }
+};
+
+// Token trie of the choices scored by Model::eval_choices. Node 0 is the last
+// token of the context (or a placeholder for an empty context); every other
+// node is a choice token at position context.size() - 1 + depth. Only the nodes
+// with children are decoded: their logits score the children.
+struct ChoiceTrie {
+  struct Node {
+    TokenID token;
+    size_t parent;
+    size_t depth;
+    std::map<TokenID, size_t> children;
+    float logprob{0.f};                  // of `token` given its ancestors
+    std::vector<ContextID> seqs;         // sequences it is decoded into (this round)
+    bool scored{false};                  // children's logprobs are set
+
+    Node(TokenID token_, size_t parent_, size_t depth_) : token(token_), parent(parent_), depth(depth_) {}
+  };
+  std::vector<Node> nodes;
+  std::vector<std::vector<size_t>> paths;  // nodes of each choice, root excluded
+
+  ChoiceTrie(TokenID const root, std::vector<TokenSequence> const & choices) {
+    nodes.emplace_back(root, 0, 0);
+    for (auto const & choice : choices) {
+      std::vector<size_t> & path = paths.emplace_back();
+      size_t cur = 0;
+      for (TokenID const tok : choice) {
+        auto it = nodes[cur].children.find(tok);
+        if (it == nodes[cur].children.end()) {
+          size_t const child = nodes.size();
+          nodes[cur].children.emplace(tok, child);
+          nodes.emplace_back(tok, cur, nodes[cur].depth + 1);
+          cur = child;
+        } else {
+          cur = it->second;
+        }
+        path.push_back(cur);
+      }
+    }
   }
-  return max_logit + std::log(log_sum_exp);
-}
 
-static void sample_logprobs(llama_context * ctx, std::vector<bool> const & mask, std::vector<std::pair<TokenID, float>> & candidates) {
-  float * logits = llama_get_logits(ctx);
-  float log_sum_exp = logit_to_log_sum_exp(logits, mask.size());
+  bool decoded(size_t const n) const { return !nodes[n].children.empty(); }
 
-  for (unsigned tok = 0; tok < mask.size(); tok++) {
-    if (mask[tok]) {
-      candidates.emplace_back(tok, log_sum_exp - logits[tok]);
+  // Decoded nodes none of whose children are decoded: one sequence each.
+  std::vector<size_t> branches() const {
+    std::vector<size_t> result;
+    for (size_t n = 0; n < nodes.size(); ++n) {
+      if (!decoded(n)) continue;
+      bool inner = false;
+      for (auto const & [tok, child] : nodes[n].children) inner = inner || decoded(child);
+      if (!inner) result.push_back(n);
     }
+    return result;
+  }
+};
+
+}
+
+// RNG model: exponential logprobs (λ=0.5, mean=2)
+// Produces realistic peaked distribution: clear winner, long tail.
+// Pruning thresholds work naturally (top 2-3 candidates survive).
+static void sample_rng_logprobs(std::mt19937 & rng, VocabMask const & mask, std::vector<std::pair<TokenID, float>> & candidates) {
+  std::exponential_distribution<float> dist(0.5f);
+  mask.for_each([&](TokenID const tok) {
+    // Restrict to printable ASCII (32-126), newline, tab
+    if (tok < 256 && !(tok >= 32 && tok <= 126) && tok != '\n' && tok != '\t') return;
+    candidates.emplace_back(tok, dist(rng));
+  });
+}
+
+static void select_topk(
+  std::vector<std::pair<TokenID, float>> & candidates, size_t max_candidates,
+  std::vector<TokenID> & topk_tokens, std::vector<float> & topk_logprobs
+) {
+  std::sort(candidates.begin(), candidates.end(), [](const auto& a, const auto& b) {
+    return a.second < b.second;
+  });
+
+  size_t k = std::min(max_candidates, candidates.size());
+  topk_tokens.clear();
+  topk_logprobs.clear();
+  topk_tokens.reserve(k);
+  topk_logprobs.reserve(k);
+  for (size_t i = 0; i < k; ++i) {
+    topk_tokens.push_back(candidates[i].first);
+    topk_logprobs.push_back(candidates[i].second);
   }
 }
 
-static float retrieve_logprob(llama_context * ctx, unsigned vocab_size, TokenID token) {
-  float * logits = llama_get_logits(ctx);
-  return logit_to_log_sum_exp(logits, vocab_size) - logits[token];
+// Runs fn(begin, end) over [0, n) split into chunks of whole VocabMask words
+// (so chunks never share a word), on up to one thread per core. Small ranges
+// run inline. The first exception thrown by a chunk is rethrown.
+template <typename F>
+static void parallel_ranges(size_t const n, F const & fn) {
+  constexpr size_t MIN_CHUNK = 8192;
+  size_t const cores = std::max(1u, std::thread::hardware_concurrency());
+  size_t const threads = std::min(cores, (n + MIN_CHUNK - 1) / MIN_CHUNK);
+  if (threads <= 1) {
+    fn(0, n);
+    return;
+  }
+  size_t const words = (n + VocabMask::WORD_BITS - 1) / VocabMask::WORD_BITS;
+  size_t const chunk = (words + threads - 1) / threads * VocabMask::WORD_BITS;
+
+  std::exception_ptr error;
+  std::mutex error_mutex;
+  auto run = [&](size_t const begin) {
+    try {
+      fn(begin, std::min(n, begin + chunk));
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(error_mutex);
+      if (!error) error = std::current_exception();
+    }
+  };
+  std::vector<std::thread> workers;
+  for (size_t begin = chunk; begin < n; begin += chunk) workers.emplace_back(run, begin);
+  run(0);
+  for (auto & worker : workers) worker.join();
+  if (error) std::rethrow_exception(error);
 }
 
+
 static llama_pos find_common_prefix(const TokenSequence& a, const TokenSequence& b) {
   llama_pos common = 0;
   size_t min_size = std::min(a.size(), b.size());
@@ -261,18 +464,18 @@ static llama_pos find_common_prefix(const TokenSequence& a, const TokenSequence&
 unsigned Model::set_tokens(TokenSequence const & target_tokens, ContextID const id) {
   SPDLOG_LOGGER_TRACE(autocog::log(), "Model::set_tokens(...):");
   SPDLOG_LOGGER_TRACE(autocog::log(), " > target_tokens.size() =");
+  check_context_id(id);
   if (this->id == 0) {
     this->tokens[id] = target_tokens;
     return target_tokens.size();
   }
-  check_context_id(id);
 
   TokenSequence & current_tokens = this->get_tokens(id);
   SPDLOG_LOGGER_TRACE(autocog::log(), " > current_tokens.size() =");
-  llama_context * ctx = this->get_context(id);
+  llama_context * ctx = this->get_context();
   unsigned n_ctx = llama_n_ctx(ctx);
-  if (current_tokens.size() > n_ctx) {
-    throw autocog::ModelError("Token sequence too long: " + std::to_string(current_tokens.size()) + " > " + std::to_string(n_ctx), id, "context_overflow");
+  if (target_tokens.size() > n_ctx) {
+    throw autocog::ModelError("Token sequence too long: " + std::to_string(target_tokens.size()) + " > " + std::to_string(n_ctx), this->id, "context_overflow");
   }
 
   llama_memory_t mem = llama_get_memory(ctx);
@@ -282,44 +485,82 @@ unsigned Model::set_tokens(TokenSequence const & target_tokens, ContextID const
   llama_pos common_prefix = find_common_prefix(current_tokens, target_tokens);
   SPDLOG_LOGGER_TRACE(autocog::log(), " > common_prefix =");
 
-  unsigned num_token_eval = 0;
-  if (common_prefix == 0) {
-    llama_memory_seq_rm(mem, 0, 0, -1);
-
-    llama_batch batch = llama_batch_get_one(const_cast<TokenID*>(target_tokens.data()), target_tokens.size());
-    if (llama_decode(ctx, batch) != 0) {
-      throw autocog::ModelError("Failed to set the token sequence", id, "set_tokens");
+  if (static_cast<size_t>(common_prefix) < target_tokens.size()) {
+    auto match = this->prefix_cache_.lookup(target_tokens, common_prefix);
+    if (match) {
+      SPDLOG_LOGGER_TRACE(autocog::log(), " > prefix cache hit: {} tokens", match->length);
+      this->fork_sequence(match->seq, id);
+      common_prefix = find_common_prefix(current_tokens, target_tokens);
     }
-    num_token_eval += target_tokens.size();
-  } else {
-    if (static_cast<size_t>(common_prefix) < current_tokens.size()) {
-      llama_memory_seq_rm(mem, 0, common_prefix, -1);
-    }
-
-    if (static_cast<size_t>(common_prefix) < target_tokens.size()) {
-      TokenSequence extension(target_tokens.begin() + common_prefix, target_tokens.end());
+  }
 
-      llama_batch batch = llama_batch_get_one(const_cast<TokenID*>(extension.data()), extension.size());
-      
-      std::vector<llama_pos> positions(extension.size());
-      for (size_t i = 0; i < extension.size(); ++i) {
-        positions[i] = common_prefix + i;
-      }
-      batch.pos = positions.data();
+  if (static_cast<size_t>(common_prefix) < current_tokens.size()) {
+    llama_memory_seq_rm(mem, id, common_prefix, -1);
+  }
 
-      if (llama_decode(ctx, batch) != 0) {
-        throw autocog::ModelError("Failed to decode token", id, "decode");
-      }
-      num_token_eval += extension.size();
+  // Chunked prefill: llama_decode takes at most n_batch tokens per call. Only
+  // the last token's logits are kept.
+  unsigned num_token_eval = 0;
+  size_t const n_batch = llama_n_batch(ctx);
+  auto const start = std::chrono::steady_clock::now();
+  for (size_t begin = common_prefix; begin < target_tokens.size(); begin += n_batch) {
+    size_t const end = std::min(target_tokens.size(), begin + n_batch);
+    Batch batch(end - begin);
+    for (size_t pos = begin; pos < end; ++pos) {
+      batch.add(target_tokens[pos], pos, id, pos + 1 == target_tokens.size());
     }
+    if (!this->decode(batch.batch)) {
+      // The sequence holds what the previous chunks decoded.
+      llama_memory_seq_rm(mem, id, static_cast<llama_pos>(begin), -1);
+      current_tokens.assign(target_tokens.begin(), target_tokens.begin() + begin);
+      throw autocog::ModelError("Failed to set the token sequence", this->id, "set_tokens");
+    }
+    num_token_eval += end - begin;
+    this->prefill_stats_.chunks++;
+  }
+  if (num_token_eval > 0) {
+    this->prefill_stats_.tokens += num_token_eval;
+    this->prefill_stats_.seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
   }
   current_tokens = target_tokens;
+  if (num_token_eval > 0) this->retain_prefix(id);
   return num_token_eval;
 }
 
+void Model::retain_prefix(ContextID const id) {
+  TokenSequence const & held = this->tokens[id];
+  if (held.size() < PREFIX_CACHE_MIN_LENGTH || this->prefix_cache_.covers(held)) return;
+
+  ContextID seq;
+  try {
+    seq = this->acquire_sequence();
+  } catch (autocog::ModelError const &) {
+    return;  // every sequence is in use: not worth evicting live work for
+  }
+  this->fork_sequence(id, seq);
+  this->release_sequences(this->prefix_cache_.insert(held, seq));
+}
+
+void Model::release_sequences(std::vector<ContextID> const & ids) {
+  for (ContextID seq : ids) this->release_sequence(seq);
+}
+
+bool Model::decode(llama_batch const & batch) {
+  llama_context * ctx = this->get_context();
+  int32_t ret = llama_decode(ctx, batch);
+  if (ret == 1 && !this->prefix_cache_.empty()) {
+    // No KV slot left for the batch: give back the cells retained by the prefix
+    // cache and try once more.
+    this->release_sequences(this->prefix_cache_.clear());
+    ret = llama_decode(ctx, batch);
+  }
+  return ret == 0;
+}
+
 unsigned Model::eval_sequences(TokenSequence const & new_tokens, ProbaSequence & logprobs, ContextID const id) {
   SPDLOG_LOGGER_TRACE(autocog::log(), "Model::eval_sequences(...):");
   SPDLOG_LOGGER_TRACE(autocog::log(), " > new_tokens.size() =");
+  check_context_id(id);
   if (this->id == 0) {
     std::exponential_distribution<float> dist(0.5f);
     logprobs.clear();
@@ -331,30 +572,160 @@ unsigned Model::eval_sequences(TokenSequence const & new_tokens, ProbaSequence &
   }
 
   TokenSequence & loc_tokens = this->get_tokens(id);
-  llama_pos token_pos = loc_tokens.size();
-  logprobs.clear();
+  llama_context * ctx = this->get_context();
+  llama_memory_t mem = llama_get_memory(ctx);
+  logprobs.assign(new_tokens.size(), 0.f);
+  if (new_tokens.empty()) return 0;
+
+  // One batch for the whole sequence. Token i is scored by the logits of the
+  // position before it, so the context's last token is decoded again in front
+  // (without a context, the first token has nothing to be scored by and stays
+  // 0). Every entry but the last one requests logits.
+  size_t const n_context = loc_tokens.size();
+  bool const has_root = n_context > 0;
+  TokenSequence entries;
+  if (has_root) entries.push_back(loc_tokens.back());
+  entries.insert(entries.end(), new_tokens.begin(), new_tokens.end());
+  llama_pos const base = static_cast<llama_pos>(n_context) - (has_root ? 1 : 0);
+  size_t const scored_from = has_root ? 0 : 1;  // first token scored by a logits row
+  if (has_root) llama_memory_seq_rm(mem, id, base, -1);
+
+  // Sequences longer than n_batch are decoded in n_batch chunks.
+  size_t const n_batch = llama_n_batch(ctx);
+  size_t const n_vocab = this->vocab_size();
+  for (size_t begin = 0; begin < entries.size(); begin += n_batch) {
+    size_t const end = std::min(entries.size(), begin + n_batch);
+    Batch batch(end - begin);
+    for (size_t e = begin; e < end; ++e)
+      batch.add(entries[e], base + static_cast<llama_pos>(e), id, e + 1 < entries.size());
+    if (!this->decode(batch.batch)) {
+      llama_memory_seq_rm(mem, id, base, -1);
+      loc_tokens.resize(base);
+      throw autocog::ModelError("Failed to decode token sequence", this->id, "decode");
+    }
+    size_t const n_rows = std::min(end, entries.size() - 1) - begin;
+    // Entry e scores entries[e + 1], i.e. new_tokens[e + scored_from].
+    sequence_logprobs(llama_get_logits(ctx), n_vocab, new_tokens.data() + begin + scored_from, n_rows, logprobs.data() + begin + scored_from);
+  }
+  loc_tokens.insert(loc_tokens.end(), new_tokens.begin(), new_tokens.end());
+  return entries.size();
+}
 
-  for (auto token: new_tokens) {
-  SPDLOG_LOGGER_TRACE(autocog::log(), " > token_pos =");
+unsigned Model::eval_choices(std::vector<TokenSequence> const & choices, std::vector<ProbaSequence> & logprobs, ContextID const id) {
+  SPDLOG_LOGGER_TRACE(autocog::log(), "Model::eval_choices(...):");
+  SPDLOG_LOGGER_TRACE(autocog::log(), " > choices.size() = {}", choices.size());
+  check_context_id(id);
+  logprobs.assign(choices.size(), {});
+  if (this->id == 0) {
+    // Same draws, in the same order, as scoring the choices one at a time.
+    std::exponential_distribution<float> dist(0.5f);
+    unsigned num_token_eval = 0;
+    for (size_t c = 0; c < choices.size(); ++c) {
+      for (size_t i = 0; i < choices[c].size(); ++i) logprobs[c].push_back(dist(this->rng));
+      num_token_eval += choices[c].size();
+    }
+    return num_token_eval;
+  }
 
-    llama_batch batch = llama_batch_get_one(&token, 1);
-    batch.pos = &token_pos;
+  TokenSequence const & context_tokens = this->get_tokens(id);
+  size_t const n_context = context_tokens.size();
+  // Without a context there are no logits for the first token of each choice
+  // (scored 0); otherwise its last token is decoded again, as the trie's root,
+  // to get the logits that score the first tokens.
+  bool const has_root = n_context > 0;
+  ChoiceTrie trie(has_root ? context_tokens.back() : TokenID{0}, choices);
 
-    if (llama_decode(this->get_context(id), batch) != 0) {
-      throw autocog::ModelError("Failed to decode token", id, "decode");
+  llama_context * ctx = this->get_context();
+  llama_memory_t mem = llama_get_memory(ctx);
+  size_t const n_vocab = this->vocab_size();
+  size_t const n_batch = llama_n_batch(ctx);
+  llama_pos const base = static_cast<llama_pos>(n_context) - 1;  // position of the root
+
+  // Each branch of the trie needs its own sequence. When there are more
+  // branches than free sequences (or decoded nodes than fit in one batch), the
+  // branches are scored over several rounds, redecoding shared ancestors. A
+  // round starts with a branch whatever its length: one longer than n_batch
+  // is then decoded alone, in n_batch chunks.
+  std::vector<size_t> const branches = trie.branches();
+  unsigned num_token_eval = 0;
+  size_t next_branch = 0;
+  while (next_branch < branches.size()) {
+    std::vector<size_t> round;      // nodes decoded in this round
+    std::vector<ContextID> leased;
+    for (auto & node : trie.nodes) node.seqs.clear();
+
+    for (; next_branch < branches.size(); ++next_branch) {
+      std::vector<size_t> path;     // nodes of the branch not already in the round
+      for (size_t n = branches[next_branch]; ; n = trie.nodes[n].parent) {
+        if (trie.nodes[n].seqs.empty() && (n != 0 || has_root)) path.push_back(n);
+        if (n == 0) break;
+      }
+      if (!round.empty() && round.size() + path.size() > n_batch) break;
+      ContextID seq = id;  // the first branch of a round uses the context's sequence
+      if (!trie.nodes[0].seqs.empty()) {
+        try {
+          seq = this->acquire_sequence();
+        } catch (autocog::ModelError const &) {
+          break;
+        }
+        leased.push_back(seq);
+      }
+      round.insert(round.end(), path.begin(), path.end());
+      for (size_t n = branches[next_branch]; ; n = trie.nodes[n].parent) {
+        trie.nodes[n].seqs.push_back(seq);
+        if (n == 0) break;
+      }
     }
 
-    logprobs.push_back(retrieve_logprob(this->get_context(id), this->vocab_size(), token));
+    // Every sequence of the round starts from the context without its last
+    // token: the root is decoded again, into all of them at once.
+    if (has_root) llama_memory_seq_rm(mem, id, base, -1);
+    for (ContextID const seq : leased) {
+      llama_memory_seq_rm(mem, seq, -1, -1);
+      llama_memory_seq_cp(mem, id, seq, -1, -1);
+    }
+
+    // Parents before children, so each sequence sees increasing positions.
+    std::stable_sort(round.begin(), round.end(), [&](size_t a, size_t b) { return trie.nodes[a].depth < trie.nodes[b].depth; });
+    for (size_t begin = 0; begin < round.size(); begin += n_batch) {
+      size_t const end = std::min(round.size(), begin + n_batch);
+      Batch batch(end - begin, leased.size() + 1);
+      for (size_t i = begin; i < end; ++i) {
+        ChoiceTrie::Node const & node = trie.nodes[round[i]];
+        batch.add(node.token, base + static_cast<llama_pos>(node.depth), node.seqs, !node.scored);
+      }
+      if (!this->decode(batch.batch)) {
+        // Earlier chunks may have decoded into the context's sequence.
+        llama_memory_seq_rm(mem, id, has_root ? base : 0, -1);
+        if (has_root) this->get_tokens(id).pop_back();  // the KV lost the root
+        for (ContextID const seq : leased) this->release_sequence(seq);
+        throw autocog::ModelError("Failed to decode choices", this->id, "eval_choices");
+      }
 
-    token_pos++;
+      for (size_t i = begin; i < end; ++i) {
+        ChoiceTrie::Node & node = trie.nodes[round[i]];
+        if (node.scored) continue;
+        float const * logits = llama_get_logits_ith(ctx, static_cast<int32_t>(i - begin));
+        float const lse = log_sum_exp(logits, n_vocab);
+        for (auto const & [tok, child] : node.children) trie.nodes[child].logprob = lse - logits[tok];
+        node.scored = true;
+      }
+    }
+    num_token_eval += round.size();
+
+    // Back to the context alone (its root cell was decoded into it as well).
+    llama_memory_seq_rm(mem, id, static_cast<llama_pos>(n_context), -1);
+    for (ContextID const seq : leased) this->release_sequence(seq);
   }
-  loc_tokens.insert(loc_tokens.end(), new_tokens.begin(), new_tokens.end());
-  return new_tokens.size();
-}
 
+  for (size_t c = 0; c < choices.size(); ++c) {
+    for (size_t const n : trie.paths[c]) logprobs[c].push_back(trie.nodes[n].logprob);
+  }
+  return num_token_eval;
+}
 
 unsigned Model::eval_topk_tokens(
-  std::vector<bool> const & vocab_mask,
+  VocabMask const & vocab_mask,
   size_t max_candidates,
   std::vector<TokenID> & topk_tokens,
   std::vector<float> & topk_lobprobs,
@@ -364,77 +735,129 @@ unsigned Model::eval_topk_tokens(
   SPDLOG_LOGGER_TRACE(autocog::log(), " > max_candidates =");
 
   check_context_id(id);
+  size_t vocab_size = this->vocab_size();
+  if (vocab_mask.size() != vocab_size) {
+     throw autocog::ModelError("vocab_mask size mismatch: " + std::to_string(vocab_mask.size()) + " vs " + std::to_string(vocab_size), this->id, "vocab_mask");
+  }
+
   if (this->id == 0) {
-    size_t vs = RNG_VOCAB_SIZE;
-    if (vocab_mask.size() != vs) {
-      throw autocog::ModelError("vocab_mask size mismatch: " + std::to_string(vocab_mask.size()) + " vs " + std::to_string(vs), id, "vocab_mask");
+    std::vector<std::pair<TokenID, float>> candidates;
+    sample_rng_logprobs(this->rng, vocab_mask, candidates);
+    select_topk(candidates, max_candidates, topk_tokens, topk_lobprobs);
+  } else {
+    masked_topk(llama_get_logits(this->get_context()), vocab_mask, max_candidates, topk_tokens, topk_lobprobs);
+  }
+
+  // Handle edge case: no valid candidates
+  if (topk_tokens.empty() && max_candidates > 0) {
+    throw autocog::ModelError("Failed to find candidate token: empty vocabulary mask", this->id, "vocab_mask");
+  }
+  return 1;
+}
+
+unsigned Model::eval_topk_batch(std::vector<TopkRequest> const & requests, std::vector<TopkResult> & results) {
+  SPDLOG_LOGGER_TRACE(autocog::log(), "Model::eval_topk_batch(...):");
+  SPDLOG_LOGGER_TRACE(autocog::log(), " > requests.size() = {}", requests.size());
+
+  size_t vocab_size = this->vocab_size();
+  std::vector<bool> seen(this->tokens.size(), false);
+  for (TopkRequest const & request : requests) {
+    check_context_id(request.seq);
+    if (seen[request.seq]) {
+      throw autocog::utilities::InternalError("eval_topk_batch: sequence " + std::to_string(request.seq) + " appears twice in the batch");
+    }
+    seen[request.seq] = true;
+    if (request.mask->size() != vocab_size) {
+       throw autocog::ModelError("vocab_mask size mismatch: " + std::to_string(request.mask->size()) + " vs " + std::to_string(vocab_size), this->id, "vocab_mask");
     }
+  }
 
-    // RNG model: exponential logprobs (λ=0.5, mean=2)
-    // Produces realistic peaked distribution: clear winner, long tail.
-    // Pruning thresholds work naturally (top 2-3 candidates survive).
-    std::exponential_distribution<float> dist(0.5f);
-    std::vector<std::pair<TokenID, float>> candidates;
-    for (size_t tok = 0; tok < vs; ++tok) {
-      if (vocab_mask[tok]) {
-        // Restrict to printable ASCII (32-126), newline, tab
-        if (tok < 256 && !(tok >= 32 && tok <= 126) && tok != '\n' && tok != '\t') continue;
-        candidates.emplace_back(static_cast<TokenID>(tok), dist(this->rng));
+  results.assign(requests.size(), {});
+  if (requests.empty()) return 0;
+
+  // One step per sequence, decoded n_batch sequences at a time.
+  llama_context * ctx = this->id == 0 ? nullptr : this->get_context();
+  size_t const n_batch = ctx ? llama_n_batch(ctx) : requests.size();
+  std::vector<std::pair<TokenID, float>> candidates;
+  for (size_t begin = 0; begin < requests.size(); begin += n_batch) {
+    size_t const end = std::min(requests.size(), begin + n_batch);
+    if (ctx) {
+      unsigned n_ctx = llama_n_ctx(ctx);
+      Batch batch(end - begin);
+      for (size_t i = begin; i < end; ++i) {
+        llama_pos pos = this->tokens[requests[i].seq].size();
+        if (static_cast<unsigned>(pos) >= n_ctx) {
+          throw autocog::ModelError("Token sequence too long: " + std::to_string(pos + 1) + " > " + std::to_string(n_ctx), this->id, "context_overflow");
+        }
+        batch.add(requests[i].token, pos, requests[i].seq, true);
+      }
+      if (!this->decode(batch.batch)) {
+        throw autocog::ModelError("Failed to decode batch", this->id, "decode");
       }
     }
 
-    if (candidates.empty()) {
-      throw autocog::ModelError("Failed to find candidate token: empty vocabulary mask", id, "vocab_mask");
+    for (size_t i = begin; i < end; ++i) {
+      TopkRequest const & request = requests[i];
+      TopkResult & result = results[i];
+      this->tokens[request.seq].push_back(request.token);
+
+      if (this->id == 0) {
+        candidates.clear();
+        sample_rng_logprobs(this->rng, *request.mask, candidates);
+        select_topk(candidates, request.max_candidates, result.tokens, result.logprobs);
+      } else {
+        masked_topk(llama_get_logits_ith(ctx, static_cast<int32_t>(i - begin)), *request.mask, request.max_candidates, result.tokens, result.logprobs);
+      }
+      if (result.tokens.empty() && request.max_candidates > 0) {
+        throw autocog::ModelError("Failed to find candidate token: empty vocabulary mask", this->id, "vocab_mask");
+      }
     }
+  }
+  return requests.size();
+}
 
-    std::sort(candidates.begin(), candidates.end(), [](const auto& a, const auto& b) {
-      return a.second < b.second;
-    });
+unsigned Model::n_sequences() const {
+  return this->tokens.size();
+}
 
-    size_t k = std::min(max_candidates, candidates.size());
-    topk_tokens.clear();
-    topk_lobprobs.clear();
-    topk_tokens.reserve(k);
-    topk_lobprobs.reserve(k);
-    for (size_t i = 0; i < k; ++i) {
-      topk_tokens.push_back(candidates[i].first);
-      topk_lobprobs.push_back(candidates[i].second);
+ContextID Model::acquire_sequence() {
+  for (ContextID seq = 1; seq < this->leased_.size(); ++seq) {
+    if (!this->leased_[seq]) {
+      this->leased_[seq] = true;
+      return seq;
     }
-    return 1;
   }
-
-  size_t vocab_size = this->vocab_size();
-  if (vocab_mask.size() != vocab_size) {
-     throw autocog::ModelError("vocab_mask size mismatch: " + std::to_string(vocab_mask.size()) + " vs " + std::to_string(vocab_size), id, "vocab_mask");
+  // Live work comes before retained prefixes.
+  if (auto const seq = this->prefix_cache_.evict()) {
+    this->release_sequence(*seq);
+    this->leased_[*seq] = true;
+    return *seq;
   }
+  throw autocog::ModelError("No free KV sequence (" + std::to_string(this->leased_.size()) + " in use)", this->id, "sequences");
+}
 
-  llama_context * ctx = this->get_context(id);
-
-  topk_tokens.clear();
-  topk_lobprobs.clear();
-
-  std::vector<std::pair<TokenID, float>> candidates;
-  sample_logprobs(ctx, vocab_mask, candidates);
-
-  // Handle edge case: no valid candidates
-  if (candidates.empty()) {
-    throw autocog::ModelError("Failed to find candidate token: empty vocabulary mask", id, "vocab_mask");
+void Model::release_sequence(ContextID const id) {
+  check_context_id(id);
+  if (id == 0) {
+    throw autocog::utilities::InternalError("KV sequence 0 is never leased");
   }
-    
-  std::sort(candidates.begin(), candidates.end(), [](const auto& a, const auto& b) {
-    return a.second < b.second;
-  });
-    
-  size_t k = std::min(max_candidates, candidates.size());
-  topk_tokens.reserve(k);
-  topk_lobprobs.reserve(k);
-    
-  for (size_t i = 0; i < k; ++i) {
-    topk_tokens.push_back(candidates[i].first);
-    topk_lobprobs.push_back(candidates[i].second);
+  if (this->id != 0) {
+    llama_memory_seq_rm(llama_get_memory(this->get_context()), id, -1, -1);
   }
-    
-  return 1;
+  this->tokens[id].clear();
+  this->leased_[id] = false;
+}
+
+void Model::fork_sequence(ContextID const src, ContextID const dst) {
+  check_context_id(src);
+  check_context_id(dst);
+  if (src == dst) return;
+  if (this->id != 0) {
+    llama_memory_t mem = llama_get_memory(this->get_context());
+    llama_memory_seq_rm(mem, dst, -1, -1);
+    llama_memory_seq_cp(mem, src, dst, -1, -1);
+  }
+  this->tokens[dst] = this->tokens[src];
 }
 
 std::string Model::sha256() const {
@@ -447,48 +870,58 @@ std::string Model::sha256() const {
       throw autocog::ModelError("Cannot open model file to hash: " + source_, id, "hash");
     // Stream the file through SHA-256 (full 64-hex) so a multi-GB GGUF is not
     // loaded into memory. Cached for the lifetime of the loaded model.
-    sha_cache_ = picosha2::hash256_hex_string(
-        std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+    autocog::data::Sha256 sha;
+    std::vector<char> chunk(1 << 20);
+    while (f.read(chunk.data(), static_cast<std::streamsize>(chunk.size())) || f.gcount() > 0)
+      sha.update(chunk.data(), static_cast<size_t>(f.gcount()));
+    sha_cache_ = autocog::data::to_hex(sha.finish());
   }
   return sha_cache_;
 }
 
-std::vector<bool> Model::build_vocab_mask(autocog::data::VocabExpr const & ve) {
+VocabMask Model::build_vocab_mask(autocog::data::VocabExpr const & ve) {
   size_t const n = vocab_size();
   using Kind = autocog::data::VocabExpr::Kind;
   switch (ve.kind) {
     case Kind::Tokenize: {
-      std::vector<bool> m(n, false);
+      VocabMask m(n);
       for (auto const & s : ve.strings)
         for (TokenID t : tokenize(s, false, true))
-          if (t >= 0 && static_cast<size_t>(t) < n) m[t] = true;
+          if (t >= 0 && static_cast<size_t>(t) < n) m.set(t);
       return m;
     }
     case Kind::Regex: {
-      std::vector<bool> m(n, false);
-      std::regex re(ve.strings.empty() ? std::string{} : ve.strings[0]);
-      for (size_t t = 0; t < n; ++t) {
-        std::string surface = detokenize({static_cast<TokenID>(t)}, false, false);
-        if (std::regex_search(surface, re)) m[t] = true;
+      std::string const pattern = ve.strings.empty() ? std::string{} : ve.strings[0];
+      std::vector<std::string> const & surfaces = token_surfaces();
+      VocabMask m(n);
+      VocabMask::Word * words = m.mutable_words();
+      auto fill = [&](auto const & matches) {
+        parallel_ranges(n, [&](size_t const begin, size_t const end) {
+          for (size_t t = begin; t < end; ++t)
+            if (matches(surfaces[t])) words[t / VocabMask::WORD_BITS] |= VocabMask::Word{1} << (t % VocabMask::WORD_BITS);
+        });
+      };
+      if (auto dfa = RegexDFA::compile(pattern)) {
+        fill([&](std::string const & surface) { return dfa->search(surface); });
+      } else {
+        std::regex const re(pattern);
+        fill([&](std::string const & surface) { return std::regex_search(surface, re); });
       }
       return m;
     }
     case Kind::Union: {
       auto a = build_vocab_mask(ve.operands[0]);
-      auto b = build_vocab_mask(ve.operands[1]);
-      for (size_t i = 0; i < n; ++i) a[i] = a[i] || b[i];
+      a |= build_vocab_mask(ve.operands[1]);
       return a;
     }
     case Kind::Intersect: {
       auto a = build_vocab_mask(ve.operands[0]);
-      auto b = build_vocab_mask(ve.operands[1]);
-      for (size_t i = 0; i < n; ++i) a[i] = a[i] && b[i];
+      a &= build_vocab_mask(ve.operands[1]);
       return a;
     }
     case Kind::Diff: {
       auto a = build_vocab_mask(ve.operands[0]);
-      auto b = build_vocab_mask(ve.operands[1]);
-      for (size_t i = 0; i < n; ++i) a[i] = a[i] && !b[i];
+      a.subtract(build_vocab_mask(ve.operands[1]));
       return a;
     }
     case Kind::Complement: {
@@ -497,18 +930,92 @@ std::vector<bool> Model::build_vocab_mask(autocog::data::VocabExpr const & ve) {
       return a;
     }
   }
-  return std::vector<bool>(n, true);
+  return VocabMask(n, true);
 }
 
-std::vector<bool> const & Model::vocab_mask(std::string const & ref, autocog::data::VocabExpr const & expr) {
+VocabMask const & Model::vocab_mask(std::string const & ref, autocog::data::VocabExpr const & expr) {
   auto it = vocab_mask_cache_.find(ref);
   if (it != vocab_mask_cache_.end()) return it->second;
-  return vocab_mask_cache_.emplace(ref, build_vocab_mask(expr)).first->second;
+
+  VocabMask built;
+  auto pending = pending_masks_.find(ref);
+  if (pending != pending_masks_.end()) {
+    std::future<VocabMask> future = std::move(pending->second);
+    pending_masks_.erase(pending);
+    // Not started yet: build it here rather than wait behind the others.
+    if (mask_builder_)
+      if (auto job = mask_builder_->take(ref)) (*job)();
+    built = future.get();
+  } else {
+    built = load_or_build_vocab_mask(ref, expr, mask_store_);
+  }
+  VocabMask & mask = vocab_mask_cache_.emplace(ref, std::move(built)).first->second;
+  mask.index(vocab_size() / SPARSE_MASK_FRACTION);
+  return mask;
+}
+
+VocabMask Model::load_or_build_vocab_mask(std::string const & ref, autocog::data::VocabExpr const & expr,
+                                          std::optional<MaskStore> const & store) {
+  if (!store) return build_vocab_mask(expr);
+  if (auto stored = store->load(ref, vocab_size())) return std::move(*stored);
+  VocabMask mask = build_vocab_mask(expr);
+  store->save(ref, mask);
+  return mask;
+}
+
+void Model::set_mask_cache(std::string const & dir) {
+  std::string normal;
+  if (!dir.empty()) {
+    std::filesystem::path path = std::filesystem::absolute(dir).lexically_normal();
+    if (!path.has_filename()) path = path.parent_path();  // trailing separator
+    normal = path.string();
+  }
+  if (normal == mask_cache_dir_) return;
+  if (!mask_cache_dir_.empty() && (!vocab_mask_cache_.empty() || !pending_masks_.empty()))
+    throw autocog::ModelError("The vocab mask cache is already '" + mask_cache_dir_ + "', cannot use '" + normal + "'", id, "mask_cache");
+  if (normal.empty()) mask_store_.reset();
+  else mask_store_.emplace(normal, sha256());
+  mask_cache_dir_ = normal;
+}
+
+static void check_regexes(autocog::data::VocabExpr const & ve) {
+  if (ve.kind == autocog::data::VocabExpr::Kind::Regex) {
+    std::regex const re(ve.strings.empty() ? std::string{} : ve.strings[0]);  // throws std::regex_error
+  }
+  for (auto const & operand : ve.operands) check_regexes(operand);
+}
+
+void Model::prime_vocab_mask(std::string const & ref, autocog::data::VocabExpr const & expr) {
+  if (vocab_mask_cache_.count(ref) > 0 || pending_masks_.count(ref) > 0) return;
+  check_regexes(expr);
+  MaskBuilder::Job job([this, ref, expr, store = mask_store_] { return load_or_build_vocab_mask(ref, expr, store); });
+  pending_masks_.emplace(ref, job.get_future());
+  if (!mask_builder_) {
+    mask_builder_ = std::make_unique<MaskBuilder>();
+    mask_builder_->thread = std::thread(&MaskBuilder::run, mask_builder_.get());
+  }
+  {
+    std::lock_guard<std::mutex> lock(mask_builder_->mutex);
+    mask_builder_->queue.emplace_back(ref, std::move(job));
+  }
+  mask_builder_->wakeup.notify_one();
+}
+
+std::vector<std::string> const & Model::token_surfaces() {
+  std::call_once(surfaces_->built, [this] {
+    size_t const n = vocab_size();
+    std::vector<std::string> & table = surfaces_->table;
+    table.resize(n);
+    parallel_ranges(n, [&](size_t const begin, size_t const end) {
+      for (size_t t = begin; t < end; ++t) table[t] = detokenize({static_cast<TokenID>(t)}, false, false);
+    });
+  });
+  return surfaces_->table;
 }
 
-std::vector<bool> const & Model::full_vocab_mask() {
+VocabMask const & Model::full_vocab_mask() {
   if (full_vocab_mask_.size() != vocab_size())
-    full_vocab_mask_.assign(vocab_size(), true);
+    full_vocab_mask_ = VocabMask(vocab_size(), true);
   return full_vocab_mask_;
 }
 
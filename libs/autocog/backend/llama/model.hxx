@@ -2,8 +2,15 @@
 #define AUTOCOG_BACKEND_LLAMA_MODEL_HXX
 
 #include "autocog/backend/llama/types.hxx"
+#include "autocog/backend/llama/prefix-cache.hxx"
+#include "autocog/backend/llama/vocab-mask.hxx"
+#include "autocog/backend/llama/mask-store.hxx"
 
+#include <future>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <random>
 #include <string>
 #include <vector>
@@ -12,6 +19,28 @@ namespace autocog::data { struct VocabExpr; }
 
 namespace autocog::backend::llama {
 
+// llama context parameters a model is loaded with; 0 keeps llama.cpp's default.
+// Prompts longer than n_batch are prefilled in n_batch chunks, each split by
+// llama.cpp into n_ubatch micro-batches.
+struct ModelConfig {
+  unsigned n_batch{0};     // tokens per llama_decode call
+  unsigned n_ubatch{0};    // tokens per compute micro-batch
+  int n_threads{0};        // threads for generation and prefill
+};
+
+// One sequence's step in Model::eval_topk_batch.
+struct TopkRequest {
+  ContextID seq;
+  TokenID token;              // appended to `seq`, then decoded
+  VocabMask const * mask;     // allowed continuations
+  size_t max_candidates;
+};
+
+struct TopkResult {
+  std::vector<TokenID> tokens;
+  std::vector<float> logprobs;
+};
+
 class Model {
   public:
     ModelID const id;
@@ -21,22 +50,78 @@ class Model {
     static constexpr TokenID RNG_BOS = 256;
     static constexpr TokenID RNG_EOS = 257;
 
+    // Number of KV sequences the llama context is created with. Sequence 0 is
+    // the default context; the others are leased by acquire_sequence().
+    static constexpr unsigned DEFAULT_N_SEQ = 64;
+
+    // Prefix cache: at most PREFIX_CACHE_ENTRIES retained sequences, holding at
+    // most 1/PREFIX_CACHE_FRACTION of the context's KV cells. Prefixes shorter
+    // than PREFIX_CACHE_MIN_LENGTH are not worth a sequence.
+    static constexpr size_t PREFIX_CACHE_ENTRIES = 8;
+    static constexpr unsigned PREFIX_CACHE_FRACTION = 2;
+    static constexpr size_t PREFIX_CACHE_MIN_LENGTH = 16;
+
+    // Cached vocab masks allowing at most 1/SPARSE_MASK_FRACTION of the vocab
+    // also keep their sorted allowed-token list (see VocabMask::index).
+    static constexpr size_t SPARSE_MASK_FRACTION = 64;
+
   private:
     llama_model * model;
-    std::vector<llama_context *> contexts;
-    std::vector<TokenSequence> tokens;
+    llama_context * context;
+    std::vector<TokenSequence> tokens;   // tokens held by each KV sequence
+    std::vector<bool> leased_;           // sequences handed out by acquire_sequence()
     std::mt19937 rng;
     std::string source_;                 // GGUF path ("" for the RNG model)
     mutable std::string sha_cache_;      // lazily-computed full SHA-256 of the GGUF
 
     // Resolved vocab masks for this model, keyed by vocab ref ("vocab_<hash>"),
     // so identical vocabs dedup across every FTA evaluated on this model.
-    std::map<std::string, std::vector<bool>> vocab_mask_cache_;
-    std::vector<bool> full_vocab_mask_;   // lazily-built all-true mask
+    std::map<std::string, VocabMask> vocab_mask_cache_;
+    VocabMask full_vocab_mask_;           // lazily-built all-true mask
+    std::map<std::string, std::future<VocabMask>> pending_masks_;  // see prime_vocab_mask()
+    std::optional<MaskStore> mask_store_;  // see set_mask_cache(); background builds use a copy
+    std::string mask_cache_dir_;           // absolute, normalized ("" when unset)
+
+    // Background thread building the primed masks, started by the first
+    // prime_vocab_mask() and joined before the Model is destroyed or moved.
+    struct MaskBuilder;
+    std::unique_ptr<MaskBuilder> mask_builder_;
+    void join_mask_builder();
+
+    // Detokenized surface of every token, built once (on first use, by
+    // whichever thread needs it) and shared by every regex vocab.
+    struct TokenSurfaces {
+      std::once_flag built;
+      std::vector<std::string> table;
+    };
+    std::unique_ptr<TokenSurfaces> surfaces_;
+
+    // Token prefixes retained in KV across evaluations (see set_tokens).
+    PrefixCache prefix_cache_;
+
+  public:
+    // Prefill done by set_tokens: tokens decoded, llama_decode calls (chunks)
+    // and time spent in them.
+    struct PrefillStats {
+      unsigned long tokens{0};
+      unsigned long chunks{0};
+      double seconds{0.};
+      double tokens_per_second() const { return seconds > 0. ? tokens / seconds : 0.; }
+    };
+
+  private:
+    PrefillStats prefill_stats_;
 
-    std::vector<bool> build_vocab_mask(autocog::data::VocabExpr const & expr);
+    void retain_prefix(ContextID const id);
+    void release_sequences(std::vector<ContextID> const & ids);
+    bool decode(llama_batch const & batch);
 
-    llama_context * get_context(ContextID const id = 0) const;
+    VocabMask build_vocab_mask(autocog::data::VocabExpr const & expr);
+    // The mask from the on-disk cache `store` if any, otherwise built (and saved).
+    VocabMask load_or_build_vocab_mask(std::string const & ref, autocog::data::VocabExpr const & expr,
+                                       std::optional<MaskStore> const & store);
+
+    llama_context * get_context() const;
     TokenSequence & get_tokens(ContextID const id = 0);
     void check_context_id(ContextID const id = 0) const;
 
@@ -44,7 +129,7 @@ class Model {
 
   public:
     Model();
-    Model(ModelID const id, std::string const & model_path, int n_ctx);
+    Model(ModelID const id, std::string const & model_path, int n_ctx, ModelConfig const & config = ModelConfig{}, unsigned n_seq = DEFAULT_N_SEQ);
     ~Model();
 
     // Move-only: a Model owns raw llama_model*/llama_context* handles, so a copy
@@ -67,32 +152,94 @@ class Model {
 
     // Token mask for a resolved vocab expression, built once and cached per ref.
     // full_vocab_mask() is the unrestricted (all-true) mask.
-    std::vector<bool> const & vocab_mask(std::string const & ref, autocog::data::VocabExpr const & expr);
-    std::vector<bool> const & full_vocab_mask();
+    VocabMask const & vocab_mask(std::string const & ref, autocog::data::VocabExpr const & expr);
+    VocabMask const & full_vocab_mask();
+
+    // Queue the mask for `ref` on the model's background builder, unless it is
+    // already cached or pending; vocab_mask() then waits for it (or builds it
+    // itself if the builder has not started it). Invalid regex patterns still
+    // throw here. Lets prepare() overlap mask construction with the first
+    // prefill. Masks are built one at a time, so priming many vocabs keeps a
+    // single extra thread (plus the parallel build's own).
+    void prime_vocab_mask(std::string const & ref, autocog::data::VocabExpr const & expr);
+
+    // Persist resolved vocab masks under `dir` (see MaskStore), keyed by this
+    // model's sha256(), so later processes map them instead of rebuilding.
+    // Setting the directory already in use is a no-op (engines share the RNG
+    // model). Once masks are requested under one directory, another one throws;
+    // masks requested before any directory was set are not persisted.
+    void set_mask_cache(std::string const & dir);
+
+    // Detokenized surface of every token (see TokenSurfaces). Thread-safe.
+    std::vector<std::string> const & token_surfaces();
 
     // Full 64-hex SHA-256 of the backing GGUF file, computed once and cached.
     // The RNG model (no file) reports the sentinel "rng". Used as the model's
     // provenance identity when stamping an evaluated FTT.
     std::string sha256() const;
 
+    PrefixCache::Stats prefix_cache_stats() const { return prefix_cache_.stats(); }
+    PrefillStats prefill_stats() const { return prefill_stats_; }
+
+    // Bring sequence `id` to `tokens`, decoding only what it does not hold yet.
+    // The longer of the sequence's own common prefix and the prefix cache's
+    // longest match is reused; a freshly decoded sequence is then retained in
+    // the prefix cache for the next evaluations. The rest is decoded in chunks
+    // of at most n_batch tokens.
     unsigned set_tokens(
       TokenSequence const & tokens,
       ContextID const id = 0
     );
 
+    // Append `tokens` to sequence `id`, decoded in one batch, and set
+    // logprobs[i] to the logprob of tokens[i] given everything before it.
     unsigned eval_sequences(
       TokenSequence const & tokens,
       ProbaSequence & logprobs,
       ContextID const id = 0
     );
 
+    // Score every choice as a continuation of sequence `id`: logprobs[c][i] is
+    // the logprob of choices[c][i] given the context and choices[c][0..i). The
+    // choices are merged into a token trie, so a prefix shared by several
+    // choices is decoded once, and the trie is decoded in a single batch (one
+    // KV sequence per branch, leased for the call) when it fits n_batch and the
+    // free sequences, otherwise over several. The sequence still holds its
+    // context afterwards.
+    unsigned eval_choices(
+      std::vector<TokenSequence> const & choices,
+      std::vector<ProbaSequence> & logprobs,
+      ContextID const id = 0
+    );
+
     unsigned eval_topk_tokens(
-      std::vector<bool> const & vocab_mask,
+      VocabMask const & vocab_mask,
       size_t max_candidates,
       std::vector<TokenID> & topk_tokens,
       std::vector<float> & topk_logprobs,
       ContextID const id
     );
+
+    // KV sequences. Every ContextID is one sequence of the model's single llama
+    // context; sequence 0 is always available, the others are leased (and
+    // cleared on release). When all are in use, acquire_sequence() takes the
+    // prefix cache's least recently used one, and throws ModelError if the
+    // cache holds none. fork_sequence() makes `dst` share the KV content of
+    // `src`.
+    unsigned n_sequences() const;
+    ContextID acquire_sequence();
+    void release_sequence(ContextID const id);
+    void fork_sequence(ContextID const src, ContextID const dst);
+
+    // Batched step: append `requests[i].token` to sequence `requests[i].seq`
+    // for every i, decode all of them in shared llama_decode calls, and select
+    // the masked top-k continuation of each sequence (same convention as
+    // eval_topk_tokens). Requests may come from different evaluations, each
+    // with its own mask; a sequence can appear only once.
+    unsigned eval_topk_batch(
+      std::vector<TopkRequest> const & requests,
+      std::vector<TopkResult> & results
+    );
 };
 
 }
@@ -0,0 +1,180 @@
+
+#include "autocog/backend/llama/prefix-cache.hxx"
+
+#include <utility>
+
+namespace autocog::backend::llama {
+
+PrefixCache::PrefixCache(size_t const budget_, size_t const max_entries_) :
+  root(std::make_unique<Node>()),
+  budget(budget_),
+  max_entries(max_entries_)
+{}
+
+PrefixCache::~PrefixCache() = default;
+PrefixCache::PrefixCache(PrefixCache &&) noexcept = default;
+
+std::pair<PrefixCache::Node *, size_t> PrefixCache::descend(TokenSequence const & seq) const {
+  Node * node = root.get();
+  size_t depth = 0;
+  while (depth < seq.size()) {
+    auto it = node->children.find(seq[depth]);
+    if (it == node->children.end()) break;
+    Node * child = it->second.get();
+    size_t k = 0;
+    while (k < child->edge.size() && depth + k < seq.size() && child->edge[k] == seq[depth + k]) k++;
+    depth += k;
+    node = child;
+    if (k < child->edge.size()) break;
+  }
+  return {node, depth};
+}
+
+PrefixCache::Node * PrefixCache::any_entry(Node * node) const {
+  // Every leaf is an entry (empty branches are pruned), so this only fails on
+  // an empty tree.
+  while (!node->seq && !node->children.empty()) node = node->children.begin()->second.get();
+  return node->seq ? node : nullptr;
+}
+
+PrefixCache::Node * PrefixCache::oldest_entry(Node * node) const {
+  Node * oldest = node->seq ? node : nullptr;
+  for (auto & [tok, child] : node->children) {
+    Node * candidate = oldest_entry(child.get());
+    if (candidate && (!oldest || candidate->last_use < oldest->last_use)) oldest = candidate;
+  }
+  return oldest;
+}
+
+std::optional<PrefixCache::Match> PrefixCache::lookup(TokenSequence const & seq, size_t const floor) {
+  auto [node, depth] = descend(seq);
+  Node * entry = depth > floor ? any_entry(node) : nullptr;
+  if (entry == nullptr) {
+    misses++;
+    return std::nullopt;
+  }
+  entry->last_use = ++clock;
+  hits++;
+  reused_tokens += depth - floor;
+  return Match{entry->seq.value(), depth};
+}
+
+bool PrefixCache::covers(TokenSequence const & seq) const {
+  auto [node, depth] = descend(seq);
+  return depth == seq.size() && any_entry(node) != nullptr;
+}
+
+void PrefixCache::drop(Node * node, std::vector<ContextID> & dropped) {
+  dropped.push_back(node->seq.value());
+  node->seq.reset();
+  entries--;
+
+  // Prune the branch left without entries...
+  while (node != root.get() && !node->seq && node->children.empty()) {
+    Node * parent = node->parent;
+    tokens -= node->edge.size();
+    parent->children.erase(node->edge.front());
+    node = parent;
+  }
+  // ...and merge a pass-through node with its only child.
+  if (node != root.get() && !node->seq && node->children.size() == 1) {
+    std::unique_ptr<Node> child = std::move(node->children.begin()->second);
+    node->children.clear();
+    node->edge.insert(node->edge.end(), child->edge.begin(), child->edge.end());
+    node->seq = child->seq;
+    node->last_use = child->last_use;
+    node->children = std::move(child->children);
+    for (auto & [tok, grandchild] : node->children) grandchild->parent = node;
+  }
+}
+
+std::vector<ContextID> PrefixCache::insert(TokenSequence const & seq, ContextID const id) {
+  std::vector<ContextID> dropped;
+
+  Node * node = root.get();
+  size_t depth = 0;
+  while (depth < seq.size()) {
+    auto it = node->children.find(seq[depth]);
+    if (it == node->children.end()) {
+      auto leaf = std::make_unique<Node>();
+      leaf->edge.assign(seq.begin() + depth, seq.end());
+      leaf->parent = node;
+      tokens += leaf->edge.size();
+      node = node->children.emplace(seq[depth], std::move(leaf)).first->second.get();
+      depth = seq.size();
+      break;
+    }
+    Node * child = it->second.get();
+    size_t k = 0;
+    while (k < child->edge.size() && depth + k < seq.size() && child->edge[k] == seq[depth + k]) k++;
+    if (k < child->edge.size()) {
+      // Split the edge where `seq` leaves (or ends inside) it.
+      auto middle = std::make_unique<Node>();
+      middle->edge.assign(child->edge.begin(), child->edge.begin() + k);
+      middle->parent = node;
+      std::unique_ptr<Node> lower = std::move(it->second);
+      lower->edge.erase(lower->edge.begin(), lower->edge.begin() + k);
+      lower->parent = middle.get();
+      middle->children.emplace(lower->edge.front(), std::move(lower));
+      child = middle.get();
+      it->second = std::move(middle);
+    }
+    node = child;
+    depth += k;
+  }
+
+  if (node == root.get() || node->seq || !node->children.empty()) {
+    // Already held by a longer (or the same) entry: nothing to retain.
+    dropped.push_back(id);
+    return dropped;
+  }
+  node->seq = id;
+  node->last_use = ++clock;
+  entries++;
+
+  // Entries that are prefixes of the new one are redundant.
+  std::vector<Node *> covered;
+  for (Node * p = node->parent; p != root.get(); p = p->parent)
+    if (p->seq) covered.push_back(p);
+  for (Node * p : covered) drop(p, dropped);
+
+  while ((budget > 0 && tokens > budget) || (max_entries > 0 && entries > max_entries))
+    drop(oldest_entry(root.get()), dropped);
+
+  return dropped;
+}
+
+std::optional<ContextID> PrefixCache::evict() {
+  if (entries == 0) return std::nullopt;
+  std::vector<ContextID> dropped;
+  drop(oldest_entry(root.get()), dropped);
+  return dropped.front();
+}
+
+std::vector<ContextID> PrefixCache::clear() {
+  std::vector<ContextID> dropped;
+  std::vector<Node *> stack{root.get()};
+  while (!stack.empty()) {
+    Node * node = stack.back();
+    stack.pop_back();
+    if (node->seq) dropped.push_back(node->seq.value());
+    for (auto & [tok, child] : node->children) stack.push_back(child.get());
+  }
+  root = std::make_unique<Node>();
+  entries = 0;
+  tokens = 0;
+  return dropped;
+}
+
+PrefixCache::Stats PrefixCache::stats() const {
+  Stats s;
+  s.hits = hits;
+  s.misses = misses;
+  s.reused_tokens = reused_tokens;
+  s.entries = entries;
+  s.tokens = tokens;
+  s.budget = budget;
+  return s;
+}
+
+}
@@ -0,0 +1,94 @@
+#ifndef AUTOCOG_BACKEND_LLAMA_PREFIX_CACHE_HXX
+#define AUTOCOG_BACKEND_LLAMA_PREFIX_CACHE_HXX
+
+#include "autocog/backend/llama/types.hxx"
+
+#include <map>
+#include <memory>
+#include <optional>
+#include <vector>
+
+namespace autocog::backend::llama {
+
+// Radix tree over the token prefixes held by KV sequences a Model retains
+// across evaluations (e.g. the header shared by every FTA of a program). It only
+// does the bookkeeping: the Model forks sequences in and out of the cache and
+// frees the KV of the sequences the cache hands back.
+//
+// Memory is accounted in tokens: the sum of the edge lengths, i.e. the KV cells
+// the retained sequences need when they share their common prefixes. When that
+// exceeds the budget, or there are more than `max_entries` entries, the least
+// recently used entries are dropped.
+class PrefixCache {
+  public:
+    struct Match {
+      ContextID seq;    // a retained sequence whose KV starts with...
+      size_t length;    // ...the first `length` tokens of the looked-up sequence
+    };
+
+    struct Stats {
+      unsigned long hits{0};
+      unsigned long misses{0};
+      unsigned long reused_tokens{0};   // prefill avoided by hits
+      size_t entries{0};
+      size_t tokens{0};
+      size_t budget{0};
+    };
+
+    PrefixCache(size_t const budget_ = 0, size_t const max_entries_ = 0);
+    ~PrefixCache();
+    PrefixCache(PrefixCache &&) noexcept;
+    PrefixCache(PrefixCache const &) = delete;
+    PrefixCache & operator=(PrefixCache const &) = delete;
+
+    // Longest prefix of `tokens` held by a retained sequence, if longer than
+    // `floor` (what the caller can already reuse). Counts a hit or a miss.
+    std::optional<Match> lookup(TokenSequence const & tokens, size_t const floor);
+
+    // True if a retained sequence already starts with all of `tokens`.
+    bool covers(TokenSequence const & tokens) const;
+
+    // Retain `seq`, which holds `tokens`. Returns the sequences no longer
+    // retained: entries that are prefixes of `tokens`, and LRU evictions.
+    std::vector<ContextID> insert(TokenSequence const & tokens, ContextID const seq);
+
+    // Drop the least recently used entry, returning its sequence (nothing if
+    // the cache is empty).
+    std::optional<ContextID> evict();
+
+    // Drop every entry, returning their sequences.
+    std::vector<ContextID> clear();
+
+    bool empty() const { return entries == 0; }
+    Stats stats() const;
+
+  private:
+    struct Node {
+      TokenSequence edge;                           // tokens from the parent to this node
+      Node * parent{nullptr};
+      std::map<TokenID, std::unique_ptr<Node>> children;
+      std::optional<ContextID> seq;                 // set if an entry ends here
+      unsigned long last_use{0};
+    };
+
+    std::unique_ptr<Node> root;
+    size_t budget;
+    size_t max_entries;
+    size_t entries{0};
+    size_t tokens{0};
+    unsigned long clock{0};
+    unsigned long hits{0};
+    unsigned long misses{0};
+    unsigned long reused_tokens{0};
+
+    // Deepest point of `tokens` in the tree: the node under which the match
+    // ended (possibly part-way through its edge) and the matched length.
+    std::pair<Node *, size_t> descend(TokenSequence const & tokens) const;
+    Node * any_entry(Node * node) const;
+    Node * oldest_entry(Node * node) const;
+    void drop(Node * node, std::vector<ContextID> & dropped);
+};
+
+}
+
+#endif // AUTOCOG_BACKEND_LLAMA_PREFIX_CACHE_HXX
@@ -37,12 +37,12 @@ PreparedFTA prepare(ModelID const id, data::FTA const & fta) {
       if (!t->text.empty()) p.tokens = model.tokenize(t->text, false, true);
     } else if (auto const * c = std::get_if<data::CompleteAction>(&a.body)) {
       p.stop = model.tokenize(c->stop_text, false, true);
-      if (c->vocab) {  // prime the per-model mask cache so it is ready at gen time
+      if (c->vocab) {  // start building the mask in the background so it is ready at gen time
         auto vit = fta.vocabs.find(*c->vocab);
         if (vit == fta.vocabs.end())
           throw autocog::ConfigError(
             "FTA action '" + a.uid + "' references unknown vocab '" + *c->vocab + "'", a.uid);
-        model.vocab_mask(*c->vocab, vit->second);
+        model.prime_vocab_mask(*c->vocab, vit->second);
       }
     } else if (auto const * ch = std::get_if<data::ChooseAction>(&a.body)) {
       p.choices.reserve(ch->choices.size());
@@ -52,6 +52,14 @@ PreparedFTA prepare(ModelID const id, data::FTA const & fta) {
   return prepared;
 }
 
+void prewarm(ModelID const id, data::STA const & sta) {
+  Model & model = Manager::get_model(id);
+  auto lock = Manager::lock_model(id);
+  for (auto const & [name, prompt] : sta.prompts)
+    for (auto const & [ref, expr] : prompt.vocabs)
+      model.prime_vocab_mask(ref, expr);
+}
+
 void detokenize(ModelID const id, data::FTT & ftt) {
   Model & model = Manager::get_model(id);
   std::function<void(data::FTTNode &)> walk = [&](data::FTTNode & node) {
@@ -5,6 +5,7 @@
 
 #include "autocog/data/fta.hxx"
 #include "autocog/data/ftt.hxx"
+#include "autocog/data/sta.hxx"
 
 #include <vector>
 
@@ -33,8 +34,14 @@ struct PreparedFTA {
 /// choices. Vocab masks are resolved lazily by the engine via the model cache.
 PreparedFTA prepare(ModelID const model, data::FTA const & fta);
 
+/// Start building (or loading from the model's mask cache) the vocab masks of
+/// every prompt of a program, so its first evaluations find them ready. Takes
+/// the model's lock.
+void prewarm(ModelID const model, data::STA const & sta);
+
 /// Fill every node's detokenized `text` from its `tokens`, in place. Run once
-/// after generation completes.
+/// after generation completes. Only reads the model's vocabulary, so it needs
+/// no model lock (see Manager::lock_model).
 void detokenize(ModelID const model, data::FTT & ftt);
 
 }
@@ -0,0 +1,539 @@
+
+#include "autocog/backend/llama/regex-dfa.hxx"
+
+#include <algorithm>
+#include <bitset>
+#include <limits>
+#include <map>
+#include <optional>
+#include <utility>
+
+namespace autocog::backend::llama {
+
+namespace {
+
+using ByteSet = std::bitset<256>;
+
+constexpr unsigned UNBOUNDED = std::numeric_limits<unsigned>::max();
+constexpr unsigned MAX_REPEAT = 1000;
+constexpr size_t MAX_NFA_STATES = 16384;
+
+struct Node {
+  enum class Kind { Empty, Bytes, Bol, Eol, Concat, Alt, Repeat };
+
+  Kind kind{Kind::Empty};
+  ByteSet bytes;
+  std::vector<Node> children;
+  unsigned min{0};
+  unsigned max{0};
+
+  static Node of(Kind const k) { Node n; n.kind = k; return n; }
+  static Node of(ByteSet const & s) { Node n; n.kind = Kind::Bytes; n.bytes = s; return n; }
+};
+
+ByteSet byte_range(unsigned char const lo, unsigned char const hi) {
+  ByteSet s;
+  for (unsigned c = lo; c <= hi; ++c) s.set(c);
+  return s;
+}
+
+ByteSet digits() { return byte_range('0', '9'); }
+ByteSet words() { return byte_range('a', 'z') | byte_range('A', 'Z') | digits() | ByteSet().set('_'); }
+ByteSet spaces() {
+  ByteSet s;
+  for (char c : {' ', '\t', '\n', '\v', '\f', '\r'}) s.set(static_cast<unsigned char>(c));
+  return s;
+}
+
+int hex_value(char const c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+bool is_alnum(char const c) {
+  return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+class Parser {
+  public:
+    explicit Parser(std::string const & pattern_) : pattern(pattern_) {}
+
+    // The pattern's tree, or nothing if it is outside the supported subset
+    // (or malformed): compile() then declines and the caller's std::regex
+    // decides.
+    std::optional<Node> parse() {
+      Node n = alternation();
+      if (!done()) fail();  // unbalanced ')'
+      if (failed) return std::nullopt;
+      return n;
+    }
+
+  private:
+    std::string const & pattern;
+    size_t pos{0};
+    bool failed{false};
+
+    // Skips the rest of the pattern: every loop ends, and parse() declines.
+    void fail() {
+      failed = true;
+      pos = pattern.size();
+    }
+
+    bool done() const { return pos >= pattern.size(); }
+    char peek() const { return pattern[pos]; }
+    char next() {
+      if (done()) {
+        fail();
+        return '\0';
+      }
+      return pattern[pos++];
+    }
+
+    Node alternation() {
+      Node first = sequence();
+      if (done() || peek() != '|') return first;
+      Node alt = Node::of(Node::Kind::Alt);
+      alt.children.push_back(std::move(first));
+      while (!done() && peek() == '|') {
+        ++pos;
+        alt.children.push_back(sequence());
+      }
+      return alt;
+    }
+
+    Node sequence() {
+      Node seq = Node::of(Node::Kind::Concat);
+      while (!done() && peek() != '|' && peek() != ')') seq.children.push_back(quantified());
+      return seq;
+    }
+
+    Node quantified() {
+      Node node = atom();
+      if (done()) return node;
+      unsigned min = 0, max = 0;
+      switch (peek()) {
+        case '*': min = 0; max = UNBOUNDED; ++pos; break;
+        case '+': min = 1; max = UNBOUNDED; ++pos; break;
+        case '?': min = 0; max = 1;         ++pos; break;
+        case '{': braces(min, max); break;
+        default: return node;
+      }
+      if (!done() && peek() == '?') ++pos;  // lazy: same set of matched strings
+      if (node.kind == Node::Kind::Bol || node.kind == Node::Kind::Eol) fail();
+      if (!done() && (peek() == '*' || peek() == '+' || peek() == '?' || peek() == '{')) fail();
+      Node rep = Node::of(Node::Kind::Repeat);
+      rep.min = min;
+      rep.max = max;
+      rep.children.push_back(std::move(node));
+      return rep;
+    }
+
+    unsigned number() {
+      if (done() || peek() < '0' || peek() > '9') {
+        fail();
+        return 0;
+      }
+      unsigned n = 0;
+      while (!done() && peek() >= '0' && peek() <= '9') {
+        n = n * 10 + static_cast<unsigned>(next() - '0');
+        if (n > MAX_REPEAT) {
+          fail();
+          return 0;
+        }
+      }
+      return n;
+    }
+
+    void braces(unsigned & min, unsigned & max) {
+      ++pos;  // '{'
+      min = number();
+      max = min;
+      if (!done() && peek() == ',') {
+        ++pos;
+        max = (!done() && peek() == '}') ? UNBOUNDED : number();
+      }
+      if (next() != '}' || min > max) fail();
+    }
+
+    Node atom() {
+      char const c = next();
+      switch (c) {
+        case '(': {
+          if (pattern.compare(pos, 2, "?:") == 0) pos += 2;
+          else if (!done() && peek() == '?') fail();  // lookarounds
+          Node inner = alternation();
+          if (next() != ')') fail();
+          return inner;
+        }
+        case '[':  return Node::of(char_class());
+        case '.':  return Node::of(ByteSet().set().reset('\n').reset('\r'));
+        case '^':  return Node::of(Node::Kind::Bol);
+        case '$':  return Node::of(Node::Kind::Eol);
+        case '\\': return Node::of(escape(false));
+        case '*': case '+': case '?': case '{': case '}': case ']': case ')': case '|':
+          fail();
+          return Node{};
+        default:
+          return Node::of(ByteSet().set(static_cast<unsigned char>(c)));
+      }
+    }
+
+    ByteSet escape(bool const in_class) {
+      char const c = next();
+      switch (c) {
+        case 'd': return digits();
+        case 'D': return ~digits();
+        case 'w': return words();
+        case 'W': return ~words();
+        case 's': return spaces();
+        case 'S': return ~spaces();
+        case 't': return ByteSet().set('\t');
+        case 'n': return ByteSet().set('\n');
+        case 'r': return ByteSet().set('\r');
+        case 'v': return ByteSet().set('\v');
+        case 'f': return ByteSet().set('\f');
+        case '0':
+          if (!done() && peek() >= '0' && peek() <= '9') fail();
+          return ByteSet().set(0);
+        case 'x': {
+          int const hi = hex_value(next());
+          int const lo = hex_value(next());
+          if (hi < 0 || lo < 0) {
+            fail();
+            return ByteSet();
+          }
+          return ByteSet().set(static_cast<size_t>(hi * 16 + lo));
+        }
+        case 'u': {
+          int value = 0;
+          for (int i = 0; i < 4; ++i) {
+            int const h = hex_value(next());
+            if (h < 0) {
+              fail();
+              return ByteSet();
+            }
+            value = value * 16 + h;
+          }
+          if (value >= 0x80) fail();  // multi-byte in UTF-8
+          return ByteSet().set(static_cast<size_t>(value));
+        }
+        case 'b':
+          if (in_class) return ByteSet().set('\b');
+          fail();  // word boundary
+          return ByteSet();
+        default:
+          if (is_alnum(c)) fail();  // back-references, \B, \cX, unknown escapes
+          return ByteSet().set(static_cast<unsigned char>(c));
+      }
+    }
+
+    // One class item: a byte (returned) or a class escape (-1, in `set`).
+    int class_item(ByteSet & set) {
+      char const c = next();
+      if (c == '[' && !done() && (peek() == ':' || peek() == '.' || peek() == '=')) {
+        fail();
+        return -1;
+      }
+      if (c != '\\') {
+        set = ByteSet().set(static_cast<unsigned char>(c));
+        return static_cast<unsigned char>(c);
+      }
+      set = escape(true);
+      if (set.count() != 1) return -1;
+      for (unsigned b = 0; b < 256; ++b) if (set.test(b)) return static_cast<int>(b);
+      return -1;
+    }
+
+    ByteSet char_class() {
+      bool negate = false;
+      if (!done() && peek() == '^') {
+        negate = true;
+        ++pos;
+      }
+      ByteSet set;
+      while (true) {
+        if (done()) {
+          fail();
+          break;
+        }
+        if (peek() == ']') {
+          ++pos;
+          break;
+        }
+        ByteSet item;
+        int const lo = class_item(item);
+        if (pos + 1 < pattern.size() && peek() == '-' && pattern[pos + 1] != ']') {
+          ++pos;
+          ByteSet hi_item;
+          int const hi = class_item(hi_item);
+          if (lo < 0 || hi < 0 || hi < lo) {
+            fail();
+            break;
+          }
+          set |= byte_range(static_cast<unsigned char>(lo), static_cast<unsigned char>(hi));
+        } else {
+          set |= item;
+        }
+      }
+      return negate ? ~set : set;
+    }
+};
+
+// States NFA::build() adds for `node`, saturating past MAX_NFA_STATES, so
+// nested repeats are rejected before they are expanded.
+size_t nfa_states(Node const & node) {
+  static constexpr size_t cap = MAX_NFA_STATES + 1;
+  auto const add = [](size_t const a, size_t const b) { return std::min(cap, a + b); };
+  auto const mul = [](size_t const a, size_t const b) { return a == 0 || b <= cap / a ? std::min(cap, a * b) : cap; };
+  switch (node.kind) {
+    case Node::Kind::Empty:
+    case Node::Kind::Bytes:
+    case Node::Kind::Bol:
+    case Node::Kind::Eol:
+      return 1;
+    case Node::Kind::Concat: {
+      size_t n = 0;
+      for (Node const & child : node.children) n = add(n, nfa_states(child));
+      return n == 0 ? 1 : n;
+    }
+    case Node::Kind::Alt: {
+      size_t n = node.children.size() - 1;  // splits
+      for (Node const & child : node.children) n = add(n, nfa_states(child));
+      return n;
+    }
+    case Node::Kind::Repeat: {
+      size_t const body = nfa_states(node.children.front());
+      size_t const optional = node.max == UNBOUNDED ? 1 : node.max - node.min;  // each with its split
+      size_t const n = add(mul(node.min, body), mul(optional, add(body, 1)));
+      return n == 0 ? 1 : n;
+    }
+  }
+  return cap;
+}
+
+// Thompson NFA. Bytes states consume one byte in `bytes`; the others are
+// epsilon moves, Bol / Eol only at the start / end of the input.
+struct NFA {
+  struct State {
+    enum class Type { Bytes, Split, Eps, Bol, Eol, Match };
+    Type type;
+    ByteSet bytes;
+    int out{-1};
+    int out1{-1};
+  };
+
+  // A partially built automaton: its entry state and the unpatched exits.
+  struct Frag {
+    int start;
+    std::vector<std::pair<int, int>> exits;  // (state, 0 for out / 1 for out1)
+  };
+
+  std::vector<State> states;
+  int start{-1};
+
+  int add(State::Type const type, ByteSet const & bytes = {}) {
+    states.push_back(State{type, bytes});
+    return static_cast<int>(states.size()) - 1;
+  }
+
+  void patch(std::vector<std::pair<int, int>> const & exits, int const target) {
+    for (auto [s, slot] : exits) (slot == 0 ? states[s].out : states[s].out1) = target;
+  }
+
+  Frag single(State::Type const type, ByteSet const & bytes = {}) {
+    int const s = add(type, bytes);
+    return Frag{s, {{s, 0}}};
+  }
+
+  Frag concat(std::vector<Frag> parts) {
+    if (parts.empty()) return single(State::Type::Eps);
+    for (size_t i = 1; i < parts.size(); ++i) patch(parts[i - 1].exits, parts[i].start);
+    return Frag{parts.front().start, std::move(parts.back().exits)};
+  }
+
+  Frag build(Node const & node) {
+    switch (node.kind) {
+      case Node::Kind::Empty: return single(State::Type::Eps);
+      case Node::Kind::Bytes: return single(State::Type::Bytes, node.bytes);
+      case Node::Kind::Bol:   return single(State::Type::Bol);
+      case Node::Kind::Eol:   return single(State::Type::Eol);
+      case Node::Kind::Concat: {
+        std::vector<Frag> parts;
+        for (Node const & child : node.children) parts.push_back(build(child));
+        return concat(std::move(parts));
+      }
+      case Node::Kind::Alt: {
+        Frag last = build(node.children.back());
+        for (size_t i = node.children.size() - 1; i-- > 0;) {
+          Frag alt = build(node.children[i]);
+          int const split = add(State::Type::Split);
+          states[split].out = alt.start;
+          states[split].out1 = last.start;
+          alt.exits.insert(alt.exits.end(), last.exits.begin(), last.exits.end());
+          last = Frag{split, std::move(alt.exits)};
+        }
+        return last;
+      }
+      case Node::Kind::Repeat: {
+        Node const & child = node.children.front();
+        std::vector<Frag> parts;
+        for (unsigned i = 0; i < node.min; ++i) parts.push_back(build(child));
+        if (node.max == UNBOUNDED) {
+          Frag body = build(child);
+          int const split = add(State::Type::Split);
+          states[split].out = body.start;
+          patch(body.exits, split);
+          parts.push_back(Frag{split, {{split, 1}}});
+        } else {
+          for (unsigned i = node.min; i < node.max; ++i) {
+            Frag body = build(child);
+            int const split = add(State::Type::Split);
+            states[split].out = body.start;
+            body.exits.emplace_back(split, 1);
+            parts.push_back(Frag{split, std::move(body.exits)});
+          }
+        }
+        return concat(std::move(parts));
+      }
+    }
+    return single(State::Type::Eps);
+  }
+
+  explicit NFA(Node const & root) {
+    Frag f = build(root);
+    patch(f.exits, add(State::Type::Match));
+    start = f.start;
+  }
+};
+
+// Epsilon closures over the NFA. A closure keeps the states that matter to the
+// DFA: Bytes (to move on), Match, and Eol (pending until the input ends).
+class Closure {
+  public:
+    explicit Closure(NFA const & nfa_) : nfa(nfa_), mark(nfa_.states.size(), 0) {}
+
+    std::vector<int> operator()(std::vector<int> const & seeds, bool const bol, bool const eol) {
+      ++generation;
+      std::vector<int> result;
+      std::vector<int> stack(seeds.rbegin(), seeds.rend());
+      while (!stack.empty()) {
+        int const s = stack.back();
+        stack.pop_back();
+        if (s < 0 || mark[s] == generation) continue;
+        mark[s] = generation;
+        NFA::State const & st = nfa.states[s];
+        switch (st.type) {
+          case NFA::State::Type::Bytes:
+          case NFA::State::Type::Match:
+            result.push_back(s);
+            break;
+          case NFA::State::Type::Split:
+            stack.push_back(st.out1);
+            stack.push_back(st.out);
+            break;
+          case NFA::State::Type::Eps:
+            stack.push_back(st.out);
+            break;
+          case NFA::State::Type::Bol:
+            if (bol) stack.push_back(st.out);
+            break;
+          case NFA::State::Type::Eol:
+            result.push_back(s);
+            if (eol) stack.push_back(st.out);
+            break;
+        }
+      }
+      std::sort(result.begin(), result.end());
+      return result;
+    }
+
+    bool has_match(std::vector<int> const & set) const {
+      for (int s : set) if (nfa.states[s].type == NFA::State::Type::Match) return true;
+      return false;
+    }
+
+  private:
+    NFA const & nfa;
+    std::vector<unsigned> mark;
+    unsigned generation{0};
+};
+
+}
+
+std::optional<RegexDFA> RegexDFA::compile(std::string const & pattern) {
+  std::optional<Node> const root = Parser(pattern).parse();
+  if (!root || nfa_states(*root) + 1 > MAX_NFA_STATES) return std::nullopt;  // + Match
+  NFA const nfa(*root);
+
+  // Bytes no NFA state tells apart share a class, so each DFA state computes
+  // one move per class instead of 256.
+  std::vector<unsigned> byte_class(256);
+  std::vector<unsigned> representative;
+  {
+    std::map<std::vector<bool>, unsigned> classes;
+    for (unsigned c = 0; c < 256; ++c) {
+      std::vector<bool> signature;
+      for (auto const & st : nfa.states)
+        if (st.type == NFA::State::Type::Bytes) signature.push_back(st.bytes.test(c));
+      auto [it, inserted] = classes.emplace(std::move(signature), representative.size());
+      if (inserted) representative.push_back(c);
+      byte_class[c] = it->second;
+    }
+  }
+
+  // Subset construction. regex_search may start a match at any position, so
+  // the start closure is added back after every byte; a reached Match state
+  // ends the search, so matched states need no transitions.
+  Closure closure(nfa);
+  std::vector<int> const restart = closure({nfa.start}, false, false);
+  std::map<std::vector<int>, std::uint32_t> ids;
+  std::vector<std::vector<int>> sets;
+  auto intern = [&](std::vector<int> set) -> std::optional<std::uint32_t> {
+    auto it = ids.find(set);
+    if (it != ids.end()) return it->second;
+    if (sets.size() >= MAX_STATES) return std::nullopt;
+    auto const id = static_cast<std::uint32_t>(sets.size());
+    ids.emplace(set, id);
+    sets.push_back(std::move(set));
+    return id;
+  };
+  intern(closure({nfa.start}, true, false));
+
+  RegexDFA dfa;
+  for (size_t i = 0; i < sets.size(); ++i) {
+    std::vector<int> const set = sets[i];
+    bool const matched = closure.has_match(set);
+    dfa.matched_.push_back(matched);
+    dfa.matched_at_end_.push_back(matched || closure.has_match(
+        i == 0 ? closure({nfa.start}, true, true) : closure(set, false, true)));
+
+    std::vector<std::uint32_t> row(representative.size(), static_cast<std::uint32_t>(i));
+    if (!matched) {
+      for (size_t k = 0; k < representative.size(); ++k) {
+        std::vector<int> moved = restart;
+        for (int s : set) {
+          NFA::State const & st = nfa.states[s];
+          if (st.type == NFA::State::Type::Bytes && st.bytes.test(representative[k])) moved.push_back(st.out);
+        }
+        auto const id = intern(closure(moved, false, false));
+        if (!id) return std::nullopt;
+        row[k] = *id;
+      }
+    }
+    for (unsigned c = 0; c < 256; ++c) dfa.next_.push_back(row[byte_class[c]]);
+  }
+  return dfa;
+}
+
+bool RegexDFA::search(std::string_view const text) const {
+  std::uint32_t state = 0;
+  for (char const c : text) {
+    if (matched_[state]) return true;
+    state = next_[state * 256 + static_cast<unsigned char>(c)];
+  }
+  return matched_at_end_[state];
+}
+
+}
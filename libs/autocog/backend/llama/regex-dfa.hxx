@@ -0,0 +1,41 @@
+#ifndef AUTOCOG_BACKEND_LLAMA_REGEX_DFA_HXX
+#define AUTOCOG_BACKEND_LLAMA_REGEX_DFA_HXX
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace autocog::backend::llama {
+
+// Regex vocab matcher: a pattern compiled once into a byte-level DFA, then run
+// over every token surface with one table lookup per byte.
+//
+// Matching follows std::regex_search with the default ECMAScript grammar, for
+// the subset vocab regexes use: literals and escapes, `.`, classes (ranges,
+// negation, \d \w \s and their complements), groups, alternation, greedy or
+// lazy quantifiers (including {m,n}), and the ^ / $ anchors. Patterns outside
+// that subset (back-references, lookarounds, \b) or whose DFA would exceed
+// MAX_STATES do not compile; callers fall back to std::regex.
+class RegexDFA {
+  public:
+    static constexpr size_t MAX_STATES = 4096;
+
+    static std::optional<RegexDFA> compile(std::string const & pattern);
+
+    // True if some substring of `text` matches (regex_search semantics).
+    bool search(std::string_view const text) const;
+
+    size_t n_states() const { return matched_.size(); }
+
+  private:
+    std::vector<std::uint32_t> next_;   // n_states x 256 transitions
+    std::vector<bool> matched_;         // a match ended at or before this state
+    std::vector<bool> matched_at_end_;  // matched if the input ends here ($)
+};
+
+}
+
+#endif // AUTOCOG_BACKEND_LLAMA_REGEX_DFA_HXX
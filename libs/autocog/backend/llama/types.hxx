@@ -18,7 +18,7 @@ using ProbaSequence = std::vector<float>;
 
 // Backend-specific types
 using ModelID   = unsigned;
-using ContextID = unsigned;
+using ContextID = unsigned;  // a KV sequence (llama_seq_id) of the model's llama context
 
 }
 
@@ -0,0 +1,158 @@
+
+#include "autocog/backend/llama/vocab-mask.hxx"
+#include "autocog/backend/llama/logits.hxx"
+
+#include "autocog/utilities/exception.hxx"
+
+#include <algorithm>
+#include <string>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#  define AUTOCOG_VOCAB_MASK_X86 1
+#  include <immintrin.h>
+#else
+#  define AUTOCOG_VOCAB_MASK_X86 0
+#endif
+
+namespace autocog::backend::llama {
+
+namespace {
+
+using Word = VocabMask::Word;
+
+enum class Op { Or, And, AndNot };
+
+template <Op op>
+inline Word apply(Word const a, Word const b) {
+  if constexpr (op == Op::Or) return a | b;
+  else if constexpr (op == Op::And) return a & b;
+  else return a & ~b;
+}
+
+template <Op op>
+void combine_scalar(Word * a, Word const * b, size_t const n, size_t const start) {
+  for (size_t i = start; i < n; ++i) a[i] = apply<op>(a[i], b[i]);
+}
+
+#if AUTOCOG_VOCAB_MASK_X86
+
+// 256 tokens per step. Same runtime selection as the logits kernels.
+template <Op op>
+__attribute__((target("avx2")))
+void combine_avx2(Word * a, Word const * b, size_t const n) {
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256i const x = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(a + i));
+    __m256i const y = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(b + i));
+    __m256i r;
+    if constexpr (op == Op::Or) r = _mm256_or_si256(x, y);
+    else if constexpr (op == Op::And) r = _mm256_and_si256(x, y);
+    else r = _mm256_andnot_si256(y, x);
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(a + i), r);
+  }
+  combine_scalar<op>(a, b, n, i);
+}
+
+#endif
+
+template <Op op>
+void combine(Word * a, Word const * b, size_t const n) {
+#if AUTOCOG_VOCAB_MASK_X86
+  if (simd_level() != SimdLevel::Scalar) {
+    combine_avx2<op>(a, b, n);
+    return;
+  }
+#endif
+  combine_scalar<op>(a, b, n, 0);
+}
+
+}
+
+VocabMask::VocabMask(size_t const n, bool const value) :
+  size_(n),
+  words_((n + WORD_BITS - 1) / WORD_BITS, value ? ~Word{0} : Word{0})
+{
+  clear_tail();
+}
+
+VocabMask VocabMask::view(size_t const n, Word const * words, std::shared_ptr<void const> backing) {
+  VocabMask mask;
+  mask.size_ = n;
+  mask.view_ = words;
+  mask.backing_ = std::move(backing);
+  return mask;
+}
+
+VocabMask::Word * VocabMask::modify() {
+  if (backing_) {
+    words_.assign(view_, view_ + n_words());
+    backing_.reset();
+    view_ = nullptr;
+  }
+  sparse_ = false;
+  return words_.data();
+}
+
+void VocabMask::clear_tail() {
+  if (size_ % WORD_BITS != 0)
+    words_.back() &= (Word{1} << (size_ % WORD_BITS)) - 1;
+}
+
+void VocabMask::check_size(VocabMask const & other) const {
+  if (other.size_ != size_)
+    throw autocog::utilities::InternalError("VocabMask size mismatch: " + std::to_string(size_) + " vs " + std::to_string(other.size_));
+}
+
+size_t VocabMask::count() const {
+  Word const * data = words();
+  size_t n = 0;
+  for (size_t i = 0; i < n_words(); ++i) n += __builtin_popcountll(data[i]);
+  return n;
+}
+
+bool VocabMask::none() const {
+  Word const * data = words();
+  for (size_t i = 0; i < n_words(); ++i) if (data[i] != 0) return false;
+  return true;
+}
+
+bool VocabMask::operator==(VocabMask const & other) const {
+  return size_ == other.size_ && std::equal(words(), words() + n_words(), other.words());
+}
+
+bool VocabMask::index(size_t const max_allowed) {
+  if (sparse_) return true;
+  allowed_.clear();
+  if (count() > max_allowed) return false;
+  allowed_.reserve(count());
+  for_each([this](TokenID const tok) { allowed_.push_back(tok); });
+  sparse_ = true;
+  return true;
+}
+
+VocabMask & VocabMask::operator|=(VocabMask const & other) {
+  check_size(other);
+  combine<Op::Or>(modify(), other.words(), n_words());
+  return *this;
+}
+
+VocabMask & VocabMask::operator&=(VocabMask const & other) {
+  check_size(other);
+  combine<Op::And>(modify(), other.words(), n_words());
+  return *this;
+}
+
+VocabMask & VocabMask::subtract(VocabMask const & other) {
+  check_size(other);
+  combine<Op::AndNot>(modify(), other.words(), n_words());
+  return *this;
+}
+
+VocabMask & VocabMask::flip() {
+  Word * data = modify();
+  for (size_t i = 0; i < n_words(); ++i) data[i] = ~data[i];
+  clear_tail();
+  return *this;
+}
+
+}
@@ -0,0 +1,102 @@
+#ifndef AUTOCOG_BACKEND_LLAMA_VOCAB_MASK_HXX
+#define AUTOCOG_BACKEND_LLAMA_VOCAB_MASK_HXX
+
+#include "autocog/backend/llama/types.hxx"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace autocog::backend::llama {
+
+// Set of allowed tokens over a model's vocabulary, packed 64 tokens per word.
+// Bits past size() are always clear, so word-wide operations (set algebra,
+// popcount, iteration) never need to special-case the last word.
+//
+// A mask that allows few tokens can also carry a sorted list of them (see
+// index()), so masked scans touch O(allowed) entries instead of O(vocab). Any
+// modification drops the list.
+//
+// The words are either owned or a read-only view of external storage (a mask
+// file mapped by MaskStore); a view is copied on first modification.
+class VocabMask {
+  public:
+    using Word = std::uint64_t;
+    static constexpr size_t WORD_BITS = 64;
+
+    VocabMask() = default;
+    explicit VocabMask(size_t const n, bool const value = false);
+
+    // Mask of `n` tokens over n_words() words at `words`, which `backing` keeps
+    // alive (and valid) for as long as the mask or a copy of it exists.
+    static VocabMask view(size_t const n, Word const * words, std::shared_ptr<void const> backing);
+
+    size_t size() const { return size_; }
+    size_t n_words() const { return (size_ + WORD_BITS - 1) / WORD_BITS; }
+    Word const * words() const { return backing_ ? view_ : words_.data(); }
+    // Raw words for bulk construction (e.g. one thread per range of words).
+    // Drops the sparse list; bits past size() must be left clear.
+    Word * mutable_words() { return modify(); }
+
+    bool test(size_t const tok) const { return (words()[tok / WORD_BITS] >> (tok % WORD_BITS)) & 1u; }
+    bool operator[](size_t const tok) const { return test(tok); }
+    void set(size_t const tok) { modify()[tok / WORD_BITS] |= Word{1} << (tok % WORD_BITS); }
+    void reset(size_t const tok) { modify()[tok / WORD_BITS] &= ~(Word{1} << (tok % WORD_BITS)); }
+
+    // Bits [tok, tok + width) as the low bits of a word. `tok` must be a
+    // multiple of `width`, which must divide WORD_BITS.
+    Word bits(size_t const tok, unsigned const width) const {
+      Word const w = words()[tok / WORD_BITS] >> (tok % WORD_BITS);
+      return width == WORD_BITS ? w : w & ((Word{1} << width) - 1);
+    }
+
+    size_t count() const;  // number of allowed tokens
+    bool none() const;
+
+    VocabMask & operator|=(VocabMask const & other);
+    VocabMask & operator&=(VocabMask const & other);
+    VocabMask & subtract(VocabMask const & other);  // this & ~other
+    VocabMask & flip();
+
+    // Build the allowed-token list if at most `max_allowed` tokens are allowed.
+    // Returns whether the mask is now sparse.
+    bool index(size_t const max_allowed);
+    bool sparse() const { return sparse_; }
+    std::vector<TokenID> const & allowed() const { return allowed_; }  // valid if sparse()
+
+    bool operator==(VocabMask const & other) const;
+    bool operator!=(VocabMask const & other) const { return !(*this == other); }
+
+    // Calls f(tok) for every allowed token in increasing order, from the sparse
+    // list if any, otherwise skipping whole zero words.
+    template <typename F>
+    void for_each(F && f) const {
+      if (sparse_) {
+        for (TokenID tok : allowed_) f(tok);
+        return;
+      }
+      Word const * data = words();
+      for (size_t w = 0; w < n_words(); ++w) {
+        for (Word bits = data[w]; bits != 0; bits &= bits - 1)
+          f(static_cast<TokenID>(w * WORD_BITS + __builtin_ctzll(bits)));
+      }
+    }
+
+  private:
+    size_t size_{0};
+    std::vector<Word> words_;
+    std::shared_ptr<void const> backing_;  // set for views
+    Word const * view_{nullptr};
+    bool sparse_{false};
+    std::vector<TokenID> allowed_;
+
+    // Owned words, about to be modified: copies a view, drops the sparse list.
+    Word * modify();
+    void clear_tail();
+    void check_size(VocabMask const & other) const;
+};
+
+}
+
+#endif // AUTOCOG_BACKEND_LLAMA_VOCAB_MASK_HXX
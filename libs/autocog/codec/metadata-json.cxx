@@ -10,6 +10,7 @@ nlohmann::json to_json(Metadata const & m) {
     {"version",   m.version},
     {"hash",      m.hash},
     {"timestamp", m.timestamp},
+    {"scheme",    static_cast<unsigned>(m.scheme)},
   };
 }
 
@@ -20,6 +21,9 @@ void from_json(nlohmann::json const & dom, Metadata & m) {
   m.version   = dom.at("version").get<std::string>();
   m.hash      = dom.at("hash").get<std::string>();
   m.timestamp = dom.at("timestamp").get<std::string>();
+  // Absent from artifacts stored before hash schemes were versioned.
+  m.scheme    = dom.contains("scheme") ? Metadata::scheme_from(dom.at("scheme").get<unsigned>())
+                                       : HashScheme::Text;
   });
 }
 
@@ -11,6 +11,7 @@ pybind11::object to_py(Metadata const & m) {
   d["version"]   = m.version;
   d["hash"]      = m.hash;
   d["timestamp"] = m.timestamp;
+  d["scheme"]    = static_cast<unsigned>(m.scheme);
   return d;
 }
 
@@ -22,6 +23,9 @@ void from_py(pybind11::object const & obj, Metadata & m) {
   m.version   = d["version"].cast<std::string>();
   m.hash      = d["hash"].cast<std::string>();
   m.timestamp = d["timestamp"].cast<std::string>();
+  // Absent from artifacts stored before hash schemes were versioned.
+  m.scheme    = d.contains("scheme") ? Metadata::scheme_from(d["scheme"].cast<unsigned>())
+                                     : HashScheme::Text;
 }
 
 }
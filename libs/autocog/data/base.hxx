@@ -15,7 +15,7 @@ namespace autocog::data {
 /// SearchConfig).
 ///
 /// It owns the identity/provenance fields and the finalize/hash surface; each
-/// derived @p CRT supplies its own content hash through `content_hash()`.
+/// derived @p CRT supplies its own content hash through `content_hash(scheme)`.
 /// Conversion lives in the free functions in json.hxx / python.hxx, not here,
 /// so this header carries no nlohmann/pybind dependency. Nothing here is
 /// virtual: dispatch to the derived is static, via `static_cast<CRT const *>`.
@@ -36,9 +36,10 @@ class Base {
     void finalize();
 
   protected:
-    /// The artifact identity: the hash of the provenance combined with the
-    /// derived content hash. Metadata is not an input (it stores this value).
-    std::string hash() const;
+    /// The artifact identity under @p scheme: the hash of the provenance
+    /// combined with the derived content hash. Metadata is not an input (it
+    /// stores this value, and the scheme).
+    std::string hash(HashScheme const scheme) const;
 };
 
 }
@@ -4,23 +4,31 @@ namespace autocog::data {
 
 template <class CRT>
 void Base<CRT>::finalize() {
-  std::string const h = hash();
   if (metadata) {
-    // verify
+    // verify, under the scheme the artifact was hashed with
+    std::string const h = hash(metadata->scheme);
     if (metadata->hash != h)
       throw autocog::IntegrityError("autocog::data: hash mismatch on finalize", CRT::format, metadata->hash, h);
   } else {
     // construct
-    metadata = Metadata::make<CRT>(h);
+    metadata = Metadata::make<CRT>(hash(hash_scheme));
   }
 }
 
 template <class CRT>
-std::string Base<CRT>::hash() const {
-  // hash( hash(provenance) + content_hash() )
-  std::string prov;
-  for (auto const & [role, h] : provenance) prov += role + '=' + h + ';';
-  return digest(digest(prov) + static_cast<CRT const *>(this)->content_hash());
+std::string Base<CRT>::hash(HashScheme const scheme) const {
+  Digest const content = static_cast<CRT const *>(this)->content_hash(scheme);
+  if (scheme == HashScheme::Text) {
+    // hash( hash(provenance) + content_hash() ), over hex strings
+    std::string prov;
+    for (auto const & [role, h] : provenance) prov += role + '=' + h + ';';
+    return digest(digest(prov) + to_hex(content));
+  }
+  // The provenance entries, then the content digest, in one stream.
+  ContentHasher h(scheme);
+  h.put(static_cast<unsigned>(provenance.size()));
+  for (auto const & [role, id] : provenance) h.put(role).put(id);
+  return h.put(content).hash();
 }
 
 }
@@ -11,17 +11,17 @@ template <class... Ts> overloaded(Ts...) -> overloaded<Ts...>;
 
 void put_paths(ContentHasher & h, std::vector<PathStep> const & v) {
   h.put(static_cast<unsigned>(v.size()));
-  for (auto const & p : v) h.put(p.hash());
+  for (auto const & p : v) h.put(p.digest(h.scheme()));
 }
 void put_clauses(ContentHasher & h, std::vector<Clause> const & v) {
   h.put(static_cast<unsigned>(v.size()));
-  for (auto const & c : v) h.put(c.hash());
+  for (auto const & c : v) h.put(c.digest(h.scheme()));
 }
 
 }  // namespace
 
-std::string Clause::hash() const {
-  ContentHasher h;
+Digest Clause::digest(HashScheme const scheme) const {
+  ContentHasher h(scheme);
   h.put(static_cast<unsigned>(value.index()));
   std::visit(overloaded{
     [&](BindClause const & c)   { put_paths(h, c.source); put_paths(h, c.target); },
@@ -30,20 +30,20 @@ std::string Clause::hash() const {
     [&](PruneClause const & c)  { put_paths(h, c.target); },
     [&](MappedClause const & c) { put_paths(h, c.target); },
   }, value);
-  return h.hash();
+  return h.digest();
 }
 
-std::string ChannelKwarg::hash() const {
-  ContentHasher h;
+Digest ChannelKwarg::digest(HashScheme const scheme) const {
+  ContentHasher h(scheme);
   h.put(name).put(is_input);
   put_paths(h, path);
   put_clauses(h, clauses);
   h.put(prompt).put(value);
-  return h.hash();
+  return h.digest();
 }
 
-std::string Channel::hash() const {
-  ContentHasher h;
+Digest Channel::digest(HashScheme const scheme) const {
+  ContentHasher h(scheme);
   h.put(static_cast<unsigned>(value.index()));
   std::visit(overloaded{
     [&](InputChannel const & c) {
@@ -55,12 +55,12 @@ std::string Channel::hash() const {
     [&](CallChannel const & c) {
       put_paths(h, c.target);
       h.put(static_cast<unsigned>(c.kwargs.size()));
-      for (auto const & kw : c.kwargs) h.put(kw.hash());
+      for (auto const & kw : c.kwargs) h.put(kw.digest(scheme));
       put_clauses(h, c.clauses);
       h.put(c.extern_func).put(c.entry);
     },
   }, value);
-  return h.hash();
+  return h.digest();
 }
 
 }
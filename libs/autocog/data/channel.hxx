@@ -23,7 +23,7 @@ struct MappedClause { std::vector<PathStep> target; };
 
 struct Clause {
   std::variant<BindClause, RavelClause, WrapClause, PruneClause, MappedClause> value;
-  std::string hash() const;
+  Digest digest(HashScheme const scheme = hash_scheme) const;
 };
 
 // --- Call kwarg --------------------------------------------------------------
@@ -35,7 +35,7 @@ struct ChannelKwarg {
   std::vector<PathStep> path;
   std::optional<std::string> value;    ///< literal value (null = none)
   std::vector<Clause> clauses;
-  std::string hash() const;
+  Digest digest(HashScheme const scheme = hash_scheme) const;
 };
 
 // --- Channels ----------------------------------------------------------------
@@ -59,7 +59,7 @@ struct CallChannel {
 
 struct Channel {
   std::variant<InputChannel, DataflowChannel, CallChannel> value;
-  std::string hash() const;
+  Digest digest(HashScheme const scheme = hash_scheme) const;
 };
 
 }
@@ -9,8 +9,8 @@ template <class... Ts> struct overloaded : Ts... { using Ts::operator()...; };
 template <class... Ts> overloaded(Ts...) -> overloaded<Ts...>;
 }  // namespace
 
-std::string Action::hash() const {
-  ContentHasher h;
+Digest Action::digest(HashScheme const scheme) const {
+  ContentHasher h(scheme);
   h.put(uid);
   h.put(static_cast<unsigned>(body.index()));
   std::visit(overloaded{
@@ -26,17 +26,17 @@ std::string Action::hash() const {
     },
   }, body);
   h.put(field).put(indices).put(successors);
-  return h.hash();
+  return h.digest();
 }
 
-std::string FTA::content_hash() const {
-  ContentHasher h;
+Digest FTA::content_hash(HashScheme const scheme) const {
+  ContentHasher h(scheme);
   h.put(static_cast<unsigned>(actions.size()));
-  for (auto const & a : actions) h.put(a.hash());   // positional: actions[0] is the entry
+  for (auto const & a : actions) h.put(a.digest(scheme));   // positional: actions[0] is the entry
   h.put(queue_metric);
   h.put(static_cast<unsigned>(vocabs.size()));
-  for (auto const & [k, ve] : vocabs) h.put(k).put(ve.hash());  // std::map: canonical by key
-  return h.hash();
+  for (auto const & [k, ve] : vocabs) h.put(k).put(ve.digest(scheme));  // std::map: canonical by key
+  return h.digest();
 }
 
 }
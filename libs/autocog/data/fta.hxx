@@ -49,7 +49,7 @@ struct Action {
   std::optional<std::vector<int>> indices;      ///< Nested field indices, when present.
   std::variant<TextAction, CompleteAction, ChooseAction> body;
 
-  std::string hash() const;
+  Digest digest(HashScheme const scheme = hash_scheme) const;
 };
 
 /// A finite thought automaton: a DAG of actions (edges by successor uid, entry
@@ -64,7 +64,7 @@ class FTA : public Base<FTA> {
     std::map<std::string, VocabExpr> vocabs;    ///< ref -> expression tree.
 
   public:
-    std::string content_hash() const;
+    Digest content_hash(HashScheme const scheme) const;
 };
 
 }
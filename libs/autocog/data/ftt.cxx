@@ -6,8 +6,9 @@
 
 namespace autocog::data {
 
-std::string FTTNode::hash() const {
-  ContentHasher h;
+Digest FTTNode::digest(HashScheme const scheme) const {
+  if (merkle && scheme == hash_scheme) return *merkle;
+  ContentHasher h(scheme);
   h.put(action)
    .put(uid)
    .put(field)
@@ -20,18 +21,19 @@ std::string FTTNode::hash() const {
   h.put(static_cast<unsigned>(children.size()));
   // Child order reflects an exploration heuristic (possibly parallel) and is not
   // enforced by the structure, so fold children in a canonical order. Each
-  // child's hash already covers its whole subtree, so sorting on it alone makes
-  // the result independent of sibling order.
-  std::vector<std::string> kids;
+  // child's digest already covers its whole subtree, so sorting on it alone
+  // makes the result independent of sibling order (and sorting raw digests
+  // orders them as their hex strings would).
+  std::vector<Digest> kids;
   kids.reserve(children.size());
-  for (auto const & c : children) kids.push_back(c.hash());
+  for (auto const & c : children) kids.push_back(c.digest(scheme));
   std::sort(kids.begin(), kids.end());
   for (auto const & k : kids) h.put(k);
-  return h.hash();
+  return h.digest();
 }
 
-std::string FTT::content_hash() const {
-  return root.hash();
+Digest FTT::content_hash(HashScheme const scheme) const {
+  return root.digest(scheme);
 }
 
 }
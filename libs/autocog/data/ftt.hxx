@@ -2,6 +2,7 @@
 #define AUTOCOG_DATA_FTT_HXX
 
 #include "autocog/data/base.hxx"
+#include "autocog/data/utility.hxx"
 
 #include <cstdint>
 #include <list>
@@ -32,8 +33,21 @@ struct FTTNode {
   std::vector<TokenID> tokens;               ///< Tokens generated at this node.
   std::list<FTTNode> children;
 
-  /// Recursive content hash: digest(fields + child count + each child's hash).
-  std::string hash() const;
+  /// Cached digest() of the subtree under the current hash_scheme, set by
+  /// seal(). Not content: the codecs ignore it, so a tree read back in is
+  /// hashed afresh.
+  std::optional<Digest> merkle;
+
+  /// Merkle content digest: digest(fields + child count + each child's
+  /// digest). Sealed children contribute their cached digest; the others are
+  /// hashed recursively.
+  Digest digest(HashScheme const scheme = hash_scheme) const;
+  /// Hex form of digest().
+  std::string hash(HashScheme const scheme = hash_scheme) const { return to_hex(digest(scheme)); }
+  /// Cache digest() in `merkle`. For the producer of the tree, once nothing
+  /// hashed in this subtree can change anymore: a tree sealed bottom-up as it
+  /// grows has its root digest ready when it is complete.
+  void seal() { merkle = digest(); }
 };
 
 /// A finite thought tree: one artifact identity for the whole tree.
@@ -44,7 +58,7 @@ class FTT : public Base<FTT> {
     FTTNode root;
 
   public:
-    std::string content_hash() const;
+    Digest content_hash(HashScheme const scheme) const;
 };
 
 }
@@ -2,6 +2,7 @@
 #define AUTOCOG_DATA_METADATA_HXX
 
 #include "autocog/data/utility.hxx"
+#include "autocog/utilities/errors.hxx"
 
 #include <string>
 #include <utility>
@@ -25,11 +26,15 @@ struct Metadata {
   std::string version;    ///< Schema version of the serialized form.
   std::string hash;       ///< The artifact's identity (content + provenance).
   std::string timestamp;  ///< RFC 3339 UTC time the artifact was finalized.
+  HashScheme scheme = HashScheme::Text;  ///< Encoding @ref hash was computed with.
 
   /// Build a fresh header for a finalized artifact of type @p CRT: format from
-  /// CRT::format, version from schema_version.
+  /// CRT::format, version from schema_version, scheme from hash_scheme.
   template <class CRT>
   static Metadata make(std::string hash);
+
+  /// The scheme numbered @p n. Throws SchemaError if there is none.
+  static HashScheme scheme_from(unsigned const n);
 };
 
 }
@@ -9,7 +9,14 @@ Metadata Metadata::make(std::string hash) {
   m.version = schema_version;
   m.hash    = std::move(hash);
   m.timestamp = utc_timestamp();
+  m.scheme  = hash_scheme;
   return m;
 }
 
+inline HashScheme Metadata::scheme_from(unsigned const n) {
+  if (n != static_cast<unsigned>(HashScheme::Text) && n != static_cast<unsigned>(HashScheme::Binary))
+    throw autocog::SchemaError("autocog::data: unknown hash scheme " + std::to_string(n), "metadata.scheme");
+  return static_cast<HashScheme>(n);
+}
+
 }
@@ -6,8 +6,8 @@
 
 namespace autocog::data {
 
-std::string PathStep::hash() const {
-  ContentHasher h;
+Digest PathStep::digest(HashScheme const scheme) const {
+  ContentHasher h(scheme);
   h.put(name);
   if (!selector) {
     h.put(0u);
@@ -20,7 +20,7 @@ std::string PathStep::hash() const {
     h.put(r.lower);
     h.put(r.upper);
   }
-  return h.hash();
+  return h.digest();
 }
 
 }
@@ -1,6 +1,8 @@
 #ifndef AUTOCOG_DATA_PATH_HXX
 #define AUTOCOG_DATA_PATH_HXX
 
+#include "autocog/data/utility.hxx"
+
 #include <optional>
 #include <string>
 #include <variant>
@@ -21,7 +23,7 @@ struct PathStep {
   std::string name;
   std::optional<std::variant<int, StepRange>> selector;
 
-  std::string hash() const;
+  Digest digest(HashScheme const scheme = hash_scheme) const;
 };
 
 }
@@ -1,36 +1,46 @@
 #ifndef AUTOCOG_DATA_REGISTRY_HXX
 #define AUTOCOG_DATA_REGISTRY_HXX
 
-#include <map>
+#include <array>
+#include <atomic>
 #include <memory>
-#include <mutex>
+#include <shared_mutex>
 #include <string>
+#include <unordered_map>
 
 namespace autocog::data {
 
 /// A reference-counted, content-addressed store of artifacts of one format @p T.
 ///
-/// Entries are keyed by the artifact's own content hash (Metadata::hash) and
-/// owned by the registry. Objects are immutable once added -- only a const
-/// accessor exists -- which is what makes content-dedup and shared references
-/// safe. Every add records one holder; identical content collapses onto a
-/// single entry and just bumps the count; release drops a holder and frees the
-/// entry only when the last one lets go. Thread-safe: the bindings drive it
-/// from multiple threads.
+/// Entries are keyed by the artifact's own content hash (Metadata::hash).
+/// Objects are immutable once added -- they are handed out as
+/// `std::shared_ptr<T const>` -- which is what makes content-dedup and shared
+/// references safe. Every add records one holder; identical content collapses
+/// onto a single entry and just bumps the count; release drops a holder and
+/// removes the entry when the last one lets go. A handle obtained from get()
+/// keeps its artifact alive past that, so readers never dangle.
+///
+/// Thread-safe: the bindings drive it from multiple threads. Hashes are spread
+/// over SHARDS independently locked maps. Lookups -- get, contains, and add of
+/// content already present -- hold their shard's lock shared and run
+/// concurrently; only inserting or removing an entry holds it exclusively.
 template <class T>
 class Registry {
   public:
+    static constexpr size_t SHARDS = 16;
+
     /// Finalize @p artifact (stamping its hash), take ownership, and store it
     /// under that hash, recording one holder. Identical content returns the
     /// existing hash and bumps its count. Returns the hash. Throws
     /// InternalError if the artifact has no hash after finalize.
     std::string add(std::unique_ptr<T> artifact);
 
-    /// Read-only access to the entry at @p hash. Throws InternalError if @p
-    /// hash is absent. There is deliberately no mutable accessor.
-    T const & get(std::string const & hash) const;
+    /// Shared read-only handle on the entry at @p hash, valid for as long as
+    /// it is held. Throws InternalError if @p hash is absent. There is
+    /// deliberately no mutable accessor.
+    std::shared_ptr<T const> get(std::string const & hash) const;
 
-    /// Drop one holder of @p hash; frees the entry when the last holder lets
+    /// Drop one holder of @p hash; removes the entry when the last holder lets
     /// go. Releasing an unknown or already-freed hash is a no-op.
     void release(std::string const & hash);
 
@@ -38,11 +48,20 @@ class Registry {
 
   private:
     struct Entry {
-        std::unique_ptr<T> artifact;
-        int                holders = 0;
+        std::shared_ptr<T const> artifact;
+        std::atomic<int>         holders;  ///< Bumped under the shared lock.
+
+        Entry(std::shared_ptr<T const> artifact_, int const holders_) :
+          artifact(std::move(artifact_)), holders(holders_) {}
     };
-    std::map<std::string, Entry> entries_;  ///< hash -> owned artifact + holders
-    mutable std::mutex           mutex_;
+    struct Shard {
+        std::unordered_map<std::string, Entry> entries;  ///< hash -> artifact + holders
+        mutable std::shared_mutex              mutex;
+    };
+    std::array<Shard, SHARDS> shards_;
+
+    Shard & shard(std::string const & hash);
+    Shard const & shard(std::string const & hash) const;
 };
 
 }
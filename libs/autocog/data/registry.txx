@@ -2,53 +2,81 @@
 
 #include "autocog/utilities/exception.hxx"
 
+#include <functional>
+#include <mutex>
+
 namespace autocog::data {
 
+template <class T>
+typename Registry<T>::Shard & Registry<T>::shard(std::string const & hash) {
+  return shards_[std::hash<std::string>{}(hash) % SHARDS];
+}
+
+template <class T>
+typename Registry<T>::Shard const & Registry<T>::shard(std::string const & hash) const {
+  return shards_[std::hash<std::string>{}(hash) % SHARDS];
+}
+
 template <class T>
 std::string Registry<T>::add(std::unique_ptr<T> artifact) {
   // finalize() stamps the hash in construct mode, or re-verifies it in verify
   // mode (so adding an already-finalized artifact is safe and idempotent).
+  // Hashing is the expensive part and needs no lock.
   artifact->finalize();
   if (!artifact->metadata || artifact->metadata->hash.empty())
     throw autocog::utilities::InternalError(
       "autocog::data::Registry: artifact has no hash after finalize");
   std::string const id = artifact->metadata->hash;
 
-  std::lock_guard<std::mutex> lock(mutex_);
-  auto it = entries_.find(id);
-  if (it == entries_.end()) {
-    entries_.emplace(id, Entry{std::move(artifact), 1});
-  } else {
+  Shard & s = shard(id);
+  {
     // Identical content collapses onto the existing entry; the incoming
-    // duplicate is freed when `artifact` leaves scope.
-    ++it->second.holders;
+    // duplicate is freed when `artifact` leaves scope. Removal takes the lock
+    // exclusively, so the entry cannot go away while we count ourselves in.
+    std::shared_lock<std::shared_mutex> lock(s.mutex);
+    auto it = s.entries.find(id);
+    if (it != s.entries.end()) {
+      it->second.holders.fetch_add(1, std::memory_order_relaxed);
+      return id;
+    }
+  }
+  std::unique_lock<std::shared_mutex> lock(s.mutex);
+  auto it = s.entries.find(id);
+  if (it == s.entries.end()) {
+    s.entries.try_emplace(id, std::move(artifact), 1);
+  } else {
+    // Added by another thread between the two locks.
+    it->second.holders.fetch_add(1, std::memory_order_relaxed);
   }
   return id;
 }
 
 template <class T>
-T const & Registry<T>::get(std::string const & hash) const {
-  std::lock_guard<std::mutex> lock(mutex_);
-  auto it = entries_.find(hash);
-  if (it == entries_.end())
+std::shared_ptr<T const> Registry<T>::get(std::string const & hash) const {
+  Shard const & s = shard(hash);
+  std::shared_lock<std::shared_mutex> lock(s.mutex);
+  auto it = s.entries.find(hash);
+  if (it == s.entries.end())
     throw autocog::utilities::InternalError(
       "autocog::data::Registry: no artifact for hash " + hash);
-  return *it->second.artifact;
+  return it->second.artifact;
 }
 
 template <class T>
 void Registry<T>::release(std::string const & hash) {
-  std::lock_guard<std::mutex> lock(mutex_);
-  auto it = entries_.find(hash);
-  if (it == entries_.end()) return;  // unknown or already freed: no-op
-  if (--it->second.holders <= 0)
-    entries_.erase(it);
+  Shard & s = shard(hash);
+  std::unique_lock<std::shared_mutex> lock(s.mutex);
+  auto it = s.entries.find(hash);
+  if (it == s.entries.end()) return;  // unknown or already freed: no-op
+  if (it->second.holders.fetch_sub(1, std::memory_order_relaxed) <= 1)
+    s.entries.erase(it);  // outstanding get() handles keep the artifact alive
 }
 
 template <class T>
 bool Registry<T>::contains(std::string const & hash) const {
-  std::lock_guard<std::mutex> lock(mutex_);
-  return entries_.find(hash) != entries_.end();
+  Shard const & s = shard(hash);
+  std::shared_lock<std::shared_mutex> lock(s.mutex);
+  return s.entries.find(hash) != s.entries.end();
 }
 
 }
@@ -42,7 +42,7 @@ class SearchConfig : public Base<SearchConfig> {
     QueueSearch  queue;
 
   public:
-    std::string content_hash() const;
+    Digest content_hash(HashScheme const scheme) const;
 };
 
 }
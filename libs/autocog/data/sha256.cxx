@@ -0,0 +1,228 @@
+#include "autocog/data/sha256.hxx"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#  define AUTOCOG_SHA256_X86 1
+#  include <cpuid.h>
+#  include <immintrin.h>
+#else
+#  define AUTOCOG_SHA256_X86 0
+#endif
+
+#if defined(__aarch64__) && (defined(__ARM_FEATURE_SHA2) || defined(__ARM_FEATURE_CRYPTO))
+#  define AUTOCOG_SHA256_ARM 1
+#  include <arm_neon.h>
+#else
+#  define AUTOCOG_SHA256_ARM 0
+#endif
+
+namespace autocog::data {
+
+namespace {
+
+alignas(16) constexpr std::uint32_t K[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+constexpr std::uint32_t H0[8] = {
+  0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+inline std::uint32_t rotr(std::uint32_t const x, int const n) { return (x >> n) | (x << (32 - n)); }
+
+void compress_portable(std::uint32_t * state, std::uint8_t const * data, size_t n_blocks) {
+  for (; n_blocks > 0; --n_blocks, data += 64) {
+    std::uint32_t w[64];
+    for (int t = 0; t < 16; ++t)
+      w[t] = (std::uint32_t{data[4 * t]} << 24) | (std::uint32_t{data[4 * t + 1]} << 16)
+           | (std::uint32_t{data[4 * t + 2]} << 8) | std::uint32_t{data[4 * t + 3]};
+    for (int t = 16; t < 64; ++t) {
+      std::uint32_t const s0 = rotr(w[t - 15], 7) ^ rotr(w[t - 15], 18) ^ (w[t - 15] >> 3);
+      std::uint32_t const s1 = rotr(w[t - 2], 17) ^ rotr(w[t - 2], 19) ^ (w[t - 2] >> 10);
+      w[t] = w[t - 16] + s0 + w[t - 7] + s1;
+    }
+    std::uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    std::uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int t = 0; t < 64; ++t) {
+      std::uint32_t const t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + K[t] + w[t];
+      std::uint32_t const t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+      h = g; g = f; f = e; e = d + t1;
+      d = c; c = b; b = a; a = t1 + t2;
+    }
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+  }
+}
+
+#if AUTOCOG_SHA256_X86
+
+bool x86_has_sha() {
+  unsigned eax, ebx, ecx, edx;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return false;
+  bool const ssse3 = ecx & (1u << 9), sse41 = ecx & (1u << 19);
+  if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) return false;
+  return ssse3 && sse41 && (ebx & (1u << 29));
+}
+
+// SHA-NI keeps the state as ABEF/CDGH and does two rounds per instruction.
+__attribute__((target("sha,sse4.1")))
+void compress_x86(std::uint32_t * state, std::uint8_t const * data, size_t n_blocks) {
+  __m128i const bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+  __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<__m128i const *>(state)), 0xB1);  // CDAB
+  __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<__m128i const *>(state + 4)), 0x1B);  // EFGH
+  __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);  // ABEF
+  state1 = _mm_blend_epi16(state1, tmp, 0xF0);       // CDGH
+
+  for (; n_blocks > 0; --n_blocks, data += 64) {
+    __m128i const abef = state0, cdgh = state1;
+    __m128i msg[4];
+    for (int i = 0; i < 4; ++i)
+      msg[i] = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<__m128i const *>(data + 16 * i)), bswap);
+#pragma GCC unroll 16
+    for (int q = 0; q < 16; ++q) {
+      __m128i & m = msg[q % 4];
+      if (q >= 4) {  // W[4q..4q+3] from the four previous quads
+        __m128i const w7 = _mm_alignr_epi8(msg[(q + 3) % 4], msg[(q + 2) % 4], 4);
+        m = _mm_sha256msg2_epu32(_mm_add_epi32(_mm_sha256msg1_epu32(m, msg[(q + 1) % 4]), w7), msg[(q + 3) % 4]);
+      }
+      __m128i wk = _mm_add_epi32(m, _mm_load_si128(reinterpret_cast<__m128i const *>(K + 4 * q)));
+      state1 = _mm_sha256rnds2_epu32(state1, state0, wk);
+      wk = _mm_shuffle_epi32(wk, 0x0E);
+      state0 = _mm_sha256rnds2_epu32(state0, state1, wk);
+    }
+    state0 = _mm_add_epi32(state0, abef);
+    state1 = _mm_add_epi32(state1, cdgh);
+  }
+
+  tmp = _mm_shuffle_epi32(state0, 0x1B);       // FEBA
+  state1 = _mm_shuffle_epi32(state1, 0xB1);    // DCHG
+  state0 = _mm_blend_epi16(tmp, state1, 0xF0); // DCBA
+  state1 = _mm_alignr_epi8(state1, tmp, 8);    // HGFE
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(state), state0);
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(state + 4), state1);
+}
+
+#endif
+
+#if AUTOCOG_SHA256_ARM
+
+// Four rounds per vsha256hq/vsha256h2q pair; the state stays ABCD/EFGH.
+void compress_arm(std::uint32_t * state, std::uint8_t const * data, size_t n_blocks) {
+  uint32x4_t state0 = vld1q_u32(state), state1 = vld1q_u32(state + 4);
+  for (; n_blocks > 0; --n_blocks, data += 64) {
+    uint32x4_t const abcd = state0, efgh = state1;
+    uint32x4_t msg[4];
+    for (int i = 0; i < 4; ++i)
+      msg[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 16 * i)));
+    for (int q = 0; q < 16; ++q) {
+      uint32x4_t & m = msg[q % 4];
+      uint32x4_t const wk = vaddq_u32(m, vld1q_u32(K + 4 * q));
+      if (q < 12)  // W[4q+16..4q+19], replacing this quad once used
+        m = vsha256su1q_u32(vsha256su0q_u32(m, msg[(q + 1) % 4]), msg[(q + 2) % 4], msg[(q + 3) % 4]);
+      uint32x4_t const prev = state0;
+      state0 = vsha256hq_u32(state0, state1, wk);
+      state1 = vsha256h2q_u32(state1, prev, wk);
+    }
+    state0 = vaddq_u32(state0, abcd);
+    state1 = vaddq_u32(state1, efgh);
+  }
+  vst1q_u32(state, state0);
+  vst1q_u32(state + 4, state1);
+}
+
+#endif
+
+}
+
+Sha256::Impl Sha256::best() {
+  static Impl const impl = [] {
+#if AUTOCOG_SHA256_X86
+    if (x86_has_sha()) return Impl::X86;
+#endif
+#if AUTOCOG_SHA256_ARM
+    return Impl::Arm;
+#endif
+    return Impl::Portable;
+  }();
+  return impl;
+}
+
+char const * Sha256::impl_name(Impl const impl) {
+  switch (impl) {
+    case Impl::X86:      return "sha-ni";
+    case Impl::Arm:      return "armv8-sha2";
+    case Impl::Portable: return "portable";
+  }
+  return "portable";
+}
+
+Sha256::Sha256(Impl const impl) : impl_(impl) {
+  reset();
+}
+
+void Sha256::reset() {
+  std::memcpy(state_.data(), H0, sizeof H0);
+  buffered_ = 0;
+  length_ = 0;
+}
+
+void Sha256::compress(std::uint8_t const * blocks, size_t const n_blocks) {
+  switch (impl_) {
+#if AUTOCOG_SHA256_X86
+    case Impl::X86: compress_x86(state_.data(), blocks, n_blocks); return;
+#endif
+#if AUTOCOG_SHA256_ARM
+    case Impl::Arm: compress_arm(state_.data(), blocks, n_blocks); return;
+#endif
+    default: compress_portable(state_.data(), blocks, n_blocks); return;
+  }
+}
+
+Sha256 & Sha256::update(void const * data, size_t size) {
+  if (size == 0) return *this;
+  auto const * bytes = static_cast<std::uint8_t const *>(data);
+  length_ += size;
+  if (buffered_ > 0) {
+    size_t const n = std::min(size, block_.size() - buffered_);
+    std::memcpy(block_.data() + buffered_, bytes, n);
+    buffered_ += n; bytes += n; size -= n;
+    if (buffered_ < block_.size()) return *this;
+    compress(block_.data(), 1);
+    buffered_ = 0;
+  }
+  // Whole blocks straight from the input, the tail into the buffer.
+  if (size >= block_.size()) {
+    compress(bytes, size / block_.size());
+    bytes += size - size % block_.size();
+    size %= block_.size();
+  }
+  std::memcpy(block_.data(), bytes, size);
+  buffered_ = size;
+  return *this;
+}
+
+Digest Sha256::finish() {
+  std::uint64_t const bits = length_ * 8;
+  std::uint8_t pad[72] = {0x80};
+  size_t const n_pad = (buffered_ < 56 ? 56 : 120) - buffered_;
+  for (int i = 0; i < 8; ++i) pad[n_pad + i] = static_cast<std::uint8_t>(bits >> (56 - 8 * i));
+  update(pad, n_pad + 8);
+
+  Digest d;
+  for (size_t i = 0; i < 8; ++i)
+    for (size_t j = 0; j < 4; ++j) d[4 * i + j] = static_cast<std::uint8_t>(state_[i] >> (24 - 8 * j));
+  reset();
+  return d;
+}
+
+}
@@ -0,0 +1,54 @@
+#ifndef AUTOCOG_DATA_SHA256_HXX
+#define AUTOCOG_DATA_SHA256_HXX
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+namespace autocog::data {
+
+/// A raw (binary) SHA-256 digest.
+using Digest = std::array<std::uint8_t, 32>;
+
+/// Incremental SHA-256 (FIPS 180-4): feed the message in any number of
+/// update() calls, then finish().
+///
+/// Blocks are compressed with the CPU's SHA extensions when both the build and
+/// the running CPU have them -- SHA-NI on x86-64 (detected at runtime), the
+/// ARMv8 SHA2 instructions on AArch64 (when the build targets them, e.g.
+/// `-march=armv8-a+crypto`, the default on Apple silicon) -- and in portable
+/// C++ otherwise. All implementations produce the same digests.
+class Sha256 {
+  public:
+    enum class Impl { Portable, X86, Arm };
+
+    /// The fastest implementation available to this process.
+    static Impl best();
+    static char const * impl_name(Impl const impl);
+
+    /// @p impl must be available: best() or Portable.
+    explicit Sha256(Impl const impl = best());
+
+    Sha256 & update(void const * data, size_t const size);
+    Sha256 & update(std::string_view const s) { return update(s.data(), s.size()); }
+
+    /// Digest of everything fed so far. Resets the hasher for a new message.
+    Digest finish();
+
+    Impl impl() const { return impl_; }
+
+  private:
+    Impl impl_;
+    std::array<std::uint32_t, 8> state_;
+    std::array<std::uint8_t, 64> block_;
+    size_t buffered_{0};       ///< Bytes in block_.
+    std::uint64_t length_{0};  ///< Message length so far, in bytes.
+
+    void reset();
+    void compress(std::uint8_t const * blocks, size_t const n_blocks);
+};
+
+}
+
+#endif // AUTOCOG_DATA_SHA256_HXX
@@ -13,7 +13,7 @@ template <class... Ts> overloaded(Ts...) -> overloaded<Ts...>;
 
 void put_paths(ContentHasher & h, std::vector<PathStep> const & v) {
   h.put(static_cast<unsigned>(v.size()));
-  for (auto const & p : v) h.put(p.hash());
+  for (auto const & p : v) h.put(p.digest(h.scheme()));
 }
 
 void put_sv(ContentHasher & h, autocog::types::Value const & v) {
@@ -29,19 +29,19 @@ void put_sv(ContentHasher & h, autocog::types::Value const & v) {
 
 }  // namespace
 
-std::string SearchParams::hash() const {
-  ContentHasher h;
+Digest SearchParams::digest(HashScheme const scheme) const {
+  ContentHasher h(scheme);
   h.put(static_cast<unsigned>(categories.size()));
   for (auto const & [cat, params] : categories) {
     h.put(cat);
     h.put(static_cast<unsigned>(params.size()));
     for (auto const & [key, val] : params) { h.put(key); put_sv(h, val); }
   }
-  return h.hash();
+  return h.digest();
 }
 
-std::string FieldFormat::hash() const {
-  ContentHasher h;
+Digest FieldFormat::digest(HashScheme const scheme) const {
+  ContentHasher h(scheme);
   h.put(static_cast<unsigned>(value.index()));
   std::visit(overloaded{
     [&](std::monostate){ },
@@ -49,11 +49,11 @@ std::string FieldFormat::hash() const {
     [&](EnumFormat const & f){ h.put(f.values); },
     [&](ChoiceFormat const & f){ h.put(f.mode); put_paths(h, f.path); },
   }, value);
-  return h.hash();
+  return h.digest();
 }
 
-std::string Flow::hash() const {
-  ContentHasher h;
+Digest Flow::digest(HashScheme const scheme) const {
+  ContentHasher h(scheme);
   h.put(static_cast<unsigned>(value.index()));
   std::visit(overloaded{
     [&](FlowControl const & f){ h.put(f.prompt); h.put(f.limit); },
@@ -62,30 +62,30 @@ std::string Flow::hash() const {
       for (auto const & rf : f.fields) { h.put(rf.alias); put_paths(h, rf.path); }
     },
   }, value);
-  return h.hash();
+  return h.digest();
 }
 
-std::string Field::hash() const {
-  ContentHasher h;
+Digest Field::digest(HashScheme const scheme) const {
+  ContentHasher h(scheme);
   h.put(name).put(static_cast<std::int32_t>(depth)).put(static_cast<std::int32_t>(index))
    .put(static_cast<std::int32_t>(flat_index)).put(desc);
   h.put(range.has_value());
   if (range) { h.put(static_cast<std::int32_t>(range->first)).put(static_cast<std::int32_t>(range->second)); }
-  h.put(format.hash());
+  h.put(format.digest(scheme));
   h.put(format_ref);
   h.put(format_desc);
-  h.put(search.hash());
-  return h.hash();
+  h.put(search.digest(scheme));
+  return h.digest();
 }
 
-std::string SchemaField::hash() const {
+Digest SchemaField::digest(HashScheme const scheme) const {
   // Hash exactly the fields the codec serializes for this type. SchemaField is
   // a flat struct shared across types, so a member relevant to one type (e.g. a
   // text field's max_length/enum_values) may be left set when the field is an
   // array. The codec only serializes the type-relevant members, so the hash
   // must too -- otherwise two fields with identical serialized form would hash
   // differently and the artifact would not round-trip through finalize.
-  ContentHasher h;
+  ContentHasher h(scheme);
   h.put(type).put(required);
   if (type == "array") {
     h.put(items_type.empty() ? std::string("text") : items_type)
@@ -93,48 +93,48 @@ std::string SchemaField::hash() const {
   } else {
     h.put(max_length).put(enum_values);
   }
-  return h.hash();
+  return h.digest();
 }
 
-std::string EntryPoint::hash() const {
-  ContentHasher h;
+Digest EntryPoint::digest(HashScheme const scheme) const {
+  ContentHasher h(scheme);
   h.put(prompt);
   h.put(static_cast<unsigned>(inputs.size()));
-  for (auto const & [k, sf] : inputs)  h.put(k).put(sf.hash());
+  for (auto const & [k, sf] : inputs)  h.put(k).put(sf.digest(scheme));
   h.put(static_cast<unsigned>(outputs.size()));
-  for (auto const & [k, sf] : outputs) h.put(k).put(sf.hash());
-  return h.hash();
+  for (auto const & [k, sf] : outputs) h.put(k).put(sf.digest(scheme));
+  return h.digest();
 }
 
-std::string PythonImport::hash() const { ContentHasher h; h.put(file).put(target); return h.hash(); }
+Digest PythonImport::digest(HashScheme const scheme) const { ContentHasher h(scheme); h.put(file).put(target); return h.digest(); }
 
-std::string Prompt::hash() const {
-  ContentHasher h;
+Digest Prompt::digest(HashScheme const scheme) const {
+  ContentHasher h(scheme);
   h.put(name).put(desc);
   h.put(static_cast<unsigned>(fields.size()));
-  for (auto const & f : fields) h.put(f.hash());
+  for (auto const & f : fields) h.put(f.digest(scheme));
   h.put(static_cast<unsigned>(abstracts.size()));
   for (auto const & a : abstracts)
     h.put(static_cast<std::int32_t>(a.field)).put(static_cast<std::int32_t>(a.flow)).put(static_cast<std::int32_t>(a.exit_));
   h.put(static_cast<unsigned>(flows.size()));
-  for (auto const & [k, flow] : flows) h.put(k).put(flow.hash());
+  for (auto const & [k, flow] : flows) h.put(k).put(flow.digest(scheme));
   h.put(static_cast<unsigned>(channels.size()));
-  for (auto const & c : channels) h.put(c.hash());
-  h.put(search.hash());
+  for (auto const & c : channels) h.put(c.digest(scheme));
+  h.put(search.digest(scheme));
   h.put(static_cast<unsigned>(vocabs.size()));
-  for (auto const & [k, ve] : vocabs) h.put(k).put(ve.hash());
-  return h.hash();
+  for (auto const & [k, ve] : vocabs) h.put(k).put(ve.digest(scheme));
+  return h.digest();
 }
 
-std::string STA::content_hash() const {
-  ContentHasher h;
+Digest STA::content_hash(HashScheme const scheme) const {
+  ContentHasher h(scheme);
   h.put(static_cast<unsigned>(entry_points.size()));
-  for (auto const & [k, e] : entry_points) h.put(k).put(e.hash());
+  for (auto const & [k, e] : entry_points) h.put(k).put(e.digest(scheme));
   h.put(static_cast<unsigned>(python_imports.size()));
-  for (auto const & [k, imp] : python_imports) h.put(k).put(imp.hash());
+  for (auto const & [k, imp] : python_imports) h.put(k).put(imp.digest(scheme));
   h.put(static_cast<unsigned>(prompts.size()));
-  for (auto const & [k, p] : prompts) h.put(k).put(p.hash());
-  return h.hash();
+  for (auto const & [k, p] : prompts) h.put(k).put(p.digest(scheme));
+  return h.digest();
 }
 
 }
@@ -27,7 +27,7 @@ struct SearchParams {
 
   bool empty() const { return categories.empty(); }
 
-  std::string hash() const;
+  Digest digest(HashScheme const scheme = hash_scheme) const;
 };
 
 // --- Field format ------------------------------------------------------------
@@ -39,7 +39,7 @@ struct ChoiceFormat     { std::string mode; std::vector<PathStep> path; };
 struct FieldFormat {
   std::variant<std::monostate, CompletionFormat, EnumFormat, ChoiceFormat> value;  // monostate = record
 
-  std::string hash() const;
+  Digest digest(HashScheme const scheme = hash_scheme) const;
 };
 
 // --- Flow --------------------------------------------------------------------
@@ -51,7 +51,7 @@ struct FlowReturn  { std::vector<ReturnField> fields; };
 struct Flow {
   std::variant<FlowControl, FlowReturn> value;
 
-  std::string hash() const;
+  Digest digest(HashScheme const scheme = hash_scheme) const;
 };
 
 // --- Abstract state ----------------------------------------------------------
@@ -73,7 +73,7 @@ struct Field {
   std::vector<std::string> format_desc;
   SearchParams search;
 
-  std::string hash() const;
+  Digest digest(HashScheme const scheme = hash_scheme) const;
 
   // Structural queries used by the runtime (pure functions of the members).
   bool is_list() const { return range.has_value(); }
@@ -95,7 +95,7 @@ struct Prompt {
   SearchParams search;
   std::map<std::string, VocabExpr> vocabs;
 
-  std::string hash() const;
+  Digest digest(HashScheme const scheme = hash_scheme) const;
 };
 
 // --- Schema & program wrapper ------------------------------------------------
@@ -111,7 +111,7 @@ struct SchemaField {
   std::optional<int> min_items;
   std::optional<int> max_items;
 
-  std::string hash() const;
+  Digest digest(HashScheme const scheme = hash_scheme) const;
 };
 
 struct EntryPoint {
@@ -119,14 +119,14 @@ struct EntryPoint {
   std::map<std::string, SchemaField> inputs;
   std::map<std::string, SchemaField> outputs;
 
-  std::string hash() const;
+  Digest digest(HashScheme const scheme = hash_scheme) const;
 };
 
 struct PythonImport {
   std::string file;
   std::string target;
 
-  std::string hash() const;
+  Digest digest(HashScheme const scheme = hash_scheme) const;
 };
 
 /// A full compiled program: entry points, python imports, and prompts. STA is
@@ -140,7 +140,7 @@ class STA : public Base<STA> {
     std::map<std::string, Prompt> prompts;
 
   public:
-    std::string content_hash() const;
+    Digest content_hash(HashScheme const scheme) const;
 };
 
 }
@@ -4,8 +4,8 @@
 
 namespace autocog::data {
 
-std::string Syntax::content_hash() const {
-  return ContentHasher{}
+Digest Syntax::content_hash(HashScheme const scheme) const {
+  return ContentHasher{scheme}
     .put(system_msg)
     .put(header_pre)
     .put(header_mid)
@@ -24,7 +24,7 @@ std::string Syntax::content_hash() const {
     .put(prompt_zero_index)
     .put(detailed_formats)
     .put(completion_stop)
-    .hash();
+    .digest();
 }
 
 }
@@ -40,7 +40,7 @@ class Syntax : public Base<Syntax> {
     std::string completion_stop;
 
   public:
-    std::string content_hash() const;
+    Digest content_hash(HashScheme const scheme) const;
 };
 
 }
@@ -2,8 +2,6 @@
 
 #include <ctime>
 
-#include "picosha2.h"
-
 namespace autocog::data {
 
 std::string utc_timestamp() {
@@ -16,8 +14,16 @@ std::string utc_timestamp() {
 }
 
 std::string digest(std::string const & input) {
-  std::string hex;
-  picosha2::hash256_hex_string(input, hex);
+  return to_hex(Sha256().update(input).finish());
+}
+
+std::string to_hex(Digest const & d) {
+  static char const hexd[] = "0123456789abcdef";
+  std::string hex(2 * d.size(), '0');
+  for (size_t i = 0; i < d.size(); ++i) {
+    hex[2 * i]     = hexd[d[i] >> 4];
+    hex[2 * i + 1] = hexd[d[i] & 0xfu];
+  }
   return hex;
 }
 
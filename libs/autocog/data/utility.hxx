@@ -1,6 +1,9 @@
 #ifndef AUTOCOG_DATA_UTILITY_HXX
 #define AUTOCOG_DATA_UTILITY_HXX
 
+#include "autocog/data/sha256.hxx"
+
+#include <charconv>
 #include <cstdint>
 #include <cstring>
 #include <optional>
@@ -15,28 +18,69 @@ std::string utc_timestamp();
 /// SHA-256 of @p input as a 64-character lowercase hex string.
 std::string digest(std::string const & input);
 
-/// Accumulates field values into a canonical buffer for content hashing.
+/// @p d as a 64-character lowercase hex string (what digest() returns).
+std::string to_hex(Digest const & d);
+
+/// Version of the content-hash encoding. An artifact's identity depends on
+/// it, so finalize() records it in the metadata and verification recomputes
+/// the hash with the recorded scheme: identities never change under stored
+/// artifacts.
+enum class HashScheme : unsigned {
+  /// Values as decimal/hex text, each followed by a '\0' separator; nested
+  /// digests as hex strings. Artifacts stored without a scheme use it.
+  Text = 1,
+  /// Fixed-width little-endian values, length-prefixed strings, raw nested
+  /// digests.
+  Binary = 2,
+};
+
+/// The scheme new artifacts are hashed with.
+inline constexpr HashScheme hash_scheme = HashScheme::Binary;
+
+/// Streams field values, in a canonical encoding, into a SHA-256 context.
 ///
-/// Fields are appended in declaration order, each followed by a '\0'
-/// separator; field *names* are intentionally excluded to minimize the hashed
-/// data. Values are assumed not to contain '\0' (to be enforced by input
-/// validation); embedded nulls would reintroduce ambiguity between adjacent
-/// fields.
+/// Fields are fed in declaration order; field *names* are intentionally
+/// excluded to minimize the hashed data. Under HashScheme::Text, values are
+/// assumed not to contain '\0' (to be enforced by input validation): embedded
+/// nulls would reintroduce ambiguity between adjacent fields. The Binary
+/// encoding is unambiguous (every variable-length value is length-prefixed).
 class ContentHasher {
   public:
-    ContentHasher & put(std::string const & s) { buf_ += s; buf_ += '\0'; return *this; }
-    ContentHasher & put(bool b)                { buf_ += (b ? '1' : '0'); buf_ += '\0'; return *this; }
-    ContentHasher & put(unsigned u)            { buf_ += std::to_string(u); buf_ += '\0'; return *this; }
-    ContentHasher & put(std::int32_t i)        { buf_ += std::to_string(i); buf_ += '\0'; return *this; }
+    explicit ContentHasher(HashScheme const scheme = hash_scheme) : scheme_(scheme) {}
+
+    HashScheme scheme() const { return scheme_; }
+
+    ContentHasher & put(std::string const & s) {
+      if (scheme_ == HashScheme::Text) { sha_.update(s); return separator(); }
+      put_le(static_cast<std::uint64_t>(s.size()));
+      sha_.update(s);
+      return *this;
+    }
+    ContentHasher & put(bool b) {
+      if (scheme_ == HashScheme::Text) { sha_.update(b ? "1" : "0"); return separator(); }
+      return put_le(static_cast<std::uint8_t>(b));
+    }
+    ContentHasher & put(unsigned u)     { return scheme_ == HashScheme::Text ? put_decimal(u) : put_le(static_cast<std::uint32_t>(u)); }
+    ContentHasher & put(std::int32_t i) { return scheme_ == HashScheme::Text ? put_decimal(i) : put_le(static_cast<std::uint32_t>(i)); }
 
-    /// Floats are hashed by their exact IEEE-754 bit pattern (8 hex chars):
-    /// equality is bit-exact, with no rounding or precision normalization.
+    /// Floats are hashed by their exact IEEE-754 bit pattern (8 hex chars under
+    /// Text): equality is bit-exact, with no rounding or precision
+    /// normalization.
     ContentHasher & put(float f) {
       std::uint32_t bits = 0;
       std::memcpy(&bits, &f, sizeof bits);
+      if (scheme_ == HashScheme::Binary) return put_le(bits);
       static char const hexd[] = "0123456789abcdef";
-      for (int i = 7; i >= 0; --i) buf_ += hexd[(bits >> (i * 4)) & 0xfu];
-      buf_ += '\0';
+      char hex[8];
+      for (int i = 0; i < 8; ++i) hex[i] = hexd[(bits >> ((7 - i) * 4)) & 0xfu];
+      sha_.update(hex, sizeof hex);
+      return separator();
+    }
+
+    /// Nested digest: raw under Binary, as its hex string under Text.
+    ContentHasher & put(Digest const & d) {
+      if (scheme_ == HashScheme::Text) return put(to_hex(d));
+      sha_.update(d.data(), d.size());
       return *this;
     }
 
@@ -56,10 +100,31 @@ class ContentHasher {
       return *this;
     }
 
-    std::string hash() const { return digest(buf_); }
+    /// The digest of everything put so far; the hasher starts over afterwards.
+    Digest digest() { return sha_.finish(); }
+    std::string hash() { return to_hex(sha_.finish()); }
 
   private:
-    std::string buf_;
+    HashScheme scheme_;
+    Sha256 sha_;
+
+    ContentHasher & separator() { sha_.update("", 1); return *this; }
+
+    template <class U>
+    ContentHasher & put_le(U const v) {
+      std::uint8_t bytes[sizeof(U)];
+      for (size_t i = 0; i < sizeof(U); ++i) bytes[i] = static_cast<std::uint8_t>(v >> (8 * i));
+      sha_.update(bytes, sizeof bytes);
+      return *this;
+    }
+
+    template <class I>
+    ContentHasher & put_decimal(I const v) {
+      char text[16];
+      auto const end = std::to_chars(text, text + sizeof text, v).ptr;
+      sha_.update(text, static_cast<size_t>(end - text));
+      return separator();
+    }
 };
 
 }
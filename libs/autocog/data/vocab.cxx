@@ -4,13 +4,13 @@
 
 namespace autocog::data {
 
-std::string VocabExpr::hash() const {
-  ContentHasher h;
+Digest VocabExpr::digest(HashScheme const scheme) const {
+  ContentHasher h(scheme);
   h.put(static_cast<unsigned>(kind));
   h.put(strings);
   h.put(static_cast<unsigned>(operands.size()));
-  for (auto const & op : operands) h.put(op.hash());
-  return h.hash();
+  for (auto const & op : operands) h.put(op.digest(scheme));
+  return h.digest();
 }
 
 }
@@ -1,6 +1,8 @@
 #ifndef AUTOCOG_DATA_VOCAB_HXX
 #define AUTOCOG_DATA_VOCAB_HXX
 
+#include "autocog/data/utility.hxx"
+
 #include <string>
 #include <vector>
 
@@ -18,8 +20,8 @@ struct VocabExpr {
   std::vector<std::string> strings;   ///< Tokenize: the strings; Regex: [pattern].
   std::vector<VocabExpr> operands;    ///< Union/Intersect/Diff: 2; Complement: 1.
 
-  /// Recursive content hash: digest(kind + strings + each operand's hash).
-  std::string hash() const;
+  /// Recursive content digest: digest(kind + strings + each operand's digest).
+  Digest digest(HashScheme const scheme = hash_scheme) const;
 };
 
 }
@@ -993,9 +993,8 @@ autocog::data::FTA instantiate(autocog::data::Prompt const & prompt, Doc const &
         b.connect(header_id, first_branch);
     }
 
-    // Queue params (prompt-scope): carried into the FTA even though the current
-    // xfta queue does not consume them yet. Policy (prompt.search["queue"]) wins
-    // over the config default. TODO(xfta-queue).
+    // Queue params (prompt-scope): the metric orders the backend's evaluation
+    // frontier. Policy (prompt.search["queue"]) wins over the config default.
     std::string metric = search.queue.metric;
     auto qit = prompt.search.categories.find("queue");
     if (qit != prompt.search.categories.end()) {
@@ -253,17 +253,20 @@ def _cmd_run_inner(args, prog, include_paths):
         if not os.path.isfile(args.syntax):
             raise FileError(f"Syntax file not found: {args.syntax}")
         engine = autocog.Engine(model=args.model, syntax=args.syntax,
-                                search=args.search, n_ctx=args.ctx)
+                                search=args.search, n_ctx=args.ctx,
+                                mask_cache=args.mask_cache)
     elif args.rng:
         if not os.path.isfile(args.syntax):
             raise FileError(f"Syntax file not found: {args.syntax}")
         engine = autocog.Engine(syntax=args.syntax,
-                                search=args.search)
+                                search=args.search,
+                                mask_cache=args.mask_cache)
     else:
         print("Error: --model or --rng required", file=sys.stderr)
         sys.exit(1)
 
     engine.set_seed(args.seed)
+    engine.prewarm(prog)
 
     # Auto-load Python externals
     externals = load_externals(prog, include_paths)
@@ -377,6 +380,10 @@ def main():
     p_run.add_argument("--entry", default="main", help="Entry point (default: main)")
     p_run.add_argument("--ctx", type=int, default=4096, help="Model context size")
     p_run.add_argument("--seed", type=int, default=42, help="RNG seed (default: 42)")
+    p_run.add_argument(
+        "--mask-cache", default=None,
+        help="Directory persisting vocab masks across runs (keyed by model hash)",
+    )
     p_run.add_argument("-o", "--output", help="Output file (default: stdout)")
     p_run.add_argument("-v", "--verbose", action="store_true", help="Show step progress")
     p_run.add_argument("--max-steps", type=int, default=100, help="Max prompt steps")
@@ -0,0 +1,76 @@
+"""
+asyncio bridge for the backend's asynchronous evaluations.
+
+backend_llama_cxx.evaluate_async queues an evaluation on its model's native
+worker thread, which batches it with the model's other in-flight evaluations.
+Completions are signalled on a pipe (async_fd): every event loop awaiting an
+evaluation watches it, drains async_results, and settles the matching futures
+on their own loops.
+"""
+
+import asyncio
+import threading
+import weakref
+
+from autocog.runtime.sta import runtime_sta_cxx
+from autocog.backend.llama import backend_llama_cxx
+
+from ...errors import ModelError
+
+_lock = threading.Lock()
+_futures = {}                  # handle → (future, model_id)
+_loops = weakref.WeakSet()     # loops with a reader on async_fd
+
+
+def _release(result):
+    """Drop the FTT of a result nobody awaits anymore."""
+    if result["status"] == "done":
+        runtime_sta_cxx.release_ftt(result["ftt"])
+
+
+def _settle(future, model_id, result):
+    if future.done():  # cancelled after the result was drained
+        _release(result)
+    elif result["status"] == "done":
+        future.set_result(result["ftt"])
+    elif result["status"] == "cancelled":
+        future.cancel()
+    else:
+        future.set_exception(ModelError(result["error"], model_id=model_id, op="evaluate"))
+
+
+def _drain():
+    for result in backend_llama_cxx.async_results():
+        with _lock:
+            future, model_id = _futures.pop(result["handle"], (None, None))
+        if future is None or future.get_loop().is_closed():
+            _release(result)
+        else:
+            future.get_loop().call_soon_threadsafe(_settle, future, model_id, result)
+
+
+def _watch(loop):
+    if loop not in _loops:
+        loop.add_reader(backend_llama_cxx.async_fd(), _drain)
+        _loops.add(loop)
+
+
+async def evaluate(model_id, fta_id, max_token_eval=None):
+    """
+    Evaluate a stored FTA without blocking the event loop.
+
+    Returns the handle of the stored FTT, like backend_llama_cxx.evaluate.
+    Cancelling the awaiting task cancels the evaluation.
+    """
+    loop = asyncio.get_running_loop()
+    _watch(loop)
+    future = loop.create_future()
+    # Registered under the lock: a result drained meanwhile waits for it.
+    with _lock:
+        handle = backend_llama_cxx.evaluate_async(model_id, fta_id, max_token_eval)
+        _futures[handle] = (future, model_id)
+    try:
+        return await future
+    except asyncio.CancelledError:
+        backend_llama_cxx.evaluate_cancel(handle)
+        raise
@@ -42,36 +42,68 @@ class Context:
         """Execute one prompt iteration."""
         if self.done:
             return
+        content = self._begin_step()
 
+        # 2. Evaluate prompt → frame
+        if self.recorder:
+            frame, artifacts = self.engine.evaluate_prompt(
+                self.program, self.prompt, content,
+                record_kinds=self.recorder.kinds
+            )
+            self._record_step(content, artifacts)
+        else:
+            frame = self.engine.evaluate_prompt(
+                self.program, self.prompt, content
+            )
+        self._end_step(frame)
+
+    async def step_async(self):
+        """Async version — evaluates the prompt without blocking the event loop
+        (when the engine supports it; otherwise as step does)."""
+        evaluate = getattr(self.engine, "evaluate_prompt_async", None)
+        if evaluate is None:
+            self.step()
+            return
+        if self.done:
+            return
+        content = self._begin_step()
+
+        # 2. Evaluate prompt → frame
+        if self.recorder:
+            frame, artifacts = await evaluate(
+                self.program, self.prompt, content,
+                record_kinds=self.recorder.kinds
+            )
+            self._record_step(content, artifacts)
+        else:
+            frame = await evaluate(self.program, self.prompt, content)
+        self._end_step(frame)
+
+    def _begin_step(self):
+        """Record the prompt's start and resolve its channels → content dict."""
         # Record prompt begin
         if self.recorder:
             self.recorder.begin_prompt(self.ctx_id, self.prompt, self._step_count)
 
         # 1. Resolve channels → content dict
-        content = resolve_channels(
+        return resolve_channels(
             self.program, self.prompt,
             self.inputs, self.frames,
             self.engine, self.externals,
             recorder=self.recorder, ctx_id=self.ctx_id
         )
 
-        # 2. Evaluate prompt → frame
-        if self.recorder:
-            frame, artifacts = self.engine.evaluate_prompt(
-                self.program, self.prompt, content,
-                record_kinds=self.recorder.kinds
-            )
-            self.recorder.record_step(
-                self.ctx_id, self.prompt, self._step_count,
-                input=content if "input" in self.recorder.kinds else None,
-                frame=artifacts.get("frame"),
-                fta=artifacts.get("fta"),
-                ftt=artifacts.get("ftt"),
-            )
-        else:
-            frame = self.engine.evaluate_prompt(
-                self.program, self.prompt, content
-            )
+    def _record_step(self, content, artifacts):
+        self.recorder.record_step(
+            self.ctx_id, self.prompt, self._step_count,
+            input=content if "input" in self.recorder.kinds else None,
+            frame=artifacts.get("frame"),
+            fta=artifacts.get("fta"),
+            ftt=artifacts.get("ftt"),
+        )
+
+    def _end_step(self, frame):
+        """Store the prompt's frame and follow its flow."""
         self._step_count += 1
 
         # 3. Store frame
@@ -119,10 +151,6 @@ class Context:
                 self.recorder.record_flow(self.ctx_id, flow_def["prompt"])
             self.prompt = flow_def["prompt"]
 
-    async def step_async(self):
-        """Async version — supports async external callables."""
-        self.step()
-
     def _extract_return(self, frame, flow_def):
         """Extract return fields from a frame according to the return definition."""
         fields = flow_def.get("fields", [])
@@ -4,6 +4,7 @@ Engine — holds a model and syntax, drives program execution.
 
 from autocog.runtime.sta import runtime_sta_cxx
 from autocog.backend.llama import backend_llama_cxx
+from autocog.backend.llama import aio
 
 from .errors import ConfigError, OrchestrationError
 from .context import Context
@@ -12,7 +13,8 @@ from .context import Context
 class Engine:
     """Execution engine: model + syntax."""
 
-    def __init__(self, model=None, syntax=None, search=None, n_ctx=4096):
+    def __init__(self, model=None, syntax=None, search=None, n_ctx=4096,
+                 mask_cache=None):
         """
         Create an engine.
 
@@ -21,11 +23,15 @@ class Engine:
             syntax: path to syntax JSON file (required)
             search: path to search config JSON file (required)
             n_ctx: context size for the model
+            mask_cache: directory persisting the model's vocab masks across
+                runs (keyed by the model's SHA-256), or None
         """
         if model is not None:
             self.model_id = backend_llama_cxx.create(model, n_ctx)
         else:
             self.model_id = 0  # RNG model
+        if mask_cache is not None:
+            backend_llama_cxx.set_mask_cache(self.model_id, str(mask_cache))
 
         if syntax is None:
             raise ConfigError("syntax is required — pass a path to a syntax JSON file")
@@ -39,6 +45,11 @@ class Engine:
         """Set the RNG seed for the underlying model."""
         backend_llama_cxx.set_seed(self.model_id, seed)
 
+    def prewarm(self, program):
+        """Start building (or loading) the vocab masks of every prompt of a
+        program in the background, so its first evaluations find them ready."""
+        backend_llama_cxx.prewarm(self.model_id, program.id)
+
     def evaluate_prompt(self, program, prompt_name, content, record_kinds=None):
         """
         Evaluate a single prompt: instantiate → evaluate → walk FTT.
@@ -61,25 +72,100 @@ class Engine:
                 artifacts["fta"] = runtime_sta_cxx.get_fta(fta_id)
 
             ftt_id = backend_llama_cxx.evaluate(self.model_id, fta_id)
+            frame = self._walk(program, prompt_name, content, ftt_id,
+                               record_kinds, artifacts)
+        finally:
+            runtime_sta_cxx.release_fta(fta_id)
+
+        if record_kinds is not None:
+            return frame, artifacts
+        return frame
+
+    async def evaluate_prompt_async(self, program, prompt_name, content,
+                                    record_kinds=None):
+        """
+        Async version of evaluate_prompt: the evaluation runs on the model's
+        native worker thread, batched with the other evaluations in flight on
+        the model, while the event loop keeps running. Cancelling the awaiting
+        task cancels the evaluation.
+        """
+        fta_id = runtime_sta_cxx.instantiate(
+            program.id, prompt_name, content, self.syntax_id, self.search_id
+        )
+        artifacts = {}
+        try:
+            if record_kinds and "fta" in record_kinds:
+                artifacts["fta"] = runtime_sta_cxx.get_fta(fta_id)
+
+            ftt_id = await aio.evaluate(self.model_id, fta_id)
+            frame = self._walk(program, prompt_name, content, ftt_id,
+                               record_kinds, artifacts)
+        finally:
+            runtime_sta_cxx.release_fta(fta_id)
+
+        if record_kinds is not None:
+            return frame, artifacts
+        return frame
+
+    @staticmethod
+    def _walk(program, prompt_name, content, ftt_id, record_kinds, artifacts):
+        """Walk a stored FTT to its frame (model-free), then release it."""
+        try:
+            frame = runtime_sta_cxx.walk_ftt_to_frame(
+                program.id, prompt_name, ftt_id, content
+            )
+
+            if record_kinds:
+                if "frame" in record_kinds:
+                    artifacts["frame"] = frame
+                if "ftt" in record_kinds:
+                    artifacts["ftt"] = runtime_sta_cxx.get_ftt(ftt_id)
+        finally:
+            runtime_sta_cxx.release_ftt(ftt_id)
+        return frame
+
+    def stream_prompt(self, program, prompt_name, content, step=16):
+        """
+        Evaluate a single prompt, yielding FTT nodes as they are grown.
+
+        Generation advances about `step` tokens at a time. Each node yields a
+        dict with "event": "node", its detokenized "text", "path" (child
+        indices from the root), "leaf", and "best": the leading path so far
+        ({"path", "text", "complete"}). The last item is {"event": "done",
+        "frame": frame}, the frame evaluate_prompt would return.
+
+        Args:
+            program: Program object
+            prompt_name: name of the prompt to evaluate
+            content: dict of resolved channel values
+            step: tokens evaluated between two batches of events
+        """
+        fta_id = runtime_sta_cxx.instantiate(
+            program.id, prompt_name, content, self.syntax_id, self.search_id
+        )
+        try:
+            stream = backend_llama_cxx.stream_start(self.model_id, fta_id)
+            try:
+                done = False
+                while not done:
+                    result = backend_llama_cxx.stream_step(stream, step)
+                    for event in result["events"]:
+                        yield dict(event, event="node")
+                    done = result["done"]
+            except BaseException:
+                # Failed or closed early: drop the partial tree.
+                runtime_sta_cxx.release_ftt(backend_llama_cxx.stream_finish(stream))
+                raise
+            ftt_id = backend_llama_cxx.stream_finish(stream)
             try:
-                # The backend stored the FTT; walk it from the store (model-free).
                 frame = runtime_sta_cxx.walk_ftt_to_frame(
                     program.id, prompt_name, ftt_id, content
                 )
-
-                if record_kinds:
-                    if "frame" in record_kinds:
-                        artifacts["frame"] = frame
-                    if "ftt" in record_kinds:
-                        artifacts["ftt"] = runtime_sta_cxx.get_ftt(ftt_id)
             finally:
                 runtime_sta_cxx.release_ftt(ftt_id)
         finally:
             runtime_sta_cxx.release_fta(fta_id)
-
-        if record_kinds is not None:
-            return frame, artifacts
-        return frame
+        yield {"event": "done", "frame": frame}
 
     def run(self, program, entry="main", externals=None, max_steps=100,
             recorder=None, **inputs):
@@ -113,7 +199,9 @@ class Engine:
         return ctx.result
 
     async def run_async(self, program, entry="main", externals=None, **inputs):
-        """Async version of run — supports async external callables."""
+        """Async version of run — supports async external callables, and
+        evaluates prompts without blocking the event loop, so concurrent runs
+        share the model's batches."""
         prompt = program.entry_prompt(entry)
 
         ctx = Context(program, self, prompt, inputs, externals or {})
@@ -221,6 +221,68 @@ runtime_sta_cxx.release_ftt(ftt_id2)
 runtime_sta_cxx.release_fta(fta_id4)
 runtime_sta_cxx.release_search(scid_full)
 
+fta_ids = [runtime_sta_cxx.instantiate(pid6, "main", dict(content, question=q), sid, scid)
+           for q in ("2+2?", "3+3?", "4+4?")]
+ftt_ids = backend_llama_cxx.evaluate_batch(0, fta_ids)
+check("evaluate_batch returns one handle per FTA", len(ftt_ids) == len(fta_ids)
+      and all(isinstance(h, str) for h in ftt_ids))
+check("evaluate_batch FTTs walk to frames", all(
+    isinstance(runtime_sta_cxx.walk_ftt_to_frame(pid6, "main", h, dict(content, question=q)), dict)
+    for h, q in zip(ftt_ids, ("2+2?", "3+3?", "4+4?"))))
+check("evaluate_batch of nothing", backend_llama_cxx.evaluate_batch(0, []) == [])
+for h in ftt_ids: runtime_sta_cxx.release_ftt(h)
+for h in fta_ids: runtime_sta_cxx.release_fta(h)
+
+fta_id5 = runtime_sta_cxx.instantiate(pid6, "main", content, sid, scid)
+stream = backend_llama_cxx.stream_start(0, fta_id5)
+events, steps, done = [], 0, False
+while not done:
+    step = backend_llama_cxx.stream_step(stream, 4)
+    events.extend(step["events"])
+    done = step["done"]
+    steps += 1
+check("stream_step reports nodes over several steps", len(events) > 1 and steps > 1)
+check("stream first event is the root", events[0]["path"] == [])
+check("stream events carry text and best path",
+      all(isinstance(e["text"], str) and "path" in e["best"] for e in events))
+ftt_id5 = backend_llama_cxx.stream_finish(stream)
+ftt5 = runtime_sta_cxx.get_ftt(ftt_id5)
+def count_nodes(node):
+    return 1 + sum(count_nodes(c) for c in node["children"])
+check("stream reports every FTT node", count_nodes(ftt5) == len(events))
+try:
+    backend_llama_cxx.stream_step(stream, 4)
+    check("stream_step after finish raises", False, "expected exception")
+except Exception:
+    check("stream_step after finish raises", True)
+runtime_sta_cxx.release_ftt(ftt_id5)
+runtime_sta_cxx.release_fta(fta_id5)
+
+import select
+fta_ids = [runtime_sta_cxx.instantiate(pid6, "main", dict(content, question=q), sid, scid)
+           for q in ("2+2?", "3+3?", "4+4?")]
+handles = [backend_llama_cxx.evaluate_async(0, h) for h in fta_ids]
+cancelled = backend_llama_cxx.evaluate_async(0, fta_ids[0], 1)
+backend_llama_cxx.evaluate_cancel(cancelled)
+results = {}
+while len(results) < len(handles) + 1:
+    ready, _, _ = select.select([backend_llama_cxx.async_fd()], [], [], 60)
+    if not ready:
+        break
+    for r in backend_llama_cxx.async_results():
+        results[r["handle"]] = r
+check("evaluate_async reports every evaluation", len(results) == len(handles) + 1)
+check("evaluate_async FTTs walk to frames", all(
+    results[h]["status"] == "done" and isinstance(
+        runtime_sta_cxx.walk_ftt_to_frame(pid6, "main", results[h]["ftt"], dict(content, question=q)), dict)
+    for h, q in zip(handles, ("2+2?", "3+3?", "4+4?"))))
+check("evaluate_cancel stops an evaluation (or it finished first)",
+      results.get(cancelled, {}).get("status") in ("cancelled", "done"))
+check("evaluate_cancel of a finished evaluation", backend_llama_cxx.evaluate_cancel(handles[0]) is False)
+for r in results.values():
+    if r["status"] == "done": runtime_sta_cxx.release_ftt(r["ftt"])
+for h in fta_ids: runtime_sta_cxx.release_fta(h)
+
 runtime_sta_cxx.release_syntax(sid)
 runtime_sta_cxx.release_search(scid)
 compiler_stl_cxx.release(pid6)
@@ -151,6 +151,29 @@ class TestPipeline:
         assert isinstance(result, str)
         assert len(result) > 0
 
+    def test_completion_without_free_sequences(self, engine, repo_root):
+        """Beams share KV sequences when the model has none left: the tree
+        does not depend on the other evaluations holding them."""
+        import autocog
+        from autocog.backend.llama import backend_llama_cxx
+        from autocog.runtime.sta import runtime_sta_cxx
+        prog = autocog.compile(str(repo_root / "tests/fixtures/stl/language/vocab/test_vocab.stl"))
+
+        engine.set_seed(42)
+        _, alone = engine.evaluate_prompt(prog, "writer", {}, record_kinds={"ftt"})
+
+        # Every stream leases a sequence up front: 64 of them hold them all.
+        fta_id = runtime_sta_cxx.instantiate(prog.id, "writer", {}, engine.syntax_id, engine.search_id)
+        streams = [backend_llama_cxx.stream_start(engine.model_id, fta_id) for _ in range(64)]
+        try:
+            engine.set_seed(42)
+            _, crowded = engine.evaluate_prompt(prog, "writer", {}, record_kinds={"ftt"})
+        finally:
+            for stream in streams:
+                runtime_sta_cxx.release_ftt(backend_llama_cxx.stream_finish(stream))
+            runtime_sta_cxx.release_fta(fta_id)
+        assert crowded["ftt"] == alone["ftt"]
+
 
 class TestRealModel:
     """Tests with real GGUF models. Skipped if models unavailable."""
@@ -193,6 +216,47 @@ class TestRealModel:
         assert isinstance(result, str)
         assert len(result) > 0
 
+    def test_llama3_choices_longer_than_batch(self, llama3_model_path):
+        """Choices sharing prefixes, one longer than n_batch: the trie scores
+        them like one at a time."""
+        from autocog.backend.llama import backend_llama_cxx
+        model = backend_llama_cxx.create(llama3_model_path, n_ctx=512, n_batch=8)
+        tokenize = lambda text: backend_llama_cxx.tokenize(model, text, False)
+        context = tokenize("question: What is the color of the sky?\nanswer:")
+        choices = [tokenize(text) for text in [
+            " blue",
+            " blue sky",
+            " blue" + ", blue and bright" * 30,
+            " grey",
+        ]]
+        # llama.cpp raises n_batch to its KQ mask padding (at most 64).
+        assert len(choices[2]) > 64
+        batched = backend_llama_cxx.score_choices(model, context, choices)
+        alone = backend_llama_cxx.score_choices(model, context, choices, batched=False)
+        assert [len(lp) for lp in batched] == [len(c) for c in choices]
+        for b, a in zip(batched, alone):
+            assert b == pytest.approx(a, abs=1e-2)
+
+    def test_llama3_lookahead_without_free_sequences(self, real_engine, repo_root):
+        """Lookahead (default search: 4 beams, 2 ahead) needs a sequence per
+        candidate: without free ones, rollouts share their candidates' and
+        the completion still picks the same texts."""
+        import autocog
+        from autocog.backend.llama import backend_llama_cxx
+        from autocog.runtime.sta import runtime_sta_cxx
+        prog = autocog.compile(str(repo_root / "tests/fixtures/stl/language/vocab/test_vocab.stl"))
+        alone = real_engine.evaluate_prompt(prog, "writer", {})
+
+        fta_id = runtime_sta_cxx.instantiate(prog.id, "writer", {}, real_engine.syntax_id, real_engine.search_id)
+        streams = [backend_llama_cxx.stream_start(real_engine.model_id, fta_id) for _ in range(64)]
+        try:
+            crowded = real_engine.evaluate_prompt(prog, "writer", {})
+        finally:
+            for stream in streams:
+                runtime_sta_cxx.release_ftt(backend_llama_cxx.stream_finish(stream))
+            runtime_sta_cxx.release_fta(fta_id)
+        assert crowded == alone
+
 
 class TestWriterDemo:
     """End-to-end test of the writer demo with RNG model."""
@@ -889,6 +953,57 @@ class TestCoverageEdgeCases:
         ))
         assert result in ["3", "4", "5", "6"]
 
+    def test_engine_run_async_concurrent(self, repo_root):
+        """Concurrent async runs share the model's worker."""
+        import asyncio, autocog
+        prog = autocog.compile(str(repo_root / "share/demos/mcq/select.stl"))
+        engine = autocog.Engine(syntax=str(repo_root / "share/syntax/default.json"), search=str(repo_root / "share/search/default.json"))
+
+        async def runs():
+            return await asyncio.gather(*(engine.run_async(
+                prog, topic="Sci", question=q, choices=["3", "4", "5", "6"]
+            ) for q in ("2+2?", "3+1?", "5-1?")))
+
+        results = asyncio.run(runs())
+        assert all(r in ["3", "4", "5", "6"] for r in results)
+
+    def test_shared_context_async_and_sync(self, engine, repo_root):
+        """With every KV sequence leased, async and sync evaluations all fall
+        back to sequence 0: they take turns on it instead of interleaving."""
+        import asyncio, autocog
+        from autocog.backend.llama import backend_llama_cxx
+        from autocog.runtime.sta import runtime_sta_cxx
+        prog = autocog.compile(str(repo_root / "tests/fixtures/stl/language/vocab/test_vocab.stl"))
+        fta_id = runtime_sta_cxx.instantiate(prog.id, "writer", {}, engine.syntax_id, engine.search_id)
+        streams = [backend_llama_cxx.stream_start(engine.model_id, fta_id) for _ in range(64)]
+
+        async def runs():
+            return await asyncio.gather(
+                *(engine.evaluate_prompt_async(prog, "writer", {}) for _ in range(3)),
+                *(asyncio.to_thread(engine.evaluate_prompt, prog, "writer", {}) for _ in range(3)),
+            )
+
+        try:
+            frames = asyncio.run(runs())
+        finally:
+            for stream in streams:
+                runtime_sta_cxx.release_ftt(backend_llama_cxx.stream_finish(stream))
+            runtime_sta_cxx.release_fta(fta_id)
+        assert len(frames) == 6
+        assert all(len(frame["code"]) > 0 for frame in frames)
+
+    def test_engine_shared_mask_cache(self, repo_root, tmp_path):
+        """RNG engines share model 0: its mask cache can be set again, not moved."""
+        import autocog
+        prog = autocog.compile(str(repo_root / "tests/fixtures/stl/language/vocab/test_vocab.stl"))
+        kwargs = dict(syntax=str(repo_root / "share/syntax/default.json"), search=str(repo_root / "share/search/default.json"))
+        engine = autocog.Engine(mask_cache=tmp_path, **kwargs)
+        engine.prewarm(prog)
+        autocog.Engine(mask_cache=tmp_path, **kwargs)
+        autocog.Engine(mask_cache=str(tmp_path) + "/", **kwargs)
+        with pytest.raises(autocog.errors.ModelError):
+            autocog.Engine(mask_cache=tmp_path / "other", **kwargs)
+
     def test_remote_error_handling(self, repo_root):
         """Test RemoteEngine error path."""
         import autocog, json, urllib.request
@@ -0,0 +1,163 @@
+// Unit test for the model-independent beam search of completions
+// (autocog/backend/llama/beams.hxx): beams are expanded and stopped on the stop
+// sequence, pruning keeps the stopped beams and the best live ones, repeats
+// are found and penalized on known token sequences, and lookahead rollouts end
+// at the stop sequence and score a candidate like the beam it would grow into. Returns non-zero if any check fails.
+
+#include "autocog/backend/llama/beams.hxx"
+
+#include <cmath>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace {
+
+using namespace autocog::backend::llama;
+
+int failures = 0;
+void check(bool ok, std::string const & what) {
+  if (ok) std::cout << "ok   : " << what << "\n";
+  else  { std::cerr << "FAIL : " << what << "\n"; ++failures; }
+}
+
+bool close(float a, float b) { return std::fabs(a - b) < 1e-6f; }
+
+// Expand `beam` with one token, returning the new beam.
+BeamState grow(BeamState const & beam, BeamArena & arena, autocog::data::CompleteAction const & ca,
+               TokenSequence const & stop, TokenID const token, float const logprob) {
+  std::vector<BeamState> beams;
+  expand_beam(beam, arena, ca, stop, {token}, {logprob}, beams);
+  return beams.front();
+}
+
+}
+
+int main() {
+  autocog::data::CompleteAction ca;
+  TokenSequence const stop{7, 8};
+
+  {
+    BeamArena arena;
+    std::vector<BeamState> beams;
+    expand_beam(BeamState{}, arena, ca, stop, {5, 6, 7}, {0.1f, 0.2f, 0.3f}, beams);
+    check(beams.size() == 3 && arena.size() == 3, "one beam per top-k token");
+    check(beams[1].length == 1 && close(beams[1].logprob, 0.2f) && close(beams[1].proba(), std::exp(-0.2f)), "beam logprob and proba");
+
+    BeamState const stopped = grow(grow(beams[0], arena, ca, stop, 7, 0.4f), arena, ca, stop, 8, 0.5f);
+    check(stopped.stopped && stopped.trimmed == 2 && ends_with(stopped, arena, stop), "stop sequence ends a beam");
+    TokenSequence tokens;
+    ProbaSequence logprobs;
+    materialize(stopped, arena, tokens, logprobs);
+    check(tokens == TokenSequence{5} && logprobs.size() == 3, "stop tokens trimmed, their logprobs kept");
+
+    std::vector<BeamState> pool{beams[0], stopped, beams[2], beams[1]};
+    prune_beams(pool, 2);
+    check(pool.size() == 3 && pool[0].stopped && pool[1].last == beams[0].last && pool[2].last == beams[1].last,
+          "pruning keeps the stopped beams, then the best live ones");
+  }
+
+  {
+    // Repeats: the longest earlier occurrence of the suffix, not overlapping
+    // itself, the farthest on ties.
+    RepetitionState state;
+    for (TokenID tok : {1, 2, 3, 4, 1, 2}) state.push(tok);
+    check(state.match(3) == std::make_pair<size_t, size_t>(3, 4), "repeat of 1 2 3 four tokens back");
+    check(state.match(9).first == 0, "no repeat of a new token");
+    check(state.push(3) == std::make_pair<size_t, size_t>(3, 4) && state.recent.size() == 7, "push returns the match");
+
+    RepetitionState ones;
+    for (int i = 0; i < 5; ++i) ones.push(1);
+    check(ones.match(1) == std::make_pair<size_t, size_t>(3, 3), "repeats do not overlap themselves");
+
+    RepetitionState window;
+    for (size_t i = 0; i < RepetitionState::WINDOW + 10; ++i) window.push(static_cast<TokenID>(i));
+    check(window.recent.size() == RepetitionState::WINDOW && window.match(5).first == 0 && window.match(20).first == 1,
+          "only the last WINDOW tokens are searched");
+  }
+
+  {
+    // Penalties on a beam, after base tokens: the repeat of 1 2 3 ends with
+    // the beam's second token.
+    autocog::data::CompleteAction penalized;
+    penalized.repetition = 0.5f;
+    BeamArena arena;
+    BeamState root;
+    auto base = std::make_shared<RepetitionState>();
+    for (TokenID tok : {1, 2, 3, 4, 1}) base->push(tok);
+    root.repetition = base;
+
+    BeamState const first = grow(root, arena, penalized, stop, 2, 0.1f);
+    check(close(first.repetition_penalty, 1.0f), "repeat shorter than MIN_LENGTH is not penalized");
+    check(first.repetition == root.repetition, "the root's window is shared");
+
+    std::vector<BeamState> beams;
+    expand_beam(first, arena, penalized, stop, {3, 4}, {0.1f, 0.1f}, beams);
+    float const penalty = 1.0f + 0.5f * std::log(4.0f) / std::log(5.0f);
+    check(close(beams[0].repetition_penalty, penalty) && close(beams[1].repetition_penalty, 1.0f),
+          "repeat of length 3 at distance 4 penalized");
+    check(beams[0].repetition == beams[1].repetition && beams[0].repetition != first.repetition
+          && beams[0].repetition->recent.size() == 6 && first.repetition->recent.size() == 5,
+          "siblings share their parent's window, the parent's is unchanged");
+
+    BeamState const again = grow(beams[0], arena, penalized, stop, 4, 0.1f);
+    check(again.repetition_penalty > beams[0].repetition_penalty, "penalties accumulate");
+
+    BeamState const plain = grow(grow(BeamState{}, arena, ca, stop, 1, 0.1f), arena, ca, stop, 1, 0.1f);
+    check(!plain.repetition && close(plain.repetition_penalty, 1.0f), "no window without the penalty");
+  }
+
+  {
+    // A rollout goes on greedily until the stop sequence, even when it starts
+    // in the candidate's own tokens.
+    BeamArena arena;
+    BeamState const a = grow(grow(BeamState{}, arena, ca, stop, 5, 0.1f), arena, ca, stop, 6, 0.1f);
+    Rollout rollout = start_rollout(0, 3, a, arena, stop);
+    check(rollout.token == 6 && rollout.seq == 3 && !rollout.stopped, "rollout starts from the candidate's last token");
+    extend_rollout(rollout, 7, 0.2f, stop);
+    check(!rollout.stopped && rollout.token == 7, "rollout goes on");
+    extend_rollout(rollout, 8, 0.3f, stop);
+    check(rollout.stopped && rollout.length == 2 && close(rollout.logprob, 0.5f), "rollout ends at the stop sequence");
+
+    BeamState const b = grow(grow(BeamState{}, arena, ca, stop, 5, 0.1f), arena, ca, stop, 7, 0.1f);
+    Rollout across = start_rollout(1, 4, b, arena, stop);
+    extend_rollout(across, 8, 0.3f, stop);
+    check(across.stopped && across.length == 1, "stop sequence spanning candidate and rollout");
+    check(across.tokens == TokenSequence{8}, "rollout records its tokens (to rebuild a shared sequence)");
+  }
+
+  {
+    // Lookahead scores a candidate on its tokens and its rollout, like the
+    // beam of all of them: a candidate whose rollout stops compares with an
+    // already stopped candidate on the same basis.
+    BeamArena arena;
+    TokenSequence const end{9};
+    std::vector<BeamState> candidates;
+    expand_beam(BeamState{}, arena, ca, end, {9, 4}, {0.5f, 0.2f}, candidates);
+    check(candidates[0].stopped && !candidates[1].stopped, "one stopped candidate, one live");
+
+    Rollout rollout = start_rollout(1, 1, candidates[1], arena, end);
+    extend_rollout(rollout, 9, 0.3f, end);
+    check(rollout.stopped && rollout.length == 1, "rollout stops after one token");
+    apply_rollout(candidates[1], rollout);
+
+    BeamState const whole = grow(candidates[1], arena, ca, end, 9, 0.3f);
+    check(close(candidates[1].score(), whole.score()) && close(candidates[1].score(), std::exp(-0.25f)),
+          "rolled-out candidate scored as its stopped beam");
+    check(close(candidates[0].lookahead_bonus, 0.0f) && close(candidates[0].score(), std::exp(-0.5f)),
+          "stopped candidate scored on its own tokens");
+    check(candidates[1].score() > candidates[0].score(), "rollouts change the ranking");
+
+    Rollout empty = start_rollout(0, 2, candidates[1], arena, end);
+    apply_rollout(candidates[1], empty);
+    check(close(candidates[1].lookahead_bonus, 0.0f), "empty rollout gives no bonus");
+  }
+
+  if (failures) {
+    std::cerr << failures << " check(s) failed\n";
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,217 @@
+// Unit test and micro-benchmark for the fused masked log-softmax / top-k
+// kernel and the per-row sequence logprobs (autocog/backend/llama/logits.hxx).
+// Every SIMD level the CPU supports is checked against the reference path the
+// backend used before (full log-sum-exp, then a sort of the allowed tokens),
+// then timed against it on a vocabulary-sized logits vector. Returns non-zero
+// if any check fails.
+
+#include "autocog/backend/llama/logits.hxx"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+using autocog::backend::llama::SimdLevel;
+using autocog::backend::llama::TokenID;
+using autocog::backend::llama::VocabMask;
+
+int failures = 0;
+void check(bool ok, std::string const & what) {
+  if (ok) std::cout << "ok   : " << what << "\n";
+  else  { std::cerr << "FAIL : " << what << "\n"; ++failures; }
+}
+
+float reference_topk(
+  std::vector<float> const & logits, std::vector<bool> const & mask, size_t const k,
+  std::vector<TokenID> & tokens, std::vector<float> & logprobs
+) {
+  float max = -std::numeric_limits<float>::infinity();
+  for (float x : logits) max = std::max(max, x);
+  double sum = 0.0;
+  for (float x : logits) sum += std::exp(static_cast<double>(x) - max);
+  float const lse = max + static_cast<float>(std::log(sum));
+
+  std::vector<std::pair<float, TokenID>> allowed;
+  for (size_t i = 0; i < logits.size(); ++i)
+    if (mask[i] && logits[i] > -std::numeric_limits<float>::infinity()) allowed.emplace_back(logits[i], static_cast<TokenID>(i));
+  std::sort(allowed.begin(), allowed.end(), [](auto const & a, auto const & b) {
+    return a.first > b.first || (a.first == b.first && a.second < b.second);
+  });
+  allowed.resize(std::min(k, allowed.size()));
+
+  tokens.clear();
+  logprobs.clear();
+  for (auto const & [logit, tok] : allowed) {
+    tokens.push_back(tok);
+    logprobs.push_back(lse - logit);
+  }
+  return lse;
+}
+
+std::vector<SimdLevel> supported_levels() {
+  std::vector<SimdLevel> levels{SimdLevel::Scalar};
+  SimdLevel const best = autocog::backend::llama::simd_level();
+  if (best == SimdLevel::AVX2 || best == SimdLevel::AVX512) levels.push_back(SimdLevel::AVX2);
+  if (best == SimdLevel::AVX512) levels.push_back(SimdLevel::AVX512);
+  return levels;
+}
+
+void check_case(
+  std::string const & name, std::vector<float> const & logits, std::vector<bool> const & mask,
+  size_t const k, SimdLevel const level
+) {
+  std::vector<TokenID> ref_tokens, tokens;
+  std::vector<float> ref_logprobs, logprobs;
+  float const ref_lse = reference_topk(logits, mask, k, ref_tokens, ref_logprobs);
+  VocabMask packed(mask.size());
+  for (size_t i = 0; i < mask.size(); ++i) if (mask[i]) packed.set(i);
+  float const lse = autocog::backend::llama::masked_topk(logits.data(), packed, k, tokens, logprobs, level);
+
+  std::string const what = std::string(autocog::backend::llama::simd_level_name(level)) + " " + name;
+  float const tolerance = 1e-4f * std::max(1.0f, std::fabs(ref_lse));
+  check(std::fabs(lse - ref_lse) <= tolerance, what + ": log-sum-exp");
+  check(tokens == ref_tokens, what + ": top-k tokens");
+  bool close = logprobs.size() == ref_logprobs.size();
+  for (size_t i = 0; close && i < logprobs.size(); ++i)
+    close = std::fabs(logprobs[i] - ref_logprobs[i]) <= tolerance;
+  check(close, what + ": top-k logprobs");
+
+  packed.index(mask.size());
+  float const sparse_lse = autocog::backend::llama::masked_topk(logits.data(), packed, k, tokens, logprobs, level);
+  check(std::fabs(sparse_lse - ref_lse) <= tolerance && tokens == ref_tokens, what + ": sparse top-k");
+
+  float const plain = autocog::backend::llama::log_sum_exp(logits.data(), logits.size(), level);
+  check(std::fabs(plain - ref_lse) <= tolerance, what + ": unmasked log-sum-exp");
+}
+
+template <typename F>
+double time_us(F && f, unsigned const reps) {
+  auto const start = std::chrono::steady_clock::now();
+  for (unsigned r = 0; r < reps; ++r) f();
+  auto const stop = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::micro>(stop - start).count() / reps;
+}
+
+}
+
+int main() {
+  std::mt19937 rng(1234);
+  std::normal_distribution<float> normal(0.0f, 4.0f);
+  std::bernoulli_distribution coin(0.3);
+
+  for (size_t n : {size_t{1}, size_t{7}, size_t{33}, size_t{1000}, size_t{32003}}) {
+    std::vector<float> logits(n);
+    for (auto & x : logits) x = normal(rng);
+    std::vector<bool> all(n, true);
+    std::vector<bool> some(n);
+    for (size_t i = 0; i < n; ++i) some[i] = coin(rng);
+
+    for (SimdLevel level : supported_levels()) {
+      std::string const size = "n=" + std::to_string(n);
+      check_case(size + " unmasked k=5", logits, all, 5, level);
+      check_case(size + " masked k=5", logits, some, 5, level);
+      check_case(size + " masked k=n", logits, some, n, level);
+      check_case(size + " k=0", logits, all, 0, level);
+    }
+  }
+
+  // Ties rank by token id, and masked-out maxima do not leak into the top-k.
+  {
+    std::vector<float> logits(100, 1.0f);
+    logits[10] = logits[50] = logits[90] = 5.0f;
+    std::vector<bool> mask(100, true);
+    mask[50] = false;
+    for (SimdLevel level : supported_levels())
+      check_case("ties", logits, mask, 4, level);
+  }
+
+  // Logits at -inf (e.g. biased out by the model) are ignored altogether.
+  {
+    std::vector<float> logits(40, -std::numeric_limits<float>::infinity());
+    logits[3] = 2.0f;
+    logits[37] = -1.0f;
+    std::vector<bool> mask(40, true);
+    for (SimdLevel level : supported_levels())
+      check_case("-inf", logits, mask, 3, level);
+  }
+
+  // Per-row logprobs of a sequence (contiguous rows, as llama returns them).
+  {
+    size_t const n_vocab = 1000, n = 12;
+    std::vector<float> rows(n * n_vocab);
+    for (auto & x : rows) x = normal(rng);
+    std::vector<TokenID> seq(n);
+    std::uniform_int_distribution<TokenID> pick(0, n_vocab - 1);
+    for (auto & tok : seq) tok = pick(rng);
+    for (SimdLevel level : supported_levels()) {
+      std::vector<float> logprobs(n);
+      autocog::backend::llama::sequence_logprobs(rows.data(), n_vocab, seq.data(), n, logprobs.data(), level);
+      bool close = true;
+      for (size_t i = 0; i < n; ++i) {
+        std::vector<float> const row(rows.begin() + i * n_vocab, rows.begin() + (i + 1) * n_vocab);
+        std::vector<TokenID> tokens;
+        std::vector<float> ref;
+        float const lse = reference_topk(row, std::vector<bool>(n_vocab, true), 0, tokens, ref);
+        close = close && std::fabs(logprobs[i] - (lse - row[seq[i]])) <= 1e-4f * std::max(1.0f, std::fabs(lse));
+      }
+      check(close, std::string(autocog::backend::llama::simd_level_name(level)) + " sequence logprobs");
+    }
+  }
+
+  // Micro-benchmark: a Llama-sized vocabulary, beam width 5, a sparse mask.
+  {
+    size_t const n = 128256;
+    unsigned const reps = 200;
+    std::vector<float> logits(n);
+    for (auto & x : logits) x = normal(rng);
+    std::vector<bool> mask(n);
+    VocabMask packed(n);
+    for (size_t i = 0; i < n; ++i) if ((mask[i] = coin(rng))) packed.set(i);
+    std::vector<TokenID> tokens;
+    std::vector<float> logprobs;
+
+    double const ref = time_us([&] { reference_topk(logits, mask, 5, tokens, logprobs); }, reps);
+    std::cout << "bench: reference " << ref << " us/call\n";
+    for (SimdLevel level : supported_levels()) {
+      double const t = time_us([&] {
+        autocog::backend::llama::masked_topk(logits.data(), packed, 5, tokens, logprobs, level);
+      }, reps);
+      std::cout << "bench: " << autocog::backend::llama::simd_level_name(level) << " " << t << " us/call (" << ref / t << "x)\n";
+    }
+  }
+
+  // Sparse masks: a few dozen allowed tokens, gathered from the index.
+  {
+    size_t const n = 128256;
+    unsigned const reps = 200;
+    std::vector<float> logits(n);
+    for (auto & x : logits) x = normal(rng);
+    std::uniform_int_distribution<size_t> pick(0, n - 1);
+    VocabMask packed(n);
+    for (unsigned i = 0; i < 40; ++i) packed.set(pick(rng));
+    std::vector<TokenID> tokens;
+    std::vector<float> logprobs;
+
+    double const fused = time_us([&] {
+      autocog::backend::llama::masked_topk(logits.data(), packed, 5, tokens, logprobs);
+    }, reps);
+    packed.index(n / 64);
+    double const sparse = time_us([&] {
+      autocog::backend::llama::masked_topk(logits.data(), packed, 5, tokens, logprobs);
+    }, reps);
+    std::cout << "bench: 40 allowed, fused " << fused << " us/call, sparse " << sparse << " us/call\n";
+  }
+
+  if (failures > 0) {
+    std::cerr << failures << " check(s) failed\n";
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,78 @@
+// Unit test for autocog::backend::llama::MaskStore: masks saved to a temporary
+// directory are mapped back as identical views, a view is copied (not written
+// through) when modified, and missing, truncated or mismatched files are
+// ignored. Returns non-zero if any check fails.
+
+#include "autocog/backend/llama/mask-store.hxx"
+
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+
+#include <unistd.h>
+
+namespace {
+
+using autocog::backend::llama::MaskStore;
+using autocog::backend::llama::VocabMask;
+
+int failures = 0;
+void check(bool ok, std::string const & what) {
+  if (ok) std::cout << "ok   : " << what << "\n";
+  else  { std::cerr << "FAIL : " << what << "\n"; ++failures; }
+}
+
+}
+
+int main() {
+  namespace fs = std::filesystem;
+  fs::path const dir = fs::temp_directory_path() / ("autocog-mask-store-" + std::to_string(::getpid()));
+  MaskStore const store(dir.string(), "0123abcd");
+  std::mt19937 rng(42);
+
+  check(!store.load("vocab_missing", 100).has_value(), "missing file is a miss");
+
+  for (size_t n : {size_t{1}, size_t{64}, size_t{300}, size_t{32003}}) {
+    std::string const size = "n=" + std::to_string(n) + ": ";
+    std::string const ref = "vocab_" + std::to_string(n);
+    std::bernoulli_distribution coin(0.3);
+    VocabMask mask(n);
+    for (size_t i = 0; i < n; ++i) if (coin(rng)) mask.set(i);
+
+    store.save(ref, mask);
+    check(fs::exists(store.path(ref)), size + "saved under <dir>/<sha>/<ref>.mask");
+
+    auto loaded = store.load(ref, n);
+    check(loaded.has_value() && *loaded == mask, size + "roundtrip");
+    check(!store.load(ref, n + 1).has_value(), size + "vocab size mismatch is a miss");
+    if (!loaded) continue;
+
+    VocabMask copy = *loaded;
+    copy.flip();
+    auto reloaded = store.load(ref, n);
+    check(reloaded.has_value() && *reloaded == mask && *loaded == mask, size + "modifying a view leaves the file intact");
+    check(loaded->index(n) && loaded->count() == mask.count(), size + "views can be indexed");
+  }
+
+  std::string const bad = "vocab_bad";
+  store.save(bad, VocabMask(300, true));
+  fs::resize_file(store.path(bad), 20);
+  check(!store.load(bad, 300).has_value(), "truncated file is a miss");
+  {
+    std::fstream f(store.path("vocab_300"), std::ios::in | std::ios::out | std::ios::binary);
+    f.put('X');
+  }
+  check(!store.load("vocab_300", 300).has_value(), "bad magic is a miss");
+
+  store.save("../escape", VocabMask(64, true));
+  check(!fs::exists(dir / "escape.mask") && !store.load("../escape", 64).has_value(), "refs that are not file names are not cached");
+
+  fs::remove_all(dir);
+  if (failures) {
+    std::cerr << failures << " check(s) failed\n";
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,128 @@
+// Unit test for autocog::backend::llama::PrefixCache: lookups find the longest
+// retained prefix (also part-way through an edge) after inserts sharing
+// prefixes, edges are split and merged back, redundant entries are dropped,
+// and eviction keeps the tree within its token budget and entry count (or
+// frees a sequence on demand), least recently used first. Returns non-zero if
+// any check fails.
+
+#include "autocog/backend/llama/prefix-cache.hxx"
+
+#include <algorithm>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace {
+
+using autocog::backend::llama::ContextID;
+using autocog::backend::llama::PrefixCache;
+using autocog::backend::llama::TokenID;
+using autocog::backend::llama::TokenSequence;
+
+int failures = 0;
+void check(bool ok, std::string const & what) {
+  if (ok) std::cout << "ok   : " << what << "\n";
+  else  { std::cerr << "FAIL : " << what << "\n"; ++failures; }
+}
+
+// `n` tokens counting up from `first`.
+TokenSequence run(TokenID const first, size_t const n) {
+  TokenSequence tokens(n);
+  for (size_t i = 0; i < n; ++i) tokens[i] = first + static_cast<TokenID>(i);
+  return tokens;
+}
+
+TokenSequence concat(TokenSequence a, TokenSequence const & b) {
+  a.insert(a.end(), b.begin(), b.end());
+  return a;
+}
+
+bool matches(std::optional<PrefixCache::Match> const & match, ContextID const seq, size_t const length) {
+  return match && match->seq == seq && match->length == length;
+}
+
+bool same(std::vector<ContextID> dropped, std::vector<ContextID> expected) {
+  std::sort(dropped.begin(), dropped.end());
+  std::sort(expected.begin(), expected.end());
+  return dropped == expected;
+}
+
+}
+
+int main() {
+  TokenSequence const a = run(1, 20);                        // 1..20
+  TokenSequence const b = concat(run(1, 10), run(50, 10));   // 1..10 50..59
+
+  {
+    PrefixCache cache;
+    check(!cache.lookup(a, 0).has_value() && cache.empty(), "empty cache misses");
+
+    check(cache.insert(a, 1).empty(), "first insert drops nothing");
+    check(matches(cache.lookup(concat(a, {99}), 0), 1, 20), "lookup past an entry matches all of it");
+    check(matches(cache.lookup(concat(run(1, 10), {77}), 0), 1, 10), "lookup leaving mid-edge matches up to there");
+    check(!cache.lookup(run(1, 10), 10).has_value(), "match no longer than the floor is a miss");
+
+    check(cache.insert(b, 2).empty(), "insert sharing a prefix drops nothing");
+    check(cache.stats().entries == 2 && cache.stats().tokens == 30, "split edge: shared prefix counted once");
+    check(matches(cache.lookup(concat(run(1, 10), run(50, 2)), 0), 2, 12), "lookup follows the new branch");
+    check(matches(cache.lookup(run(1, 15), 0), 1, 15), "lookup follows the old branch");
+    auto const fork = cache.lookup(concat(run(1, 10), {77}), 0);
+    check(fork && fork->length == 10 && (fork->seq == 1 || fork->seq == 2), "lookup ending at the split matches either");
+
+    check(same(cache.insert(run(1, 5), 3), {3}), "insert of a covered prefix is not retained");
+    check(cache.covers(run(1, 5)) && cache.covers(b) && !cache.covers(run(1, 21)), "covers");
+
+    check(same(cache.insert(run(1, 25), 4), {1}), "insert extending an entry drops it");
+    check(cache.stats().entries == 2 && cache.stats().tokens == 35, "extended entry reuses its edge");
+    check(matches(cache.lookup(run(1, 25), 0), 4, 25), "extended entry is found");
+
+    auto const stats = cache.stats();
+    check(stats.hits == 6 && stats.misses == 2, "hits and misses counted");
+    check(same(cache.clear(), {2, 4}) && cache.empty() && cache.stats().tokens == 0, "clear returns every sequence");
+  }
+
+  {
+    // Entry count: the least recently used entry goes, and the pass-through
+    // node it leaves is merged with its only child.
+    PrefixCache cache(0, 2);
+    cache.insert(a, 1);
+    cache.insert(b, 2);
+    cache.lookup(b, 0);
+    check(same(cache.insert(run(7, 3), 3), {1}), "max entries: LRU entry evicted");
+    check(cache.stats().entries == 2 && cache.stats().tokens == 23, "evicted branch pruned");
+    check(matches(cache.lookup(b, 0), 2, 20), "merged edge still matches");
+    check(matches(cache.lookup(concat(run(1, 10), {77}), 0), 2, 10), "merged edge matches part-way");
+    check(!cache.lookup(run(11, 5), 0).has_value(), "evicted tokens miss");
+  }
+
+  {
+    // On demand (the model needs a sequence): least recently used first.
+    PrefixCache cache;
+    check(!cache.evict().has_value(), "evict: nothing in an empty cache");
+    cache.insert(a, 1);
+    cache.insert(b, 2);
+    cache.lookup(a, 0);
+    check(cache.evict() == std::optional<ContextID>(2) && cache.stats().entries == 1, "evict: LRU entry first");
+    check(cache.stats().tokens == 20 && matches(cache.lookup(a, 0), 1, 20), "evict: its branch pruned, the rest kept");
+    check(cache.evict() == std::optional<ContextID>(1) && cache.empty() && cache.stats().tokens == 0, "evict: last entry");
+  }
+
+  {
+    // Token budget: shared prefixes count once, then LRU eviction.
+    PrefixCache cache(30, 0);
+    cache.insert(a, 1);
+    check(cache.insert(b, 2).empty(), "budget: shared prefixes fit");
+    cache.lookup(a, 0);
+    check(same(cache.insert(run(100, 10), 3), {2}), "budget: LRU entry evicted");
+    check(cache.stats().tokens == 30 && cache.stats().entries == 2, "budget: back within budget");
+    check(same(cache.insert(run(200, 25), 4), {1, 3}), "budget: as many entries as needed evicted");
+    check(cache.stats().tokens == 25 && matches(cache.lookup(run(200, 25), 0), 4, 25), "budget: newest entry kept");
+  }
+
+  if (failures) {
+    std::cerr << failures << " check(s) failed\n";
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,102 @@
+// Unit test for autocog::backend::llama::RegexDFA: the compiled DFA must agree
+// with std::regex_search (ECMAScript) on hand-picked vocab patterns and on
+// randomly generated patterns and token surfaces. Patterns outside the
+// supported subset must decline to compile. Returns non-zero if any check fails.
+
+#include "autocog/backend/llama/regex-dfa.hxx"
+
+#include <iostream>
+#include <random>
+#include <regex>
+#include <string>
+#include <vector>
+
+namespace {
+
+using autocog::backend::llama::RegexDFA;
+
+int failures = 0;
+void check(bool ok, std::string const & what) {
+  if (ok) std::cout << "ok   : " << what << "\n";
+  else  { std::cerr << "FAIL : " << what << "\n"; ++failures; }
+}
+
+// Number of texts on which the DFA and std::regex_search disagree.
+size_t disagreements(RegexDFA const & dfa, std::string const & pattern, std::vector<std::string> const & texts) {
+  std::regex const re(pattern);
+  size_t n = 0;
+  for (auto const & text : texts)
+    if (dfa.search(text) != std::regex_search(text, re)) {
+      if (n == 0) std::cerr << "  " << pattern << " on \"" << text << "\": dfa=" << dfa.search(text) << "\n";
+      ++n;
+    }
+  return n;
+}
+
+std::string random_text(std::mt19937 & rng, std::string const & alphabet, size_t max_len) {
+  std::uniform_int_distribution<size_t> len(0, max_len);
+  std::uniform_int_distribution<size_t> pick(0, alphabet.size() - 1);
+  std::string s(len(rng), ' ');
+  for (char & c : s) c = alphabet[pick(rng)];
+  return s;
+}
+
+// Random pattern over a, b, c from the supported grammar.
+std::string random_pattern(std::mt19937 & rng, unsigned depth) {
+  std::uniform_int_distribution<int> d(0, depth == 0 ? 5 : 11);
+  switch (d(rng)) {
+    case 0: return "a";
+    case 1: return "b";
+    case 2: return ".";
+    case 3: return "[ac]";
+    case 4: return "[^a]";
+    case 5: return "\\d";
+    case 6: return random_pattern(rng, depth - 1) + random_pattern(rng, depth - 1);
+    case 7: return "(" + random_pattern(rng, depth - 1) + "|" + random_pattern(rng, depth - 1) + ")";
+    case 8: return "(?:" + random_pattern(rng, depth - 1) + ")*";
+    case 9: return "(" + random_pattern(rng, depth - 1) + ")+";
+    case 10: return "(" + random_pattern(rng, depth - 1) + ")?";
+    default: return "(" + random_pattern(rng, depth - 1) + "){1,2}";
+  }
+}
+
+}
+
+int main() {
+  std::mt19937 rng(7);
+
+  std::vector<std::string> texts = {
+    "", " ", "a", "ab", "abc", "12", " 42", "4.2", "Hello", " hello", "\n", "a\nb", "\r",
+    "x_y", "ABC", "-", "\t1", "caba", "bbbb", "\xc3\xa9t\xc3\xa9", "\xe2\x96\x81the", "<0x0A>",
+  };
+  for (int i = 0; i < 300; ++i) texts.push_back(random_text(rng, "abc19 _.\n-Az", 6));
+
+  std::vector<std::string> const patterns = {
+    "^[a-zA-Z]+$", "^[0-9]+$", "^\\d{1,3}$", "^\\s*\\d", "[aeiou]", "^ ?[A-Za-z]+$", "^\\w+$",
+    "^[^0-9]*$", "abc|^b", "a.c", "^$", "", "a*", "^(?:ab|c)+$", "\\.", "^[-+]?\\d+(\\.\\d+)?$",
+    "^\\S+$", "\\W", "^.{2}$", "^.{2,}$", "b{0}c", "[\\d_]", "[a\\-z]", "a$|^c", "^\\x41",
+    "[\\t\\n ]", "^(a|b)?$", "^a+?$", "[]", "[^]", "^\\u0061", "[a-]",
+  };
+  for (auto const & pattern : patterns) {
+    auto dfa = RegexDFA::compile(pattern);
+    check(dfa.has_value(), "compiles: " + pattern);
+    if (dfa) check(disagreements(*dfa, pattern, texts) == 0, "agrees with std::regex: " + pattern);
+  }
+
+  for (std::string const pattern : {"(a)\\1", "a(?=b)", "a(?!b)", "\\bthe", "\\Bx", "[[:alpha:]]", "a{2000}", "(?:a{900}){900}", "a**", "(a", "a)", "\\", "\\cJ"})
+    check(!RegexDFA::compile(pattern).has_value(), "declines: " + pattern);
+
+  size_t random_failures = 0;
+  for (int i = 0; i < 400; ++i) {
+    std::string const pattern = random_pattern(rng, 3);
+    auto dfa = RegexDFA::compile(pattern);
+    if (!dfa || disagreements(*dfa, pattern, texts) != 0) random_failures++;
+  }
+  check(random_failures == 0, "400 random patterns agree with std::regex");
+
+  if (failures > 0) {
+    std::cerr << failures << " check(s) failed\n";
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,100 @@
+// Unit test for autocog::backend::llama::VocabMask: the packed set algebra,
+// popcount and sparse iteration are checked against a std::vector<bool>
+// reference on sizes that do and do not fill the last word. Returns non-zero
+// if any check fails.
+
+#include "autocog/backend/llama/vocab-mask.hxx"
+
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+using autocog::backend::llama::TokenID;
+using autocog::backend::llama::VocabMask;
+
+int failures = 0;
+void check(bool ok, std::string const & what) {
+  if (ok) std::cout << "ok   : " << what << "\n";
+  else  { std::cerr << "FAIL : " << what << "\n"; ++failures; }
+}
+
+VocabMask pack(std::vector<bool> const & bits) {
+  VocabMask m(bits.size());
+  for (size_t i = 0; i < bits.size(); ++i) if (bits[i]) m.set(i);
+  return m;
+}
+
+bool same(VocabMask const & m, std::vector<bool> const & bits) {
+  if (m.size() != bits.size()) return false;
+  size_t count = 0;
+  for (size_t i = 0; i < bits.size(); ++i) {
+    if (m[i] != bits[i]) return false;
+    count += bits[i];
+  }
+  return m.count() == count && m.none() == (count == 0);
+}
+
+}
+
+int main() {
+  std::mt19937 rng(42);
+
+  for (size_t n : {size_t{1}, size_t{63}, size_t{64}, size_t{300}, size_t{32003}}) {
+    std::string const size = "n=" + std::to_string(n) + ": ";
+    std::bernoulli_distribution coin(0.4);
+    std::vector<bool> a(n), b(n);
+    for (size_t i = 0; i < n; ++i) { a[i] = coin(rng); b[i] = coin(rng); }
+
+    check(same(pack(a), a), size + "set/test/count");
+    check(same(VocabMask(n, true), std::vector<bool>(n, true)), size + "all-true mask has a clear tail");
+    check(VocabMask(n).none(), size + "default mask is empty");
+
+    std::vector<bool> expect(n);
+    for (size_t i = 0; i < n; ++i) expect[i] = a[i] || b[i];
+    check(same(VocabMask(pack(a)) |= pack(b), expect), size + "union");
+    for (size_t i = 0; i < n; ++i) expect[i] = a[i] && b[i];
+    check(same(VocabMask(pack(a)) &= pack(b), expect), size + "intersection");
+    for (size_t i = 0; i < n; ++i) expect[i] = a[i] && !b[i];
+    check(same(VocabMask(pack(a)).subtract(pack(b)), expect), size + "difference");
+    for (size_t i = 0; i < n; ++i) expect[i] = !a[i];
+    check(same(VocabMask(pack(a)).flip(), expect), size + "complement");
+
+    std::vector<TokenID> listed, expected;
+    pack(a).for_each([&](TokenID tok) { listed.push_back(tok); });
+    for (size_t i = 0; i < n; ++i) if (a[i]) expected.push_back(static_cast<TokenID>(i));
+    check(listed == expected, size + "for_each visits allowed tokens in order");
+
+    VocabMask m = pack(a);
+    bool bits_ok = true;
+    for (size_t i = 0; i + 8 <= n; i += 8) {
+      VocabMask::Word expected_bits = 0;
+      for (unsigned j = 0; j < 8; ++j) if (a[i + j]) expected_bits |= VocabMask::Word{1} << j;
+      bits_ok = bits_ok && m.bits(i, 8) == expected_bits;
+    }
+    check(bits_ok, size + "bits(tok, 8) extracts aligned groups");
+
+    VocabMask few(n);
+    few.set(n / 2);
+    few.set(n - 1);
+    check(few.index(2) && few.sparse(), size + "index() keeps a sparse list");
+    std::vector<TokenID> const few_tokens = n == 1
+        ? std::vector<TokenID>{0}
+        : std::vector<TokenID>{static_cast<TokenID>(n / 2), static_cast<TokenID>(n - 1)};
+    check(few.allowed() == few_tokens, size + "sparse list holds the allowed tokens");
+    std::vector<TokenID> visited;
+    few.for_each([&](TokenID tok) { visited.push_back(tok); });
+    check(visited == few.allowed(), size + "for_each uses the sparse list");
+    few.set(0);
+    check(!few.sparse(), size + "modifying a mask drops its sparse list");
+    check(!VocabMask(n, true).index(n - 1), size + "dense masks are not indexed");
+  }
+
+  if (failures > 0) {
+    std::cerr << failures << " check(s) failed\n";
+    return 1;
+  }
+  return 0;
+}
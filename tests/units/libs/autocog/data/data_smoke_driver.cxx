@@ -80,6 +80,10 @@ int main(int argc, char ** argv) {
     child.field = 2;
     child.tokens = {7, 8};
     ftt.root.children.push_back(child);
+    std::string const unsealed = ftt.root.hash();
+    ftt.root.children.front().seal();
+    ftt.root.seal();
+    check(ftt.root.merkle && ftt.root.hash() == unsealed, "sealed ftt digest matches the recursive one");
     ftt.finalize();
     check(ftt.metadata && ftt.metadata->format == std::string("ftt"), "ftt format stamped");
     json_roundtrip(ftt, "ftt");
@@ -178,6 +182,35 @@ int main(int argc, char ** argv) {
     } catch (...) {}
     check(threw, "tampered stored hash on reload throws IntegrityError");
   }
+  {
+    // Hash schemes: a new artifact records the current scheme; one stored
+    // without a scheme (this hash predates them) is verified as text-hashed.
+    FTT ftt; ftt.root.action = 0; ftt.root.text = "r";
+    FTTNode c; c.action = 1; c.tokens = {7, 8}; c.logprobs = {-0.5f, -0.25f}; c.logprob = -0.75f; c.length = 2;
+    ftt.root.children.push_back(c); c.tokens = {9}; ftt.root.children.push_back(c);
+    ftt.provenance["fta"] = "abc";
+    ftt.finalize();
+    check(ftt.metadata->scheme == hash_scheme, "finalize records the current hash scheme");
+    nlohmann::json j = nlohmann::json::parse(to_string(ftt));
+    check(j["metadata"]["scheme"] == static_cast<unsigned>(hash_scheme), "hash scheme serialized");
+
+    std::string const legacy = "d1983c9c1acd87d96e4efed74239378562a24613d5cdba7a671ef5c295045f29";
+    j["metadata"].erase("scheme");
+    j["metadata"]["hash"] = legacy;
+    auto old = from_string<FTT>(j.dump());
+    check(old->metadata->scheme == HashScheme::Text && old->metadata->hash == legacy,
+          "artifact stored without a scheme verifies under the text scheme");
+
+    j["metadata"]["scheme"] = static_cast<unsigned>(HashScheme::Binary);
+    bool threw = false;
+    try { from_string<FTT>(j.dump()); } catch (autocog::IntegrityError const &) { threw = true; } catch (...) {}
+    check(threw, "a hash is verified under its recorded scheme only");
+
+    j["metadata"]["scheme"] = 7;
+    threw = false;
+    try { from_string<FTT>(j.dump()); } catch (autocog::SchemaError const &) { threw = true; } catch (...) {}
+    check(threw, "unknown hash scheme throws SchemaError");
+  }
   {
     // SchemaError: an unknown discriminant tag during deserialization.
     bool threw = false;
@@ -9,9 +9,12 @@
 
 #include "autocog/utilities/exception.hxx"
 
+#include <atomic>
 #include <iostream>
 #include <memory>
 #include <string>
+#include <thread>
+#include <vector>
 
 namespace {
 
@@ -25,7 +28,9 @@ void check(bool ok, std::string const & what) {
 struct Fake : autocog::data::Base<Fake> {
   static constexpr char const * format = "fake";
   int value = 0;
-  std::string content_hash() const { return std::to_string(value); }
+  autocog::data::Digest content_hash(autocog::data::HashScheme const scheme) const {
+    return autocog::data::ContentHasher(scheme).put(static_cast<unsigned>(value)).digest();
+  }
 };
 
 std::unique_ptr<Fake> make_fake(int v) {
@@ -45,7 +50,7 @@ int main() {
   std::string const h1 = reg.add(make_fake(42));
   check(!h1.empty(), "add finalizes and returns a non-empty hash");
   check(reg.contains(h1), "contains(hash) is true after add");
-  check(reg.get(h1).value == 42, "get returns the stored artifact");
+  check(reg.get(h1)->value == 42, "get returns the stored artifact");
 
   std::string const h1b = reg.add(make_fake(42));
   check(h1b == h1, "identical content collapses onto the same hash");
@@ -70,6 +75,38 @@ int main() {
 
   check(reg.contains(h2), "an unrelated entry is unaffected by releases");
 
+  // A handle outlives the entry it was taken from.
+  auto const held = reg.get(h2);
+  reg.release(h2);
+  check(!reg.contains(h2), "entry is freed after the last holder releases (handle held)");
+  check(held->value == 7, "a handle from get stays valid after the entry is freed");
+
+  // Concurrent add/get/release over a few shared contents: every add is
+  // matched by one release, so the registry ends up empty.
+  {
+    int const n_threads = 8, n_rounds = 2000, n_values = 5;
+    std::atomic<int> bad{0};
+    std::vector<std::thread> threads;
+    for (int t = 0; t < n_threads; ++t)
+      threads.emplace_back([&, t] {
+        for (int i = 0; i < n_rounds; ++i) {
+          int const v = 100 + (t + i) % n_values;
+          std::string const h = reg.add(make_fake(v));
+          if (reg.get(h)->value != v) ++bad;
+          reg.release(h);
+        }
+      });
+    for (auto & th : threads) th.join();
+    check(bad == 0, "concurrent get returns the content added under its hash");
+    bool empty = true;
+    for (int v = 100; v < 100 + n_values; ++v) {
+      auto probe = make_fake(v);
+      probe->finalize();
+      empty = empty && !reg.contains(probe->metadata->hash);
+    }
+    check(empty, "concurrent adds and releases balance out");
+  }
+
   check(&autocog::data::datastore() == &autocog::data::datastore(),
         "datastore() returns a stable singleton");
 
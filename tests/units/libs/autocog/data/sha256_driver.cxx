@@ -0,0 +1,65 @@
+// Unit test for autocog::data::Sha256: every implementation available here
+// (portable, and the CPU's SHA extensions if any) against known vectors and
+// picosha2, across message lengths and update() chunkings. Returns non-zero if
+// any check fails.
+
+#include "autocog/data/sha256.hxx"
+#include "autocog/data/utility.hxx"
+
+#include "picosha2.h"
+
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+using autocog::data::Sha256;
+
+namespace {
+
+int failures = 0;
+void check(bool ok, std::string const & what) {
+  if (ok) std::cout << "ok   : " << what << "\n";
+  else  { std::cerr << "FAIL : " << what << "\n"; ++failures; }
+}
+
+std::string hex(Sha256 & h) { return autocog::data::to_hex(h.finish()); }
+
+}
+
+int main() {
+  std::vector<Sha256::Impl> impls{Sha256::Impl::Portable};
+  if (Sha256::best() != Sha256::Impl::Portable) impls.push_back(Sha256::best());
+
+  std::mt19937 rng(42);
+  std::string message(3000, '\0');
+  for (auto & c : message) c = static_cast<char>(rng());
+
+  for (Sha256::Impl const impl : impls) {
+    std::string const name = Sha256::impl_name(impl);
+    Sha256 h(impl);
+    check(hex(h) == "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855", name + ": empty message");
+    check(hex(h.update("abc")) == "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad", name + ": \"abc\"");
+    check(hex(h.update("abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq"))
+          == "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1", name + ": two-block message");
+
+    bool all = true;
+    for (size_t n = 0; n <= 300 && all; ++n) {
+      std::string const m = message.substr(0, n);
+      all = hex(h.update(m)) == picosha2::hash256_hex_string(m);
+    }
+    check(all, name + ": lengths 0..300 match picosha2");
+
+    bool chunked = true;
+    for (size_t chunk : {1, 7, 63, 64, 65, 1000}) {
+      for (size_t i = 0; i < message.size(); i += chunk)
+        h.update(message.data() + i, std::min(chunk, message.size() - i));
+      chunked = chunked && hex(h) == picosha2::hash256_hex_string(message);
+    }
+    check(chunked, name + ": chunked updates match one-shot");
+  }
+
+  std::cout << "sha256 implementation: " << Sha256::impl_name(Sha256::best()) << "\n";
+  std::cout << (failures ? "FAILURES\n" : "all sha256 checks passed\n");
+  return failures ? 1 : 0;
+}
@@ -27,7 +27,8 @@ namespace codec = autocog::codec;
 
 void print_usage(const char* program_name) {
     std::cerr << "Usage: " << program_name << " --fta <file> (--model <file> | --rng) --ftt <file>\n"
-              << "            [--seed N] [--ctx N]\n\n"
+              << "            [--seed N] [--ctx N] [--batch N] [--ubatch N] [--threads N]\n"
+              << "            [--early-stop N] [--mask-cache DIR]\n\n"
               << "Evaluate an FTA against a model and write the resulting FTT.\n\n"
               << "Options:\n"
               << "  --fta <file>          Input FTA JSON (required)\n"
@@ -36,6 +37,11 @@ void print_usage(const char* program_name) {
               << "  --ftt <file>          Output FTT JSON (required; /dev/stdout for stdout)\n"
               << "  --seed N              RNG seed (default: 42)\n"
               << "  --ctx N               Maximum context size for the model\n"
+              << "  --batch N             Tokens per decode call (prefill chunk; default: llama.cpp's)\n"
+              << "  --ubatch N            Tokens per compute micro-batch (default: llama.cpp's)\n"
+              << "  --threads N           Threads for prefill and generation (default: llama.cpp's)\n"
+              << "  --early-stop N        Stop once N complete paths beat every open one\n"
+              << "  --mask-cache DIR      Persist vocab masks under DIR (keyed by model hash)\n"
               << "  --verbose [LEVEL]     Log level (trace,debug,info,warn,error; default: debug)\n"
               << "  --version             Show version\n"
               << "  --build-info          Show build configuration\n"
@@ -44,10 +50,12 @@ void print_usage(const char* program_name) {
 }
 
 static int run(int argc, char** argv) {
-  std::string fta_file, ftt_file, model_path;
+  std::string fta_file, ftt_file, model_path, mask_cache;
   unsigned ctx_size = 4096;
   unsigned seed = 42;
   bool use_rng = false;
+  ModelConfig model_config;
+  EvaluationConfig config;
 
   autocog::init_console_logger();
 
@@ -62,6 +70,11 @@ static int run(int argc, char** argv) {
     if (arg == "--model" && i + 1 < argc) { model_path = argv[++i]; continue; }
     if (arg == "--seed"  && i + 1 < argc) { seed = std::stoul(argv[++i]); continue; }
     if (arg == "--ctx"   && i + 1 < argc) { ctx_size = std::stoi(argv[++i]); continue; }
+    if (arg == "--batch" && i + 1 < argc) { model_config.n_batch = std::stoul(argv[++i]); continue; }
+    if (arg == "--ubatch" && i + 1 < argc) { model_config.n_ubatch = std::stoul(argv[++i]); continue; }
+    if (arg == "--threads" && i + 1 < argc) { model_config.n_threads = std::stoi(argv[++i]); continue; }
+    if (arg == "--early-stop" && i + 1 < argc) { config.early_stop = std::stoul(argv[++i]); continue; }
+    if (arg == "--mask-cache" && i + 1 < argc) { mask_cache = argv[++i]; continue; }
     if (arg == "--verbose") {
       spdlog::level::level_enum lvl = spdlog::level::debug;
       if (i + 1 < argc && autocog::looks_like_level_token(argv[i + 1])) {
@@ -93,18 +106,30 @@ static int run(int argc, char** argv) {
     SPDLOG_LOGGER_DEBUG(autocog::log(), "Using built-in RNG model (Model #0)");
   } else {
     SPDLOG_LOGGER_DEBUG(autocog::log(), "Loading model from {} with {} tokens of context", model_path, ctx_size);
-    model_id = Manager::add_model(model_path, ctx_size);
+    model_id = Manager::add_model(model_path, ctx_size, model_config);
     SPDLOG_LOGGER_DEBUG(autocog::log(), "Model #{}", model_id);
   }
 
   Manager::get_model(model_id).set_seed(seed);
   SPDLOG_LOGGER_DEBUG(autocog::log(), "RNG seed: {}", seed);
 
+  if (!mask_cache.empty()) {
+    Manager::get_model(model_id).set_mask_cache(mask_cache);
+    SPDLOG_LOGGER_DEBUG(autocog::log(), "Vocab mask cache: \"{}\"", mask_cache);
+  }
+
   SPDLOG_LOGGER_DEBUG(autocog::log(), "FTA: \"{}\"", fta_file);
   auto fta = codec::from_file<data::FTA>(fta_file);
-  EvalID eval_id = Manager::add_eval(model_id, *fta);
+  EvalID eval_id = Manager::add_eval(model_id, *fta, config);
   Manager::advance(eval_id, std::nullopt);
 
+  auto const pc = Manager::get_model(model_id).prefix_cache_stats();
+  SPDLOG_LOGGER_DEBUG(autocog::log(), "Prefix cache: {} hits, {} misses, {} tokens reused, {} entries ({}/{} tokens)",
+                      pc.hits, pc.misses, pc.reused_tokens, pc.entries, pc.tokens, pc.budget);
+  auto const pf = Manager::get_model(model_id).prefill_stats();
+  SPDLOG_LOGGER_DEBUG(autocog::log(), "Prefill: {} tokens in {} chunks, {:.3f}s ({:.1f} tokens/s)",
+                      pf.tokens, pf.chunks, pf.seconds, pf.tokens_per_second());
+
   // The backend grows the tree with tokens during evaluation; fill each node's
   // text from its tokens in one post-generation pass (needs the model).
   data::FTT ftt = Manager::retrieve(eval_id);